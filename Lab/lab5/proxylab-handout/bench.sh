@@ -0,0 +1,139 @@
+#!/bin/bash
+#
+# bench.sh - Reproducible proxy benchmark: serves a generated object set
+#     from tiny and drives the proxy with loadgen, with a request mix
+#     skewed by popularity, in each connection mode, then prints the
+#     proxy's own statistics.
+#
+#     usage: ./bench.sh [-n requests] [-c concurrency] [-o objects]
+#                       [-z size_dist] [-s zipf_exponent] [-m modes]
+#                       [-S seed] [-- proxy_args...]
+#
+#     size_dist is fixed:SIZE, uniform:MIN:MAX, pareto:MIN:ALPHA or
+#         lognormal:MEDIAN:SIGMA, in bytes with an optional K or M suffix;
+#         pareto and lognormal sizes are capped at MAX_OBJECT
+#     zipf_exponent skews popularity: object k gets weight 1/k^s
+#         (0 = uniform)
+#     modes is a comma-separated list of close (a connection per
+#         request), keepalive and pipeline
+#     proxy_args replace the default "-c 64M -o 4M"
+#
+REQUESTS=20000
+CONCURRENCY=16
+OBJECTS=200
+SIZE_DIST="lognormal:8K:1.5"
+ZIPF=0.8
+MODES="close,keepalive,pipeline"
+SEED=1
+MAX_OBJECT=$(( 4 << 20 ))
+BENCH_DIR="bench"
+MIX_FILE=".bench-mix"
+
+while getopts "n:c:o:z:s:m:S:" opt; do
+    case ${opt} in
+        n) REQUESTS=${OPTARG} ;;
+        c) CONCURRENCY=${OPTARG} ;;
+        o) OBJECTS=${OPTARG} ;;
+        z) SIZE_DIST=${OPTARG} ;;
+        s) ZIPF=${OPTARG} ;;
+        m) MODES=${OPTARG} ;;
+        S) SEED=${OPTARG} ;;
+        *) echo "usage: $0 [-n requests] [-c concurrency] [-o objects] [-z size_dist]"
+           echo "          [-s zipf_exponent] [-m modes] [-S seed] [-- proxy_args...]"
+           exit 1 ;;
+    esac
+done
+shift $(( OPTIND - 1 ))
+PROXY_ARGS=${*:-"-c 64M -o 4M"}
+
+make -s proxy loadgen || exit 1
+if [ ! -x ./tiny/tiny ]; then
+    (cd ./tiny && make -s) || exit 1
+fi
+
+#
+# to_bytes - converts a size with an optional K or M suffix
+#
+function to_bytes {
+    case $1 in
+        *K|*k) echo $(( ${1%?} << 10 )) ;;
+        *M|*m) echo $(( ${1%?} << 20 )) ;;
+        *) echo $1 ;;
+    esac
+}
+
+# One size per object, drawn with a fixed seed so runs compare
+IFS=: read -r dist a b <<< "${SIZE_DIST}"
+a=`to_bytes ${a}`
+case ${dist} in
+    uniform|fixed) b=`to_bytes ${b:-${a}}` ;;
+    pareto|lognormal) ;;
+    *) echo "bench.sh: unknown size distribution ${dist}"; exit 1 ;;
+esac
+sizes=`awk -v n=${OBJECTS} -v seed=${SEED} -v dist=${dist} -v a=${a} -v b=${b} -v max=${MAX_OBJECT} 'BEGIN {
+    srand(seed)
+    for (i = 0; i < n; i++) {
+        if (dist == "fixed") {
+            size = a
+        } else if (dist == "uniform") {
+            size = a + int(rand() * (b - a + 1))
+        } else if (dist == "pareto") {
+            size = a / (1 - rand()) ^ (1 / b)
+        } else {
+            # Box-Muller
+            z = sqrt(-2 * log(1 - rand())) * cos(6.283185307 * rand())
+            size = a * exp(b * z)
+        }
+        size = int(size) < 1 ? 1 : int(size) > max ? max : int(size)
+        print size
+    }
+}'`
+
+rm -rf ./tiny/${BENCH_DIR}
+mkdir -p ./tiny/${BENCH_DIR}
+i=1
+total=0
+for size in ${sizes}; do
+    head -c ${size} /dev/urandom > ./tiny/${BENCH_DIR}/${i}.bin
+    total=$(( total + size ))
+    i=$(( i + 1 ))
+done
+
+tiny_port=`./free-port.sh`
+(cd ./tiny && exec ./tiny ${tiny_port} &> /dev/null) &
+tiny_pid=$!
+sleep 1
+
+proxy_port=`./free-port.sh`
+while [ "${proxy_port}" == "${tiny_port}" ]; do
+    proxy_port=`expr ${proxy_port} + 1`
+done
+./proxy -l off ${PROXY_ARGS} ${proxy_port} > /dev/null 2> .bench-stats &
+proxy_pid=$!
+trap 'kill ${proxy_pid} ${tiny_pid} 2> /dev/null; rm -rf ./tiny/${BENCH_DIR} ${MIX_FILE} .bench-stats' EXIT
+sleep 1
+
+# Object k is the k-th most popular
+awk -v n=${OBJECTS} -v s=${ZIPF} -v url="http://localhost:${tiny_port}/${BENCH_DIR}" 'BEGIN {
+    for (k = 1; k <= n; k++) {
+        printf "%.9f %s/%d.bin\n", 1 / k ^ s, url, k
+    }
+}' > ${MIX_FILE}
+
+echo "*** ${OBJECTS} objects, ${SIZE_DIST} sizes (${total} bytes), zipf ${ZIPF}, seed ${SEED}"
+echo "*** proxy ${PROXY_ARGS}"
+for mode in `echo ${MODES} | tr ',' ' '`; do
+    case ${mode} in
+        close) flags="" ;;
+        keepalive) flags="-k" ;;
+        pipeline) flags="-P 8" ;;
+        *) echo "bench.sh: unknown mode ${mode}"; exit 1 ;;
+    esac
+    echo "*** ${mode}"
+    ./loadgen ${flags} -c ${CONCURRENCY} -n ${REQUESTS} -f ${MIX_FILE} localhost ${proxy_port}
+done
+
+kill -USR1 ${proxy_pid}
+sleep 1
+echo "*** proxy statistics"
+cat .bench-stats
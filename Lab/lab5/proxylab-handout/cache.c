@@ -1,113 +1,728 @@
+#include <stdatomic.h>
 #include "csapp.h"
 #include "cache.h"
+#include "slab.h"
+#include "policy.h"
+#include "log.h"
+#include "compress.h"
 
-cache_entry *head;
-cache_entry *tail;
-int cache_size;
+cache_shard shards[CACHE_SHARDS];
 
-pthread_mutex_t cache_mutex;
+size_t cache_capacity;
+size_t cache_max_object;
+cache_policy *cache_policy_used;
 
-void cache_init()
+// Bytes cached or reserved by in-progress inserts, across all shards
+atomic_size_t cache_size;
+atomic_size_t cache_objects;
+
+// Bytes compression saves the objects cached, so capacity goes further
+atomic_size_t cache_saved;
+
+// Counters for cache_stats()
+atomic_ulong cache_hits;
+atomic_ulong cache_misses;
+atomic_ulong cache_evictions;
+atomic_ulong cache_evicted_bytes;
+atomic_ulong cache_rejections;
+atomic_ulong cache_coalesced;
+atomic_ulong cache_revalidated;
+atomic_ulong cache_revalidated_bytes;
+
+// Recency clock shared by all shards, so tails can be compared
+atomic_ulong cache_clock;
+
+// Concurrent misses for one key share a single fetch
+static cache_flight *flights[CACHE_FLIGHT_BUCKETS];
+static pthread_mutex_t flight_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Helper functions
+static cache_shard *shard_of(unsigned int hash);
+static cache_entry *lookup(char *key, unsigned int hash);
+static cache_flight **flight_slot(unsigned int hash, char *key);
+static void flight_release(cache_flight *flight);
+static int evict_one();
+static int admit(unsigned int hash);
+static cache_entry **bucket_slot(cache_shard *shard, unsigned int hash, char *key);
+static cache_entry *unlink_key(cache_shard *shard, unsigned int hash, char *key);
+static void bucket_resize(cache_shard *shard);
+static size_t effective_capacity();
+
+void cache_init(size_t capacity, size_t max_object, cache_policy *policy)
 {
-    head = NULL;
-    tail = NULL;
-    cache_size = 0;
+    cache_capacity = capacity;
+    cache_max_object = max_object < capacity ? max_object : capacity;
+    cache_policy_used = policy;
+
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        cache_shard *shard = &shards[i];
 
-    pthread_mutex_init(&cache_mutex, NULL);
+        shard->head = NULL;
+        shard->tail = NULL;
+        shard->nbuckets = CACHE_INIT_BUCKETS;
+        shard->nentries = 0;
+        shard->buckets = Calloc(shard->nbuckets, sizeof(cache_entry *));
+
+        pthread_rwlock_init(&shard->lock, NULL);
+        pthread_mutex_init(&shard->lru_mutex, NULL);
+    }
+
+    atomic_init(&cache_size, 0);
+    atomic_init(&cache_objects, 0);
+    atomic_init(&cache_saved, 0);
+    atomic_init(&cache_clock, 0);
+    atomic_init(&cache_hits, 0);
+    atomic_init(&cache_misses, 0);
+    atomic_init(&cache_evictions, 0);
+    atomic_init(&cache_evicted_bytes, 0);
+    atomic_init(&cache_rejections, 0);
+    atomic_init(&cache_coalesced, 0);
+    atomic_init(&cache_revalidated, 0);
+    atomic_init(&cache_revalidated_bytes, 0);
+
+    if (policy->init != NULL) {
+        policy->init(capacity);
+    }
 }
 
+// On a hit the entry is pinned and must be unpinned with cache_release()
 cache_entry *cache_find(char *key)
 {
-    pthread_mutex_lock(&cache_mutex);
-
-    cache_entry *curr = head;
-    while (curr != NULL) {
-        if (strcmp(curr->key, key) == 0) {
-            // Move to front
-            if (curr != head) {
-                curr->prev->next = curr->next;
-                if (curr != tail) {
-                    curr->next->prev = curr->prev;
-                } else {
-                    tail = curr->prev;
-                }
-                curr->prev = NULL;
-                curr->next = head;
-                head->prev = curr;
-                head = curr;
-            }
+    unsigned int hash = cache_hash(key);
 
-            printf("Cache hit!\n");
-            return curr;
-        }
-        curr = curr->next;
+    if (cache_policy_used->record != NULL) {
+        cache_policy_used->record(hash);
+    }
+
+    cache_entry *curr = lookup(key, hash);
+    if (curr != NULL) {
+        atomic_fetch_add(&cache_hits, 1);
+        log_debug("cache hit %s", key);
+    } else {
+        atomic_fetch_add(&cache_misses, 1);
     }
+    return curr;
+}
 
-    pthread_mutex_unlock(&cache_mutex);
+// cache_find() for the proxy's own lookups, which are neither counted as
+// client hits and misses nor recorded by the admission policy
+cache_entry *cache_lookup(char *key)
+{
+    return lookup(key, cache_hash(key));
+}
 
-    return NULL;
+// Drops one reference; the last one frees the entry
+void cache_release(cache_entry *entry)
+{
+    if (atomic_fetch_sub(&entry->refcnt, 1) == 1) {
+        slab_free(entry->value, entry->size);
+        slab_free(entry, sizeof(cache_entry) + strlen(entry->key) + 1);
+    }
 }
 
-void cache_insert(char *key, char *value, int size)
+// Takes ownership of value, a slab_alloc'd buffer of size bytes, and
+// replaces any older object under key. expires is when it goes stale,
+// 0 for never. Text is stored compressed if compression is on.
+void cache_insert(char *key, char *value, size_t size, time_t expires)
 {
-    pthread_mutex_lock(&cache_mutex);
+    unsigned int hash = cache_hash(key);
+    cache_shard *shard = shard_of(hash);
+    size_t plain_size = 0, packed_size;
+    unsigned int plain_head = 0;
+    char *packed;
+
+    if (compress_level > 0 &&
+        (packed = compress_object(value, size, &packed_size, &plain_size, &plain_head)) != NULL) {
+        slab_free(value, size);
+        value = packed;
+        size = packed_size;
+    }
+
+    // Charged for the whole slab blocks it takes, not just the bytes used.
+    // Rounding up can push an object within cache_max_object past the
+    // capacity, and no amount of eviction makes room for that.
+    size_t entry_size = sizeof(cache_entry) + strlen(key) + 1;
+    size_t charge = slab_charge(size) + slab_charge(entry_size);
+    if (charge > cache_capacity) {
+        slab_free(value, size);
+        return;
+    }
+
+    // The newer response wins, and the room the older one held counts
+    // before anything else is evicted for it. Readers still holding the
+    // old one keep it alive until they finish.
+    pthread_rwlock_wrlock(&shard->lock);
+    cache_entry *old = unlink_key(shard, hash, key);
+    pthread_rwlock_unlock(&shard->lock);
 
-    if (cache_size + size > MAX_CACHE_SIZE) {
-        cache_evict(size);
+    // The policy may refuse an object that would displace a more popular one
+    if (atomic_load(&cache_size) + charge > cache_capacity && !admit(hash)) {
+        atomic_fetch_add(&cache_rejections, 1);
+        slab_free(value, size);
+        if (old != NULL) {
+            cache_release(old);
+        }
+        return;
     }
 
-    cache_entry *entry = Malloc(sizeof(cache_entry));
-    entry->key = strdup(key);
-    entry->value = strdup(value);
+    // Reserve room first so concurrent inserts cannot overshoot together
+    atomic_fetch_add(&cache_size, charge);
+    if (atomic_load(&cache_size) > cache_capacity) {
+        cache_evict(0);
+    }
+
+    pthread_rwlock_wrlock(&shard->lock);
+
+    // Another insert of the same key may have landed in the meantime
+    cache_entry *raced = unlink_key(shard, hash, key);
+
+    // The key is stored inline after the entry
+    cache_entry *entry = slab_alloc(entry_size);
+    entry->key = strcpy((char *)(entry + 1), key);
+    entry->value = value;
     entry->size = size;
+    entry->charge = charge;
+    entry->plain_size = plain_size;
+    entry->plain_head = plain_head;
+    entry->hash = hash;
+    entry->stamp = cache_tick();
+    atomic_init(&entry->expires, expires);
+    atomic_init(&entry->refcnt, 1);
+    atomic_init(&entry->referenced, 0);
 
-    entry->prev = NULL;
-    entry->next = head;
-    if (head != NULL) {
-        head->prev = entry;
+    cache_lru_push_front(shard, entry);
+
+    cache_entry **slot = &shard->buckets[hash & (shard->nbuckets - 1)];
+    entry->hnext = *slot;
+    *slot = entry;
+    shard->nentries++;
+    if (shard->nentries > shard->nbuckets) {
+        bucket_resize(shard);
+    }
+    atomic_fetch_add(&cache_objects, 1);
+    if (plain_size != 0) {
+        atomic_fetch_add(&cache_saved, plain_size - size);
+    }
+
+    pthread_rwlock_unlock(&shard->lock);
+
+    if (old != NULL) {
+        cache_release(old);
+    }
+    if (raced != NULL) {
+        cache_release(raced);
+    }
+
+    log_debug("cached %s, %zu bytes", key, size);
+}
+
+// Drops the object under key, if any. Readers holding it keep it alive
+// until they finish.
+void cache_remove(char *key)
+{
+    unsigned int hash = cache_hash(key);
+    cache_shard *shard = shard_of(hash);
+
+    pthread_rwlock_wrlock(&shard->lock);
+    cache_entry *entry = unlink_key(shard, hash, key);
+    pthread_rwlock_unlock(&shard->lock);
+
+    if (entry != NULL) {
+        cache_release(entry);
+    }
+}
+
+// Whether entry has to be revalidated before it is served at now
+int cache_is_stale(cache_entry *entry, time_t now)
+{
+    long expires = atomic_load(&entry->expires);
+    return expires != 0 && now >= expires;
+}
+
+// Marks a stale entry fresh again after the origin confirmed it unchanged
+void cache_refresh(cache_entry *entry, time_t expires)
+{
+    atomic_store(&entry->expires, expires);
+    atomic_fetch_add(&cache_revalidated, 1);
+    atomic_fetch_add(&cache_revalidated_bytes, entry->size);
+}
+
+// Evicts least recently used entries until size more bytes fit
+void cache_evict(size_t size)
+{
+    log_debug("evicting for %zu bytes", size);
+
+    while (atomic_load(&cache_size) + size > cache_capacity) {
+        if (!evict_one()) {
+            break;
+        }
+    }
+
+    log_debug("cache size %zu", atomic_load(&cache_size));
+}
+
+// Joins the fetch in progress for key, or starts one. *leader tells the
+// caller whether it has to fetch the object and then call
+// cache_flight_end(); otherwise it calls cache_flight_wait().
+cache_flight *cache_flight_begin(char *key, int *leader)
+{
+    unsigned int hash = cache_hash(key);
+
+    pthread_mutex_lock(&flight_mutex);
+    cache_flight **slot = flight_slot(hash, key);
+    cache_flight *flight = *slot;
+    if (flight != NULL) {
+        flight->refcnt++;
+        *leader = 0;
+    } else {
+        // The key is stored inline after the flight
+        flight = Calloc(1, sizeof(cache_flight) + strlen(key) + 1);
+        flight->key = strcpy((char *)(flight + 1), key);
+        flight->hash = hash;
+        flight->refcnt = 1;
+        pthread_mutex_init(&flight->mutex, NULL);
+        pthread_cond_init(&flight->cond, NULL);
+        *slot = flight;
+        *leader = 1;
+    }
+    pthread_mutex_unlock(&flight_mutex);
+
+    return flight;
+}
+
+// Waits until the leader streams the object or gives up on it. If it
+// streams, sets *streaming and returns NULL; the caller tails the stream
+// with cache_flight_peek() and then calls cache_flight_leave(). Otherwise
+// the flight is left and the result is the object the leader cached,
+// pinned, or NULL if the caller has to fetch it after all.
+cache_entry *cache_flight_wait(cache_flight *flight, int *streaming)
+{
+    pthread_mutex_lock(&flight->mutex);
+    while (!flight->done && flight->head_len == 0) {
+        pthread_cond_wait(&flight->cond, &flight->mutex);
+    }
+    *streaming = flight->head_len > 0;
+    pthread_mutex_unlock(&flight->mutex);
+
+    if (*streaming) {
+        atomic_fetch_add(&cache_coalesced, 1);
+        return NULL;
+    }
+
+    cache_entry *entry = lookup(flight->key, flight->hash);
+    if (entry != NULL) {
+        atomic_fetch_add(&cache_coalesced, 1);
+    }
+    flight_release(flight);
+
+    return entry;
+}
+
+// Waits for stream bytes past off. Sets *p to the longest run of them in
+// one segment and returns its length, 0 once the whole object has been
+// read, or -1 if the leader gave up midway.
+ssize_t cache_flight_peek(cache_flight *flight, size_t off, char **p)
+{
+    ssize_t n;
+
+    pthread_mutex_lock(&flight->mutex);
+    while (!flight->done && flight->size <= off) {
+        pthread_cond_wait(&flight->cond, &flight->mutex);
+    }
+    if (flight->size > off) {
+        size_t left = CACHE_STREAM_SEGMENT - off % CACHE_STREAM_SEGMENT;
+        n = flight->size - off < left ? flight->size - off : left;
+        *p = flight->segments[off / CACHE_STREAM_SEGMENT] + off % CACHE_STREAM_SEGMENT;
     } else {
-        tail = entry;
+        n = flight->complete ? 0 : -1;
     }
-    head = entry;
+    pthread_mutex_unlock(&flight->mutex);
 
-    cache_size += size;
+    return n;
+}
 
-    pthread_mutex_unlock(&cache_mutex);
+// Drops a waiter's reference once it is done with the stream
+void cache_flight_leave(cache_flight *flight)
+{
+    flight_release(flight);
+}
+
+// Starts the stream with the response head, which must fit one segment,
+// and wakes the waiters
+void cache_flight_stream(cache_flight *flight, char *head, size_t head_len)
+{
+    cache_flight_append(flight, head, head_len);
 
-    printf("Cache miss!\n");
+    pthread_mutex_lock(&flight->mutex);
+    flight->head_len = head_len;
+    pthread_cond_broadcast(&flight->cond);
+    pthread_mutex_unlock(&flight->mutex);
 }
 
-void cache_evict(int size)
+// Publishes n more response bytes to the waiters. Only the leader writes,
+// so bytes are copied in past the published size without the lock.
+void cache_flight_append(cache_flight *flight, char *data, size_t n)
 {
-    printf("Evicting %d bytes\n", size);
-    
-    while (cache_size + size > MAX_CACHE_SIZE && tail != NULL) {
-        cache_entry *prev = tail->prev;
-        cache_size -= tail->size;
-        Free(tail->key);
-        Free(tail->value);
-        Free(tail);
-        tail = prev;
-        if (tail != NULL) {
-            tail->next = NULL;
-        } else {
-            head = NULL;
+    while (n > 0) {
+        size_t off = flight->size % CACHE_STREAM_SEGMENT;
+        size_t want = CACHE_STREAM_SEGMENT - off < n ? CACHE_STREAM_SEGMENT - off : n;
+        int seg = flight->size / CACHE_STREAM_SEGMENT;
+
+        if (off == 0) {
+            char *segment = slab_alloc(CACHE_STREAM_SEGMENT);
+            pthread_mutex_lock(&flight->mutex);
+            if (seg == flight->nsegments) {
+                flight->nsegments = flight->nsegments ? flight->nsegments * 2 : 4;
+                flight->segments = Realloc(flight->segments, flight->nsegments * sizeof(char *));
+            }
+            flight->segments[seg] = segment;
+            pthread_mutex_unlock(&flight->mutex);
         }
+        memcpy(flight->segments[seg] + off, data, want);
+
+        pthread_mutex_lock(&flight->mutex);
+        flight->size += want;
+        pthread_cond_broadcast(&flight->cond);
+        pthread_mutex_unlock(&flight->mutex);
+
+        data += want;
+        n -= want;
+    }
+}
+
+// Ends the flight if nobody is waiting on it, so the leader need not
+// stream the rest. Returns whether it did; the flight is then gone.
+int cache_flight_detach(cache_flight *flight)
+{
+    pthread_mutex_lock(&flight_mutex);
+    int alone = flight->refcnt == 1;
+    if (alone) {
+        *flight_slot(flight->hash, flight->key) = flight->next;
     }
+    pthread_mutex_unlock(&flight_mutex);
+
+    if (alone) {
+        flight_release(flight);
+    }
+    return alone;
+}
+
+// Called by the leader once the object is cached, or known not to be.
+// complete says whether the stream, if any, holds the whole object;
+// waiters on an incomplete one see it fail. Later misses for the key
+// start a new flight.
+void cache_flight_end(cache_flight *flight, int complete)
+{
+    pthread_mutex_lock(&flight_mutex);
+    *flight_slot(flight->hash, flight->key) = flight->next;
+    pthread_mutex_unlock(&flight_mutex);
+
+    pthread_mutex_lock(&flight->mutex);
+    flight->done = 1;
+    flight->complete = complete;
+    pthread_cond_broadcast(&flight->cond);
+    pthread_mutex_unlock(&flight->mutex);
 
-    printf("Cache size: %d\n", cache_size);
+    flight_release(flight);
+}
+
+// Prints one line summarizing occupancy and hit ratio
+void cache_stats(FILE *fp)
+{
+    unsigned long hits = atomic_load(&cache_hits);
+    unsigned long misses = atomic_load(&cache_misses);
+    unsigned long lookups = hits + misses;
+
+    fprintf(fp, "cache: policy=%s capacity=%zu max_object=%zu used=%zu saved=%zu effective_capacity=%zu "
+            "objects=%zu hits=%lu misses=%lu coalesced=%lu revalidated=%lu revalidated_bytes=%lu "
+            "evictions=%lu evicted_bytes=%lu rejections=%lu hit_ratio=%.2f%%\n",
+            cache_policy_used->name, cache_capacity, cache_max_object, atomic_load(&cache_size),
+            atomic_load(&cache_saved), effective_capacity(),
+            atomic_load(&cache_objects), hits, misses, atomic_load(&cache_coalesced),
+            atomic_load(&cache_revalidated), atomic_load(&cache_revalidated_bytes),
+            atomic_load(&cache_evictions), atomic_load(&cache_evicted_bytes), atomic_load(&cache_rejections),
+            lookups ? 100.0 * hits / lookups : 0.0);
+    fflush(fp);
+}
+
+// The same counters in the Prometheus text format
+void cache_metrics(FILE *fp)
+{
+    fprintf(fp, "# HELP proxy_cache_lookups_total Memory cache lookups, by result.\n");
+    fprintf(fp, "# TYPE proxy_cache_lookups_total counter\n");
+    fprintf(fp, "proxy_cache_lookups_total{result=\"hit\"} %lu\n", atomic_load(&cache_hits));
+    fprintf(fp, "proxy_cache_lookups_total{result=\"miss\"} %lu\n", atomic_load(&cache_misses));
+    fprintf(fp, "# HELP proxy_cache_evictions_total Objects evicted from the memory cache.\n");
+    fprintf(fp, "# TYPE proxy_cache_evictions_total counter\n");
+    fprintf(fp, "proxy_cache_evictions_total %lu\n", atomic_load(&cache_evictions));
+    fprintf(fp, "# HELP proxy_cache_evicted_bytes_total Bytes evicted from the memory cache.\n");
+    fprintf(fp, "# TYPE proxy_cache_evicted_bytes_total counter\n");
+    fprintf(fp, "proxy_cache_evicted_bytes_total %lu\n", atomic_load(&cache_evicted_bytes));
+    fprintf(fp, "# HELP proxy_cache_rejections_total Objects the admission policy kept out.\n");
+    fprintf(fp, "# TYPE proxy_cache_rejections_total counter\n");
+    fprintf(fp, "proxy_cache_rejections_total %lu\n", atomic_load(&cache_rejections));
+    fprintf(fp, "# HELP proxy_cache_used_bytes Bytes held by the memory cache.\n");
+    fprintf(fp, "# TYPE proxy_cache_used_bytes gauge\n");
+    fprintf(fp, "proxy_cache_used_bytes %zu\n", atomic_load(&cache_size));
+    fprintf(fp, "# HELP proxy_cache_capacity_bytes Memory cache capacity.\n");
+    fprintf(fp, "# TYPE proxy_cache_capacity_bytes gauge\n");
+    fprintf(fp, "proxy_cache_capacity_bytes %zu\n", cache_capacity);
+    fprintf(fp, "# HELP proxy_cache_saved_bytes Bytes compression saves the objects held.\n");
+    fprintf(fp, "# TYPE proxy_cache_saved_bytes gauge\n");
+    fprintf(fp, "proxy_cache_saved_bytes %zu\n", atomic_load(&cache_saved));
+    fprintf(fp, "# HELP proxy_cache_effective_capacity_bytes Uncompressed bytes the capacity holds at the current ratio.\n");
+    fprintf(fp, "# TYPE proxy_cache_effective_capacity_bytes gauge\n");
+    fprintf(fp, "proxy_cache_effective_capacity_bytes %zu\n", effective_capacity());
+    fprintf(fp, "# HELP proxy_cache_objects Objects held by the memory cache.\n");
+    fprintf(fp, "# TYPE proxy_cache_objects gauge\n");
+    fprintf(fp, "proxy_cache_objects %zu\n", atomic_load(&cache_objects));
 }
 
 void cache_free()
 {
-    cache_entry *curr = head;
-    while (curr != NULL) {
-        cache_entry *next = curr->next;
-        Free(curr->key);
-        Free(curr->value);
-        Free(curr);
-        curr = next;
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        cache_shard *shard = &shards[i];
+
+        cache_entry *curr = shard->head;
+        while (curr != NULL) {
+            cache_entry *next = curr->next;
+            cache_release(curr);
+            curr = next;
+        }
+        Free(shard->buckets);
+
+        pthread_rwlock_destroy(&shard->lock);
+        pthread_mutex_destroy(&shard->lru_mutex);
+    }
+
+    if (cache_policy_used->destroy != NULL) {
+        cache_policy_used->destroy();
+    }
+}
+
+// Next value of the recency clock shared by all shards
+unsigned long cache_tick()
+{
+    return atomic_fetch_add(&cache_clock, 1);
+}
+
+// FNV-1a
+unsigned int cache_hash(const char *key)
+{
+    unsigned int hash = 2166136261u;
+    while (*key) {
+        hash ^= (unsigned char)*key++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// ========================================================== //
+// ==================== Helper Functions ==================== //
+// ========================================================== //
+
+// Shards use the high bits of the hash, buckets the low bits
+static cache_shard *shard_of(unsigned int hash)
+{
+    return &shards[(hash >> 24) & (CACHE_SHARDS - 1)];
+}
+
+// Pins key's entry without touching the statistics. Returns NULL if absent.
+static cache_entry *lookup(char *key, unsigned int hash)
+{
+    cache_shard *shard = shard_of(hash);
+
+    pthread_rwlock_rdlock(&shard->lock);
+
+    cache_entry *curr = *bucket_slot(shard, hash, key);
+    if (curr != NULL) {
+        atomic_fetch_add(&curr->refcnt, 1);
+        cache_policy_used->touch(shard, curr);
+    }
+
+    pthread_rwlock_unlock(&shard->lock);
+
+    return curr;
+}
+
+// Takes the entry under key, if any, out of shard. Requires the shard
+// write lock; the caller drops the cache's reference.
+static cache_entry *unlink_key(cache_shard *shard, unsigned int hash, char *key)
+{
+    cache_entry **slot = bucket_slot(shard, hash, key);
+    cache_entry *entry = *slot;
+
+    if (entry != NULL) {
+        *slot = entry->hnext;
+        shard->nentries--;
+        cache_lru_unlink(shard, entry);
+        atomic_fetch_sub(&cache_size, entry->charge);
+        atomic_fetch_sub(&cache_objects, 1);
+        if (entry->plain_size != 0) {
+            atomic_fetch_sub(&cache_saved, entry->plain_size - entry->size);
+        }
+    }
+
+    return entry;
+}
+
+// Evicts the policy's victim. Returns 0 if every shard is empty.
+static int evict_one()
+{
+    cache_shard *shard = cache_policy_used->pick_shard(shards, CACHE_SHARDS);
+    if (shard == NULL) {
+        return 0;
+    }
+
+    pthread_rwlock_wrlock(&shard->lock);
+
+    // The shard may have emptied since it was picked
+    cache_entry *victim = NULL;
+    if (shard->tail != NULL) {
+        victim = cache_policy_used->pick_victim(shard);
+
+        *bucket_slot(shard, victim->hash, victim->key) = victim->hnext;
+        shard->nentries--;
+        cache_lru_unlink(shard, victim);
+        atomic_fetch_sub(&cache_size, victim->charge);
+        atomic_fetch_sub(&cache_objects, 1);
+        atomic_fetch_add(&cache_evictions, 1);
+        atomic_fetch_add(&cache_evicted_bytes, victim->size);
+        if (victim->plain_size != 0) {
+            atomic_fetch_sub(&cache_saved, victim->plain_size - victim->size);
+        }
+    }
+
+    pthread_rwlock_unlock(&shard->lock);
+
+    // Readers still streaming the victim keep it alive until they finish
+    if (victim != NULL) {
+        cache_release(victim);
+    }
+
+    return 1;
+}
+
+// Asks the policy whether an object with this hash may displace the next victim
+static int admit(unsigned int hash)
+{
+    if (cache_policy_used->admit == NULL) {
+        return 1;
+    }
+
+    cache_shard *shard = cache_policy_used->pick_shard(shards, CACHE_SHARDS);
+    if (shard == NULL) {
+        return 1;
+    }
+
+    pthread_rwlock_rdlock(&shard->lock);
+    pthread_mutex_lock(&shard->lru_mutex);
+    int empty = shard->tail == NULL;
+    unsigned int victim_hash = empty ? 0 : shard->tail->hash;
+    pthread_mutex_unlock(&shard->lru_mutex);
+    pthread_rwlock_unlock(&shard->lock);
+
+    return empty || cache_policy_used->admit(hash, victim_hash);
+}
+
+// Returns the link pointing at key's entry (or at the NULL ending its chain)
+static cache_entry **bucket_slot(cache_shard *shard, unsigned int hash, char *key)
+{
+    cache_entry **slot = &shard->buckets[hash & (shard->nbuckets - 1)];
+    while (*slot != NULL) {
+        if ((*slot)->hash == hash && strcmp((*slot)->key, key) == 0) {
+            break;
+        }
+        slot = &(*slot)->hnext;
+    }
+    return slot;
+}
+
+// Returns the link pointing at key's flight. Requires flight_mutex.
+static cache_flight **flight_slot(unsigned int hash, char *key)
+{
+    cache_flight **slot = &flights[hash & (CACHE_FLIGHT_BUCKETS - 1)];
+    while (*slot != NULL && ((*slot)->hash != hash || strcmp((*slot)->key, key) != 0)) {
+        slot = &(*slot)->next;
+    }
+    return slot;
+}
+
+// The last of the leader and its waiters frees the flight
+static void flight_release(cache_flight *flight)
+{
+    pthread_mutex_lock(&flight_mutex);
+    int last = --flight->refcnt == 0;
+    pthread_mutex_unlock(&flight_mutex);
+
+    if (last) {
+        for (int i = 0; i * CACHE_STREAM_SEGMENT < flight->size; i++) {
+            slab_free(flight->segments[i], CACHE_STREAM_SEGMENT);
+        }
+        Free(flight->segments);
+        pthread_mutex_destroy(&flight->mutex);
+        pthread_cond_destroy(&flight->cond);
+        Free(flight);
+    }
+}
+
+static void bucket_resize(cache_shard *shard)
+{
+    unsigned int new_nbuckets = shard->nbuckets * 2;
+    cache_entry **new_buckets = Calloc(new_nbuckets, sizeof(cache_entry *));
+
+    for (unsigned int i = 0; i < shard->nbuckets; i++) {
+        cache_entry *curr = shard->buckets[i];
+        while (curr != NULL) {
+            cache_entry *next = curr->hnext;
+            cache_entry **slot = &new_buckets[curr->hash & (new_nbuckets - 1)];
+            curr->hnext = *slot;
+            *slot = curr;
+            curr = next;
+        }
     }
 
-    pthread_mutex_destroy(&cache_mutex);
-}
\ No newline at end of file
+    Free(shard->buckets);
+    shard->buckets = new_buckets;
+    shard->nbuckets = new_nbuckets;
+}
+
+// Uncompressed bytes the capacity would hold if filled at the ratio of the
+// objects cached now
+static size_t effective_capacity()
+{
+    size_t used = atomic_load(&cache_size);
+
+    if (used == 0) {
+        return cache_capacity;
+    }
+    return cache_capacity * ((double)(used + atomic_load(&cache_saved)) / used);
+}
+
+// Unlinks entry from the shard's list; callers hold the lock that guards it
+void cache_lru_unlink(cache_shard *shard, cache_entry *entry)
+{
+    if (entry->prev != NULL) {
+        entry->prev->next = entry->next;
+    } else {
+        shard->head = entry->next;
+    }
+    if (entry->next != NULL) {
+        entry->next->prev = entry->prev;
+    } else {
+        shard->tail = entry->prev;
+    }
+}
+
+void cache_lru_push_front(cache_shard *shard, cache_entry *entry)
+{
+    entry->prev = NULL;
+    entry->next = shard->head;
+    if (shard->head != NULL) {
+        shard->head->prev = entry;
+    } else {
+        shard->tail = entry;
+    }
+    shard->head = entry;
+}
+
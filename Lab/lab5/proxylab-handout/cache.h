@@ -1,17 +1,97 @@
-/* Recommended max cache and object sizes */
+/* Recommended max cache and object sizes, used unless configured */
 #define MAX_CACHE_SIZE 10970
 #define MAX_OBJECT_SIZE 10970
 
+/* Number of independently locked shards (power of two, at most 256) */
+#define CACHE_SHARDS 16
+
+/* Initial number of hash buckets per shard (power of two) */
+#define CACHE_INIT_BUCKETS 16
+
+/* Hash buckets for fetches in progress (power of two) */
+#define CACHE_FLIGHT_BUCKETS 64
+
+/* Waiters tail a fetch in progress through a stream of fixed segments */
+#define CACHE_STREAM_SEGMENT (64 * 1024)
+
+/* Largest response held in a stream for waiters */
+#define CACHE_STREAM_MAX (64 * 1024 * 1024)
+
 typedef struct cache_entry {
     char *key;
-    char *value;
-    int size;
-    struct cache_entry *prev;
+    char *value;                // Raw response bytes, not NUL-terminated
+    size_t size;
+    size_t charge;              // Memory held, value and entry, by slab class
+    size_t plain_size;          // Size uncompressed, 0 if stored as it is
+    unsigned int plain_head;    // Head bytes the compressed form shares with it
+    unsigned int hash;          // Precomputed hash of key
+    unsigned long stamp;        // Last use, for comparing shard tails
+    _Atomic long expires;       // Stale from then on, 0 if never
+    _Atomic int refcnt;         // Held by the cache and by every reader
+    _Atomic int referenced;     // CLOCK reference bit
+    struct cache_entry *prev;   // LRU list
     struct cache_entry *next;
+    struct cache_entry *hnext;  // Hash bucket chain
 } cache_entry;
 
-void cache_init();
+typedef struct cache_shard {
+    pthread_rwlock_t lock;      // Readers share it for lookups, writers insert/evict
+    pthread_mutex_t lru_mutex;  // Serializes list updates among readers
+    cache_entry *head;
+    cache_entry *tail;
+    cache_entry **buckets;
+    unsigned int nbuckets;
+    unsigned int nentries;
+} cache_shard;
+
+/* A fetch in progress that concurrent misses for the same key wait on */
+typedef struct cache_flight {
+    char *key;
+    unsigned int hash;
+    int refcnt;                 // Leader and waiters, under the table mutex
+    struct cache_flight *next;
+
+    pthread_mutex_t mutex;      // Guards the rest
+    pthread_cond_t cond;        // Signalled as the stream grows or ends
+    int done;                   // The leader has finished or given up
+    int complete;               // The stream holds the whole object
+    size_t head_len;            // 0 until the leader starts streaming
+    size_t size;                // Stream bytes published so far
+    char **segments;            // Published bytes never move or change
+    int nsegments;
+} cache_flight;
+
+struct cache_policy;
+
+/* Limits and policy chosen at cache_init() */
+extern size_t cache_capacity;
+extern size_t cache_max_object;
+extern struct cache_policy *cache_policy_used;
+
+void cache_init(size_t capacity, size_t max_object, struct cache_policy *policy);
 cache_entry *cache_find(char *key);
-void cache_insert(char *key, char *value, int size);
-void cache_evict(int size);
-void cache_free();
\ No newline at end of file
+cache_entry *cache_lookup(char *key);
+void cache_release(cache_entry *entry);
+void cache_insert(char *key, char *value, size_t size, time_t expires);
+void cache_remove(char *key);
+int cache_is_stale(cache_entry *entry, time_t now);
+void cache_refresh(cache_entry *entry, time_t expires);
+void cache_evict(size_t size);
+cache_flight *cache_flight_begin(char *key, int *leader);
+cache_entry *cache_flight_wait(cache_flight *flight, int *streaming);
+ssize_t cache_flight_peek(cache_flight *flight, size_t off, char **p);
+void cache_flight_leave(cache_flight *flight);
+void cache_flight_stream(cache_flight *flight, char *head, size_t head_len);
+void cache_flight_append(cache_flight *flight, char *data, size_t n);
+int cache_flight_detach(cache_flight *flight);
+void cache_flight_end(cache_flight *flight, int complete);
+void cache_stats(FILE *fp);
+void cache_metrics(FILE *fp);
+void cache_free();
+
+unsigned int cache_hash(const char *key);
+unsigned long cache_tick();
+
+/* List primitives for eviction policies */
+void cache_lru_unlink(cache_shard *shard, cache_entry *entry);
+void cache_lru_push_front(cache_shard *shard, cache_entry *entry);
@@ -0,0 +1,288 @@
+/*
+ * cachebench.c - Microbenchmark for the proxy object cache
+ *
+ * Default mode:
+ * 1. Fills the cache with n objects and measures the average cost of a
+ *    cache_find() hit for n = 10 .. 100000.
+ * 2. Measures aggregate hit throughput with 1, 2, 4, ... threads looking
+ *    up random objects concurrently.
+ *
+ * Replay mode (-r or -S) feeds a URI stream through the cache once per
+ * eviction policy and compares hit ratios. Each trace line holds a URI
+ * (the first token containing "://", so proxy request lines work as is)
+ * optionally followed by the object size in bytes.
+ *
+ * usage: ./cachebench [-n lookups] [-t max threads] [-p policy]
+ *                     [-r trace | -S] [-c cache_size] [-s object_size]
+ */
+#include <time.h>
+#include "csapp.h"
+#include "cache.h"
+#include "policy.h"
+#include "slab.h"
+
+#define MAX_ENTRIES 100000
+#define LOAD_ENTRIES 10000
+#define DEFAULT_LOOKUPS 1000000
+
+/* Large enough to hold every benchmark object */
+#define BENCH_CACHE_SIZE (1UL << 30)
+
+/* Replay defaults */
+#define REPLAY_CACHE_SIZE (256 * 1024)
+#define REPLAY_OBJECT_SIZE 1024
+
+/* Synthetic workload: a skewed hot set interrupted by crawler scans */
+#define SYNTH_REQUESTS 200000
+#define SYNTH_HOT_OBJECTS 1000
+#define SYNTH_SCAN_EVERY 20000
+#define SYNTH_SCAN_LENGTH 5000
+
+typedef struct trace_req {
+    char *uri;
+    size_t size;
+} trace_req;
+
+static char keys[MAX_ENTRIES][64];
+static int lookups = DEFAULT_LOOKUPS;
+
+static trace_req *trace;
+static int trace_len, trace_cap;
+
+static double now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Performs lookups random hits among the first n keys
+static void run_lookups(int n, unsigned int seed)
+{
+    for (int i = 0; i < lookups; i++) {
+        seed = seed * 1103515245 + 12345;
+        cache_entry *entry = cache_find(keys[(seed >> 8) % n]);
+        if (entry == NULL) {
+            app_error("cachebench: unexpected miss");
+        }
+        cache_release(entry);
+    }
+}
+
+static void *lookup_thread(void *vargp)
+{
+    run_lookups(LOAD_ENTRIES, (unsigned int)(long)vargp);
+    return NULL;
+}
+
+static void bench_lookups(cache_policy *policy, int max_threads)
+{
+    int sizes[] = {10, 100, 1000, 10000, 100000};
+    pthread_t tids[256];
+
+    for (int i = 0; i < MAX_ENTRIES; i++) {
+        sprintf(keys[i], "http://bench.local:8080/objects/%d.html", i);
+    }
+
+    // Lookup cost versus number of cached objects
+    fprintf(stderr, "%10s %12s %14s\n", "entries", "lookups", "ns/lookup");
+    for (int s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        int n = sizes[s];
+
+        cache_init(BENCH_CACHE_SIZE, BENCH_CACHE_SIZE, policy);
+        for (int i = 0; i < n; i++) {
+            cache_insert(keys[i], slab_alloc(1), 1, 0);
+        }
+
+        double start = now_ns();
+        run_lookups(n, 15213);
+        double elapsed = now_ns() - start;
+
+        fprintf(stderr, "%10d %12d %14.1f\n", n, lookups, elapsed / lookups);
+        cache_free();
+    }
+
+    // Hit throughput versus number of threads
+    cache_init(BENCH_CACHE_SIZE, BENCH_CACHE_SIZE, policy);
+    for (int i = 0; i < LOAD_ENTRIES; i++) {
+        cache_insert(keys[i], slab_alloc(1), 1, 0);
+    }
+
+    fprintf(stderr, "\n%10s %12s %14s\n", "threads", "lookups", "Mhits/s");
+    for (int t = 1; t <= max_threads; t *= 2) {
+        double start = now_ns();
+        for (int i = 0; i < t; i++) {
+            Pthread_create(&tids[i], NULL, lookup_thread, (void *)(long)(i + 1));
+        }
+        for (int i = 0; i < t; i++) {
+            Pthread_join(tids[i], NULL);
+        }
+        double elapsed = now_ns() - start;
+
+        fprintf(stderr, "%10d %12d %14.2f\n", t, t * lookups, t * lookups / elapsed * 1e3);
+    }
+    cache_free();
+}
+
+static void trace_add(const char *uri, size_t size)
+{
+    if (trace_len == trace_cap) {
+        trace_cap = trace_cap ? trace_cap * 2 : 1024;
+        trace = Realloc(trace, trace_cap * sizeof(trace_req));
+    }
+    trace[trace_len].uri = strdup(uri);
+    trace[trace_len].size = size;
+    trace_len++;
+}
+
+static void trace_load(const char *path, size_t default_size)
+{
+    char line[MAXLINE];
+    FILE *fp = strcmp(path, "-") == 0 ? stdin : Fopen(path, "r");
+
+    while (Fgets(line, MAXLINE, fp) != NULL) {
+        char *save, *uri = NULL, *tok = strtok_r(line, " \t\r\n", &save);
+        size_t size = default_size;
+
+        for (; tok != NULL; tok = strtok_r(NULL, " \t\r\n", &save)) {
+            if (uri == NULL && strstr(tok, "://") != NULL) {
+                uri = tok;
+            } else if (uri != NULL && isdigit((unsigned char)*tok)) {
+                size = strtoull(tok, NULL, 10);
+                break;
+            }
+        }
+        if (uri != NULL && size > 0) {
+            trace_add(uri, size);
+        }
+    }
+
+    if (fp != stdin) {
+        Fclose(fp);
+    }
+}
+
+static void trace_synthesize(size_t size)
+{
+    char uri[MAXLINE];
+    unsigned int seed = 15213;
+    int scanned = 0;
+
+    for (int i = 0; i < SYNTH_REQUESTS; i++) {
+        if (i % SYNTH_SCAN_EVERY == SYNTH_SCAN_EVERY - 1) {
+            for (int j = 0; j < SYNTH_SCAN_LENGTH; j++) {
+                sprintf(uri, "http://crawl.local/page/%d", scanned++);
+                trace_add(uri, size);
+            }
+        }
+
+        // Squaring a uniform draw skews requests towards low object ids
+        seed = seed * 1103515245 + 12345;
+        double u = (seed >> 8) / (double)(1 << 24);
+        sprintf(uri, "http://hot.local/object/%d", (int)(u * u * SYNTH_HOT_OBJECTS));
+        trace_add(uri, size);
+    }
+}
+
+static void replay(cache_policy *policy, size_t capacity)
+{
+    unsigned long hits = 0;
+    size_t hit_bytes = 0, total_bytes = 0;
+
+    cache_init(capacity, capacity, policy);
+
+    double start = now_ns();
+    for (int i = 0; i < trace_len; i++) {
+        cache_entry *entry = cache_find(trace[i].uri);
+        if (entry != NULL) {
+            hits++;
+            hit_bytes += entry->size;
+            cache_release(entry);
+        } else if (trace[i].size <= cache_max_object) {
+            cache_insert(trace[i].uri, slab_alloc(trace[i].size), trace[i].size, 0);
+        }
+        total_bytes += trace[i].size;
+    }
+    double elapsed = now_ns() - start;
+
+    fprintf(stderr, "%10s %12d %11.2f%% %11.2f%% %12.1f\n", policy->name, trace_len,
+            100.0 * hits / trace_len, 100.0 * hit_bytes / total_bytes,
+            elapsed / trace_len);
+    cache_free();
+}
+
+int main(int argc, char *argv[])
+{
+    int opt, synthetic = 0;
+    int max_threads = 2 * sysconf(_SC_NPROCESSORS_ONLN);
+    char *trace_path = NULL;
+    size_t capacity = REPLAY_CACHE_SIZE, object_size = REPLAY_OBJECT_SIZE;
+    cache_policy *policy = NULL;
+    cache_policy *all[] = {&lru_policy, &clock_policy, &tinylfu_policy};
+
+    while ((opt = getopt(argc, argv, "n:t:p:r:Sc:s:")) != -1) {
+        switch (opt) {
+        case 'n':
+            lookups = atoi(optarg);
+            break;
+        case 't':
+            max_threads = atoi(optarg);
+            break;
+        case 'p':
+            if ((policy = policy_lookup(optarg)) == NULL) {
+                app_error("cachebench: unknown policy");
+            }
+            break;
+        case 'r':
+            trace_path = optarg;
+            break;
+        case 'S':
+            synthetic = 1;
+            break;
+        case 'c':
+            capacity = strtoull(optarg, NULL, 10);
+            break;
+        case 's':
+            object_size = strtoull(optarg, NULL, 10);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-n lookups] [-t max threads] [-p policy] "
+                    "[-r trace | -S] [-c cache_size] [-s object_size]\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (max_threads > 256) {
+        max_threads = 256;
+    }
+
+    // The cache reports hits and misses on stdout
+    if (freopen("/dev/null", "w", stdout) == NULL) {
+        unix_error("freopen error");
+    }
+
+    slab_init();
+
+    if (trace_path == NULL && !synthetic) {
+        bench_lookups(policy != NULL ? policy : &lru_policy, max_threads);
+        return 0;
+    }
+
+    if (synthetic) {
+        trace_synthesize(object_size);
+    } else {
+        trace_load(trace_path, object_size);
+    }
+    if (trace_len == 0) {
+        app_error("cachebench: empty trace");
+    }
+
+    fprintf(stderr, "capacity %zu bytes\n", capacity);
+    fprintf(stderr, "%10s %12s %12s %12s %12s\n", "policy", "requests", "hit ratio", "byte ratio", "ns/request");
+    for (int i = 0; i < sizeof(all) / sizeof(all[0]); i++) {
+        if (policy == NULL || policy == all[i]) {
+            replay(all[i], capacity);
+        }
+    }
+
+    return 0;
+}
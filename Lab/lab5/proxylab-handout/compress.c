@@ -0,0 +1,395 @@
+/*
+ * compress.c - gzip storage for cached text objects
+ *
+ * A text object is cached as the gzip-encoded response a client sending
+ * "Accept-Encoding: gzip" gets as it is. Both forms share the original
+ * head minus its ETag and Content-Length, plus a Vary header, so the plain
+ * one is rebuilt on demand:
+ *
+ *     stored:  head, Vary: Accept-Encoding, Content-Encoding: gzip,
+ *              ETag: "<tag>-gzip", Content-Length: <packed>, empty line,
+ *              gzip body
+ *     plain:   head, Vary: Accept-Encoding, ETag: "<tag>",
+ *              Content-Length: <length>, empty line, body
+ */
+#include <stdatomic.h>
+#include <zlib.h>
+#include "csapp.h"
+#include "cache.h"
+#include "http.h"
+#include "slab.h"
+#include "compress.h"
+
+int compress_level = 0;
+
+// Counters for compress_stats()
+atomic_ulong compress_objects;          // Objects stored compressed
+atomic_ulong compress_skipped;          // Text objects that did not shrink enough
+atomic_ulong compress_in_bytes;         // Bodies before and after, over compress_objects
+atomic_ulong compress_out_bytes;
+atomic_ulong compress_ns;               // CPU time deflating, skipped objects included
+atomic_ulong compress_expansions;       // Hits inflated for clients without gzip
+atomic_ulong compress_expand_ns;
+atomic_ulong compress_passthrough;      // Hits sent still compressed
+
+// Added to the head both forms share
+static const char *vary_hdr = "Vary: Accept-Encoding\r\n";
+
+// Added to the head of a compressed object, ahead of its ETag and
+// Content-Length
+static const char *packed_hdrs = "Content-Encoding: gzip\r\n";
+
+// Helper functions
+static long copy_head(const char *value, long head_end, char *dst, const char **etag, size_t *etag_len);
+static size_t etag_line(const char *etag, size_t len, const char *suffix, char *dst);
+static const char *packed_etag(const char *value, size_t size, unsigned int shared, size_t *len);
+static int is_text(const char *type, size_t len);
+static long long cpu_ns();
+
+// Compresses a cached response whose body is text, framed by
+// Content-Length and not already encoded. Returns the compressed object in
+// a slab buffer of *packed_size bytes, its first *shared bytes being the
+// head both forms have in common, or NULL to store value as it is.
+// *plain_size is the size compress_expand() rebuilds, which may differ
+// from size as the Content-Length line is written anew.
+char *compress_object(const char *value, size_t size, size_t *packed_size, size_t *plain_size,
+                      unsigned int *shared)
+{
+    http_response resp;
+    long head_end, head_len;
+    size_t body, body_len, cap, len, etag_len, packed_len;
+    const char *etag;
+    char *out, line[64];
+    z_stream zs;
+    long long start;
+    int n;
+
+    if (size < COMPRESS_MIN_SIZE || (head_end = http_parse_response_head(value, size, &resp)) < 0 ||
+        resp.status != 200 || resp.chunked || memcmp(value + head_end, "\r\n", 2) != 0) {
+        return NULL;
+    }
+    body = head_end + 2;
+    body_len = size - body;
+    if (body_len < COMPRESS_MIN_SIZE || resp.content_length != body_len) {
+        return NULL;
+    }
+
+    start = cpu_ns();
+    memset(&zs, 0, sizeof(zs));
+    if (deflateInit2(&zs, compress_level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return NULL;
+    }
+
+    // The gzip body goes after room for the longest Content-Length line,
+    // and moves down once its length is known
+    cap = head_end + strlen(vary_hdr) + strlen(packed_hdrs) + strlen(COMPRESS_ETAG_SUFFIX) + sizeof(line) +
+          deflateBound(&zs, body_len);
+    out = slab_alloc(cap);
+    if ((head_len = copy_head(value, head_end, out, &etag, &etag_len)) < 0) {
+        deflateEnd(&zs);
+        slab_free(out, cap);
+        return NULL;
+    }
+    packed_len = strlen(packed_hdrs) + (etag != NULL ? etag_line(etag, etag_len, COMPRESS_ETAG_SUFFIX, NULL) : 0);
+    len = head_len + packed_len + sizeof(line);
+
+    zs.next_in = (Bytef *)value + body;
+    zs.avail_in = body_len;
+    zs.next_out = (Bytef *)out + len;
+    zs.avail_out = cap - len;
+    if (deflate(&zs, Z_FINISH) != Z_STREAM_END ||
+        zs.total_out > body_len - body_len / COMPRESS_MIN_SAVING) {
+        deflateEnd(&zs);
+        slab_free(out, cap);
+        atomic_fetch_add(&compress_skipped, 1);
+        atomic_fetch_add(&compress_ns, cpu_ns() - start);
+        return NULL;
+    }
+    deflateEnd(&zs);
+
+    memcpy(out + head_len, packed_hdrs, strlen(packed_hdrs));
+    if (etag != NULL) {
+        etag_line(etag, etag_len, COMPRESS_ETAG_SUFFIX, out + head_len + strlen(packed_hdrs));
+    }
+    n = snprintf(line, sizeof(line), "Content-Length: %lu\r\n\r\n", zs.total_out);
+    memcpy(out + head_len + packed_len, line, n);
+    memmove(out + head_len + packed_len + n, out + len, zs.total_out);
+    *packed_size = head_len + packed_len + n + zs.total_out;
+    *shared = head_len;
+    *plain_size = head_len + (etag != NULL ? etag_line(etag, etag_len, "", NULL) : 0) +
+                  snprintf(line, sizeof(line), "Content-Length: %zu\r\n\r\n", body_len) + body_len;
+
+    atomic_fetch_add(&compress_objects, 1);
+    atomic_fetch_add(&compress_in_bytes, body_len);
+    atomic_fetch_add(&compress_out_bytes, zs.total_out);
+    atomic_fetch_add(&compress_ns, cpu_ns() - start);
+    return slab_realloc(out, cap, *packed_size);
+}
+
+// Rebuilds the plain response, plain_size bytes, from an object
+// compress_object() made. Returns it in a slab buffer, or NULL if the
+// object is corrupt.
+char *compress_expand(const char *value, size_t size, unsigned int shared, size_t plain_size)
+{
+    http_response resp;
+    size_t body_len, len, etag_len = 0, etag_plain = 0;
+    const char *etag;
+    char *plain, line[64];
+    const unsigned char *trailer = (const unsigned char *)value + size - 4;
+    z_stream zs;
+    long long start = cpu_ns();
+    int n, rc;
+
+    // The gzip trailer ends with the body length, modulo 2^32
+    if (http_parse_response_head(value, size, &resp) < 0 || resp.content_length < 4 || resp.content_length > size) {
+        return NULL;
+    }
+    body_len = trailer[0] | trailer[1] << 8 | trailer[2] << 16 | (size_t)trailer[3] << 24;
+    n = snprintf(line, sizeof(line), "Content-Length: %zu\r\n\r\n", body_len);
+
+    // The plain form's ETag is the stored one less its suffix
+    if ((etag = packed_etag(value, size, shared, &etag_len)) != NULL) {
+        size_t m = strlen(COMPRESS_ETAG_SUFFIX);
+        if (etag_len < m + 2 || memcmp(etag + etag_len - m - 1, COMPRESS_ETAG_SUFFIX, m) != 0) {
+            return NULL;
+        }
+        etag_len -= m;
+        etag_plain = etag_line(etag, etag_len, "", NULL);
+    }
+    len = shared + etag_plain + n;
+    if (len + body_len != plain_size) {
+        return NULL;
+    }
+
+    plain = slab_alloc(plain_size);
+    memcpy(plain, value, shared);
+    if (etag != NULL) {
+        etag_line(etag, etag_len, "", plain + shared);
+    }
+    memcpy(plain + shared + etag_plain, line, n);
+
+    memset(&zs, 0, sizeof(zs));
+    if (inflateInit2(&zs, 15 + 16) != Z_OK) {
+        slab_free(plain, plain_size);
+        return NULL;
+    }
+    zs.next_in = (Bytef *)value + size - resp.content_length;
+    zs.avail_in = resp.content_length;
+    zs.next_out = (Bytef *)plain + len;
+    zs.avail_out = body_len;
+    rc = inflate(&zs, Z_FINISH);
+    inflateEnd(&zs);
+    if (rc != Z_STREAM_END || zs.total_out != body_len) {
+        slab_free(plain, plain_size);
+        return NULL;
+    }
+
+    atomic_fetch_add(&compress_expansions, 1);
+    atomic_fetch_add(&compress_expand_ns, cpu_ns() - start);
+    return plain;
+}
+
+// The response to send for a pinned entry: as stored, or expanded for a
+// client that cannot take gzip. Returns NULL if it cannot be expanded.
+// Hand the result back with compress_close().
+char *compress_open(cache_entry *entry, int accept_gzip, size_t *size)
+{
+    if (entry->plain_size == 0) {
+        *size = entry->size;
+        return entry->value;
+    }
+    if (accept_gzip) {
+        atomic_fetch_add(&compress_passthrough, 1);
+        *size = entry->size;
+        return entry->value;
+    }
+
+    *size = entry->plain_size;
+    return compress_expand(entry->value, entry->size, entry->plain_head, entry->plain_size);
+}
+
+void compress_close(cache_entry *entry, char *value, size_t size)
+{
+    if (value != entry->value) {
+        slab_free(value, size);
+    }
+}
+
+// Lays out the header lines revalidating entry with the origin, which
+// knows the ETag of the plain form only. Returns their length, 0 if the
+// entry has no validators or they do not fit.
+size_t compress_validators(cache_entry *entry, char *buf, size_t size)
+{
+    size_t n = http_format_validators(entry->value, entry->size, buf, size);
+    size_t m = strlen(COMPRESS_ETAG_SUFFIX);
+    char *suffix;
+
+    if (entry->plain_size != 0 && n > 0 && (suffix = strstr(buf, COMPRESS_ETAG_SUFFIX "\"")) != NULL) {
+        memmove(suffix, suffix + m, buf + n + 1 - (suffix + m));
+        n -= m;
+    }
+    return n;
+}
+
+// Prints one line with the space saved and the CPU time it cost
+void compress_stats(FILE *fp)
+{
+    if (compress_level == 0) {
+        return;
+    }
+
+    unsigned long objects = atomic_load(&compress_objects);
+    unsigned long skipped = atomic_load(&compress_skipped);
+    unsigned long in = atomic_load(&compress_in_bytes);
+    unsigned long out = atomic_load(&compress_out_bytes);
+    unsigned long expansions = atomic_load(&compress_expansions);
+
+    fprintf(fp, "compress: level=%d objects=%lu skipped=%lu in=%lu out=%lu ratio=%.2f "
+            "compress_cpu=%.1fus/object expansions=%lu expand_cpu=%.1fus/expansion passthrough=%lu\n",
+            compress_level, objects, skipped, in, out, out > 0 ? (double)in / out : 1.0,
+            objects + skipped > 0 ? atomic_load(&compress_ns) / 1000.0 / (objects + skipped) : 0.0,
+            expansions, expansions > 0 ? atomic_load(&compress_expand_ns) / 1000.0 / expansions : 0.0,
+            atomic_load(&compress_passthrough));
+}
+
+// The same counters in the Prometheus text format
+void compress_metrics(FILE *fp)
+{
+    if (compress_level == 0) {
+        return;
+    }
+
+    fprintf(fp, "# HELP proxy_compress_objects_total Objects cached compressed, or tried and stored as they are.\n");
+    fprintf(fp, "# TYPE proxy_compress_objects_total counter\n");
+    fprintf(fp, "proxy_compress_objects_total{result=\"compressed\"} %lu\n", atomic_load(&compress_objects));
+    fprintf(fp, "proxy_compress_objects_total{result=\"skipped\"} %lu\n", atomic_load(&compress_skipped));
+    fprintf(fp, "# HELP proxy_compress_bytes_total Body bytes of compressed objects, before and after.\n");
+    fprintf(fp, "# TYPE proxy_compress_bytes_total counter\n");
+    fprintf(fp, "proxy_compress_bytes_total{form=\"plain\"} %lu\n", atomic_load(&compress_in_bytes));
+    fprintf(fp, "proxy_compress_bytes_total{form=\"gzip\"} %lu\n", atomic_load(&compress_out_bytes));
+    fprintf(fp, "# HELP proxy_compress_hits_total Hits on compressed objects, by how they were sent.\n");
+    fprintf(fp, "# TYPE proxy_compress_hits_total counter\n");
+    fprintf(fp, "proxy_compress_hits_total{form=\"gzip\"} %lu\n", atomic_load(&compress_passthrough));
+    fprintf(fp, "proxy_compress_hits_total{form=\"plain\"} %lu\n", atomic_load(&compress_expansions));
+    fprintf(fp, "# HELP proxy_compress_cpu_seconds_total CPU time spent compressing and expanding.\n");
+    fprintf(fp, "# TYPE proxy_compress_cpu_seconds_total counter\n");
+    fprintf(fp, "proxy_compress_cpu_seconds_total{op=\"compress\"} %.6f\n", atomic_load(&compress_ns) / 1e9);
+    fprintf(fp, "proxy_compress_cpu_seconds_total{op=\"expand\"} %.6f\n", atomic_load(&compress_expand_ns) / 1e9);
+}
+
+// ========================================================== //
+// ==================== Helper Functions ==================== //
+// ========================================================== //
+
+// Copies the head up to head_end, less its ETag and Content-Length, to
+// dst and adds the Vary header. The ETag value, closing quote included,
+// is left in *etag and *etag_len, or *etag is NULL if there is none.
+// Returns the bytes copied, or -1 if the body is not text, carries
+// encodings or variants of its own, or its ETag is not quoted.
+static long copy_head(const char *value, long head_end, char *dst, const char **etag, size_t *etag_len)
+{
+    const char *p = value, *end = value + head_end;
+    long len = 0;
+    int text = 0;
+
+    *etag = NULL;
+    while (p < end) {
+        const char *eol = memchr(p, '\n', end - p);
+        size_t n = eol + 1 - p;
+
+        if (strncasecmp(p, "Content-Encoding:", 17) == 0 || strncasecmp(p, "Transfer-Encoding:", 18) == 0 ||
+            strncasecmp(p, "Content-Range:", 14) == 0 || strncasecmp(p, "Vary:", 5) == 0) {
+            return -1;
+        }
+        if (strncasecmp(p, "Content-Type:", 13) == 0) {
+            const char *type = p + 13;
+            while (type < eol && (*type == ' ' || *type == '\t')) {
+                type++;
+            }
+            text = is_text(type, eol - type);
+        }
+        if (strncasecmp(p, "ETag:", 5) == 0) {
+            const char *tag = p + 5, *tag_end = eol;
+            while (tag < tag_end && (*tag == ' ' || *tag == '\t')) {
+                tag++;
+            }
+            while (tag_end > tag && (tag_end[-1] == '\r' || tag_end[-1] == ' ' || tag_end[-1] == '\t')) {
+                tag_end--;
+            }
+            if (tag_end - tag < 2 || tag_end[-1] != '"') {
+                return -1;
+            }
+            *etag = tag;
+            *etag_len = tag_end - tag;
+        } else if (strncasecmp(p, "Content-Length:", 15) != 0) {
+            memcpy(dst + len, p, n);
+            len += n;
+        }
+        p += n;
+    }
+    if (!text) {
+        return -1;
+    }
+
+    memcpy(dst + len, vary_hdr, strlen(vary_hdr));
+    return len + strlen(vary_hdr);
+}
+
+// Lays out the ETag line for the entity tag etag, len bytes with its
+// closing quote, with suffix put inside the quote. dst may be NULL to
+// only measure it. Returns its length.
+static size_t etag_line(const char *etag, size_t len, const char *suffix, char *dst)
+{
+    size_t n = strlen("ETag: ") + len + strlen(suffix) + strlen("\r\n");
+
+    if (dst != NULL) {
+        memcpy(dst, "ETag: ", 6);
+        memcpy(dst + 6, etag, len - 1);
+        memcpy(dst + 6 + len - 1, suffix, strlen(suffix));
+        memcpy(dst + n - 3, "\"\r\n", 3);
+    }
+    return n;
+}
+
+// Finds the ETag a compressed object carries after the head both forms
+// share. Returns its value, closing quote included, or NULL if none.
+static const char *packed_etag(const char *value, size_t size, unsigned int shared, size_t *len)
+{
+    const char *p = value + shared, *end = value + size;
+
+    while (p < end) {
+        const char *eol = memchr(p, '\n', end - p);
+        if (eol == NULL || eol - p <= 1) {
+            break;
+        }
+        if (strncmp(p, "ETag: ", 6) == 0) {
+            *len = eol - 1 - (p + 6);
+            return p + 6;
+        }
+        p = eol + 1;
+    }
+    return NULL;
+}
+
+// Media types that are worth compressing
+static int is_text(const char *type, size_t len)
+{
+    const char *types[] = {"text/", "application/javascript", "application/json", "application/xml",
+                           "application/x-javascript", "image/svg+xml"};
+
+    for (int i = 0; i < sizeof(types) / sizeof(types[0]); i++) {
+        if (len >= strlen(types[i]) && strncasecmp(type, types[i], strlen(types[i])) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// CPU time of the calling thread, in nanoseconds
+static long long cpu_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
@@ -0,0 +1,23 @@
+/* Bodies smaller than this are stored as they are */
+#define COMPRESS_MIN_SIZE 512
+
+/* A gzip body must come in at least 1/8 smaller to be kept */
+#define COMPRESS_MIN_SAVING 8
+
+/* Goes inside the closing quote of the gzip form's ETag, so the two forms
+ * of an object do not share an entity tag */
+#define COMPRESS_ETAG_SUFFIX "-gzip"
+
+struct cache_entry;
+
+/* zlib level, 1 (fastest) to 9; 0 stores everything as it is (the default) */
+extern int compress_level;
+
+char *compress_object(const char *value, size_t size, size_t *packed_size, size_t *plain_size,
+                      unsigned int *shared);
+char *compress_expand(const char *value, size_t size, unsigned int shared, size_t plain_size);
+char *compress_open(struct cache_entry *entry, int accept_gzip, size_t *size);
+void compress_close(struct cache_entry *entry, char *value, size_t size);
+size_t compress_validators(struct cache_entry *entry, char *buf, size_t size);
+void compress_stats(FILE *fp);
+void compress_metrics(FILE *fp);
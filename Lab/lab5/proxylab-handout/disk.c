@@ -0,0 +1,418 @@
+/*
+ * disk.c - Persistent second tier below the memory cache
+ *
+ * Objects are appended to log segments in one directory and read back
+ * through read-only shared mappings, so a hit is served straight from the
+ * page cache. The index lives in memory and is rebuilt at startup by
+ * walking the records of every segment; later copies of a key replace
+ * earlier ones, and a record whose checksum fails ends the log. Once the
+ * log outgrows its capacity the oldest segment is deleted whole.
+ */
+#include <stdatomic.h>
+#include <sys/uio.h>
+#include <zlib.h>
+#include "csapp.h"
+#include "cache.h"
+#include "disk.h"
+
+int disk_enabled;
+
+static char *disk_dir;
+static size_t disk_capacity;
+static size_t segment_limit;    // Where appends move to a new segment
+
+// Segments oldest first; appends go to the newest. The list is only
+// touched under log_mutex.
+static disk_segment *oldest, *newest;
+static size_t disk_used;
+static int nsegments;
+static pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// The index, the entry list of every segment and their dropped flags are
+// guarded by index_lock
+static disk_entry *buckets[DISK_BUCKETS];
+static pthread_rwlock_t index_lock = PTHREAD_RWLOCK_INITIALIZER;
+static int nentries;
+
+// Statistics
+static atomic_ulong disk_hits, disk_misses, disk_writes;
+static int loaded_entries;
+static double load_ms;
+
+// Helper functions
+static disk_segment *open_segment(unsigned int id, size_t *file_size);
+static size_t scan_segment(disk_segment *segment, size_t file_size);
+static void drop_oldest();
+static void unpin(disk_segment *segment);
+static int index_put(char *key, unsigned int hash, disk_segment *segment, size_t offset, size_t size,
+                     time_t expires);
+static disk_entry **entry_slot(unsigned int hash, char *key);
+static void entry_unlink(disk_entry *entry);
+static size_t record_len(size_t key_len, size_t size);
+static unsigned int record_crc(const char *key, size_t key_len, const char *value, size_t size);
+static int compare_uint(const void *a, const void *b);
+
+// Opens or creates the log in dir and indexes what it holds
+void disk_init(char *dir, size_t capacity)
+{
+    DIR *dp;
+    struct dirent *de;
+    struct timeval start, end;
+    unsigned int *ids = NULL, id;
+    int nids = 0, cap = 0;
+    char suffix[8];
+
+    gettimeofday(&start, NULL);
+
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+        unix_error("disk: mkdir error");
+    }
+    disk_dir = strdup(dir);
+    disk_capacity = capacity;
+    segment_limit = capacity / 4 < DISK_SEGMENT_SIZE ? capacity / 4 : DISK_SEGMENT_SIZE;
+
+    // Segments are named by their sequence number
+    if ((dp = opendir(dir)) == NULL) {
+        unix_error("disk: opendir error");
+    }
+    while ((de = readdir(dp)) != NULL) {
+        if (sscanf(de->d_name, "%8u%7s", &id, suffix) == 2 && strcmp(suffix, ".log") == 0) {
+            if (nids == cap) {
+                cap = cap ? cap * 2 : 16;
+                ids = Realloc(ids, cap * sizeof(unsigned int));
+            }
+            ids[nids++] = id;
+        }
+    }
+    closedir(dp);
+    qsort(ids, nids, sizeof(unsigned int), compare_uint);
+
+    for (int i = 0; i < nids; i++) {
+        size_t file_size;
+        disk_segment *segment = open_segment(ids[i], &file_size);
+        if (segment == NULL) {
+            continue;
+        }
+        if (newest != NULL) {
+            newest->next = segment;
+        } else {
+            oldest = segment;
+        }
+        newest = segment;
+        nsegments++;
+
+        segment->size = scan_segment(segment, file_size);
+        if (segment->size < file_size && ftruncate(segment->fd, segment->size) < 0) {
+            fprintf(stderr, "disk: cannot truncate segment %u: %s\n", segment->id, strerror(errno));
+        }
+        disk_used += segment->size;
+    }
+    Free(ids);
+
+    while (disk_used > disk_capacity && oldest != newest) {
+        drop_oldest();
+    }
+
+    gettimeofday(&end, NULL);
+    loaded_entries = nentries;
+    load_ms = (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_usec - start.tv_usec) / 1e3;
+    disk_enabled = 1;
+}
+
+// Looks key up on disk. On a hit, points *value at the mapped object and
+// returns its segment pinned, for disk_release(). Returns NULL on a miss.
+disk_segment *disk_find(char *key, char **value, size_t *size, time_t *expires)
+{
+    unsigned int hash = cache_hash(key);
+    disk_segment *segment = NULL;
+
+    if (!disk_enabled) {
+        return NULL;
+    }
+
+    pthread_rwlock_rdlock(&index_lock);
+    disk_entry *entry = *entry_slot(hash, key);
+    if (entry != NULL) {
+        segment = entry->segment;
+        atomic_fetch_add(&segment->refcnt, 1);
+        *value = segment->map + entry->offset;
+        *size = entry->size;
+        *expires = entry->expires;
+    }
+    pthread_rwlock_unlock(&index_lock);
+
+    atomic_fetch_add(segment != NULL ? &disk_hits : &disk_misses, 1);
+    return segment;
+}
+
+void disk_release(disk_segment *segment)
+{
+    unpin(segment);
+}
+
+// Appends an object to the log. It can be found once the write is done;
+// a failed write only leaves a gap that the next startup scan cuts off.
+void disk_store(char *key, char *value, size_t size, time_t expires)
+{
+    disk_record rec;
+    struct iovec iov[4];
+    static char pad[8];
+    size_t key_len = strlen(key) + 1;
+    size_t len = record_len(key_len, size);
+
+    if (!disk_enabled || size > DISK_MAX_OBJECT || len > segment_limit) {
+        return;
+    }
+
+    // Reserve room at the end of the log
+    pthread_mutex_lock(&log_mutex);
+    if (newest == NULL || newest->size + len > segment_limit) {
+        size_t file_size;
+        disk_segment *segment = open_segment(newest != NULL ? newest->id + 1 : 0, &file_size);
+        if (segment == NULL) {
+            pthread_mutex_unlock(&log_mutex);
+            return;
+        }
+        if (newest != NULL) {
+            newest->next = segment;
+        } else {
+            oldest = segment;
+        }
+        newest = segment;
+        nsegments++;
+    }
+    disk_segment *segment = newest;
+    size_t offset = segment->size;
+    segment->size += len;
+    disk_used += len;
+    atomic_fetch_add(&segment->refcnt, 1);
+
+    while (disk_used > disk_capacity && oldest != newest) {
+        drop_oldest();
+    }
+    pthread_mutex_unlock(&log_mutex);
+
+    memset(&rec, 0, sizeof(rec));
+    rec.magic = DISK_MAGIC;
+    rec.hash = cache_hash(key);
+    rec.key_len = key_len;
+    rec.expires = expires;
+    rec.size = size;
+    rec.crc = record_crc(key, key_len, value, size);
+    iov[0] = (struct iovec){&rec, sizeof(rec)};
+    iov[1] = (struct iovec){key, key_len};
+    iov[2] = (struct iovec){value, size};
+    iov[3] = (struct iovec){pad, len - sizeof(rec) - key_len - size};
+
+    if (pwritev(segment->fd, iov, 4, offset) == len) {
+        pthread_rwlock_wrlock(&index_lock);
+        int added = index_put(key, rec.hash, segment, offset + sizeof(rec) + key_len, size, expires);
+        pthread_rwlock_unlock(&index_lock);
+        if (added) {
+            atomic_fetch_add(&disk_writes, 1);
+        }
+    }
+    unpin(segment);
+}
+
+void disk_stats(FILE *fp)
+{
+    if (!disk_enabled) {
+        return;
+    }
+
+    pthread_mutex_lock(&log_mutex);
+    int segments = nsegments;
+    size_t used = disk_used;
+    pthread_mutex_unlock(&log_mutex);
+
+    pthread_rwlock_rdlock(&index_lock);
+    int entries = nentries;
+    pthread_rwlock_unlock(&index_lock);
+
+    fprintf(fp, "disk: dir=%s capacity=%zu used=%zu segments=%d objects=%d "
+            "hits=%lu misses=%lu writes=%lu loaded=%d load_ms=%.1f\n",
+            disk_dir, disk_capacity, used, segments, entries,
+            atomic_load(&disk_hits), atomic_load(&disk_misses), atomic_load(&disk_writes),
+            loaded_entries, load_ms);
+}
+
+// ========================================================== //
+// ==================== Helper Functions ==================== //
+// ========================================================== //
+
+// Opens or creates segment id and maps it. Returns NULL on error.
+static disk_segment *open_segment(unsigned int id, size_t *file_size)
+{
+    char path[MAXLINE];
+    struct stat st;
+    int fd;
+    char *map;
+
+    snprintf(path, MAXLINE, "%s/%08u.log", disk_dir, id);
+    if ((fd = open(path, O_RDWR | O_CREAT, 0644)) < 0 || fstat(fd, &st) < 0) {
+        fprintf(stderr, "disk: cannot open %s: %s\n", path, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        return NULL;
+    }
+
+    // The mapping covers the whole segment up front; appends show up in
+    // it through the page cache
+    if ((map = mmap(NULL, DISK_SEGMENT_SIZE, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        fprintf(stderr, "disk: cannot map %s: %s\n", path, strerror(errno));
+        close(fd);
+        return NULL;
+    }
+
+    disk_segment *segment = Calloc(1, sizeof(disk_segment));
+    segment->id = id;
+    segment->fd = fd;
+    segment->map = map;
+    atomic_init(&segment->refcnt, 1);
+    *file_size = st.st_size < DISK_SEGMENT_SIZE ? st.st_size : DISK_SEGMENT_SIZE;
+    return segment;
+}
+
+// Indexes the records of a segment being loaded. Returns where the valid
+// records end; anything after a damaged record is unreachable.
+static size_t scan_segment(disk_segment *segment, size_t file_size)
+{
+    size_t off = 0;
+
+    while (off + sizeof(disk_record) <= file_size) {
+        disk_record *rec = (disk_record *)(segment->map + off);
+        char *key = segment->map + off + sizeof(disk_record);
+
+        if (rec->magic != DISK_MAGIC || rec->key_len == 0 || rec->key_len > MAXLINE ||
+            rec->size > DISK_MAX_OBJECT) {
+            break;
+        }
+        size_t len = record_len(rec->key_len, rec->size);
+        if (off + len > file_size || key[rec->key_len - 1] != '\0' || cache_hash(key) != rec->hash) {
+            break;
+        }
+
+        // A write torn inside the value leaves a sound header behind
+        if (record_crc(key, rec->key_len, key + rec->key_len, rec->size) != rec->crc) {
+            break;
+        }
+
+        index_put(key, rec->hash, segment, off + sizeof(disk_record) + rec->key_len, rec->size, rec->expires);
+        off += len;
+    }
+
+    return off;
+}
+
+// Deletes the oldest segment and forgets its objects, found through the
+// segment's own entry list. Readers still holding it keep the mapping
+// until they let go. Requires log_mutex.
+static void drop_oldest()
+{
+    char path[MAXLINE];
+    disk_segment *segment = oldest;
+    disk_entry *entry;
+
+    pthread_rwlock_wrlock(&index_lock);
+    segment->dropped = 1;
+    while ((entry = segment->entries) != NULL) {
+        disk_entry **slot = entry_slot(entry->hash, entry->key);
+        *slot = entry->next;
+        entry_unlink(entry);
+        Free(entry->key);
+        Free(entry);
+        nentries--;
+    }
+    pthread_rwlock_unlock(&index_lock);
+    oldest = segment->next;
+
+    snprintf(path, MAXLINE, "%s/%08u.log", disk_dir, segment->id);
+    unlink(path);
+    disk_used -= segment->size;
+    nsegments--;
+    unpin(segment);
+}
+
+static void unpin(disk_segment *segment)
+{
+    if (atomic_fetch_sub(&segment->refcnt, 1) == 1) {
+        munmap(segment->map, DISK_SEGMENT_SIZE);
+        close(segment->fd);
+        Free(segment);
+    }
+}
+
+// Points key at a record. Fails if the segment was dropped while the
+// record was being written. Requires the index write lock.
+static int index_put(char *key, unsigned int hash, disk_segment *segment, size_t offset, size_t size,
+                     time_t expires)
+{
+    if (segment->dropped) {
+        return 0;
+    }
+
+    disk_entry **slot = entry_slot(hash, key);
+    disk_entry *entry = *slot;
+    if (entry == NULL) {
+        entry = Calloc(1, sizeof(disk_entry));
+        entry->key = strdup(key);
+        entry->hash = hash;
+        *slot = entry;
+        nentries++;
+    } else {
+        entry_unlink(entry);
+    }
+    entry->segment = segment;
+    entry->offset = offset;
+    entry->size = size;
+    entry->expires = expires;
+
+    entry->seg_prev = NULL;
+    entry->seg_next = segment->entries;
+    if (segment->entries != NULL) {
+        segment->entries->seg_prev = entry;
+    }
+    segment->entries = entry;
+    return 1;
+}
+
+static disk_entry **entry_slot(unsigned int hash, char *key)
+{
+    disk_entry **slot = &buckets[hash & (DISK_BUCKETS - 1)];
+    while (*slot != NULL && ((*slot)->hash != hash || strcmp((*slot)->key, key) != 0)) {
+        slot = &(*slot)->next;
+    }
+    return slot;
+}
+
+// Takes entry off its segment's list. Requires the index write lock.
+static void entry_unlink(disk_entry *entry)
+{
+    if (entry->seg_prev != NULL) {
+        entry->seg_prev->seg_next = entry->seg_next;
+    } else {
+        entry->segment->entries = entry->seg_next;
+    }
+    if (entry->seg_next != NULL) {
+        entry->seg_next->seg_prev = entry->seg_prev;
+    }
+}
+
+static size_t record_len(size_t key_len, size_t size)
+{
+    return (sizeof(disk_record) + key_len + size + 7) & ~(size_t)7;
+}
+
+static unsigned int record_crc(const char *key, size_t key_len, const char *value, size_t size)
+{
+    uLong crc = crc32(0L, (const Bytef *)key, key_len);
+    return crc32(crc, (const Bytef *)value, size);
+}
+
+static int compare_uint(const void *a, const void *b)
+{
+    unsigned int x = *(const unsigned int *)a, y = *(const unsigned int *)b;
+    return (x > y) - (x < y);
+}
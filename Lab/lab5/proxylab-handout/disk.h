@@ -0,0 +1,57 @@
+/* Log segments are rotated at this size */
+#define DISK_SEGMENT_SIZE (64 * 1024 * 1024)
+
+/* Default bytes kept on disk; whole segments are dropped oldest first */
+#define DISK_CAPACITY (1024 * 1024 * 1024UL)
+
+/* Largest object written to disk; it is buffered while being fetched */
+#define DISK_MAX_OBJECT (16 * 1024 * 1024)
+
+/* Starts every record, so a scan can tell where a torn write ends the
+ * log; changes with the record format */
+#define DISK_MAGIC 0x50584332
+
+#define DISK_BUCKETS 65536
+
+/* On-disk record header, followed by the key (NUL included) and value.
+ * Records are 8-byte aligned. */
+typedef struct disk_record {
+    unsigned int magic;
+    unsigned int hash;          // cache_hash() of the key, checks the header
+    unsigned int key_len;
+    unsigned int expires;       // Seconds since the epoch, 0 if never stale
+    unsigned long long size;    // Value bytes
+    unsigned int crc;           // crc32 of the key and value
+    unsigned int unused;
+} disk_record;
+
+typedef struct disk_segment {
+    unsigned int id;
+    int fd;
+    char *map;                  // DISK_SEGMENT_SIZE bytes, read-only
+    size_t size;                // Bytes reserved by appends
+    _Atomic int refcnt;         // Held by the log and by every reader
+    struct disk_segment *next;  // Next newer segment
+    struct disk_entry *entries; // Index entries pointing into it
+    int dropped;                // Deleted; nothing may point into it anymore
+} disk_segment;
+
+typedef struct disk_entry {
+    char *key;
+    unsigned int hash;
+    disk_segment *segment;
+    size_t offset;              // Of the value within the segment
+    size_t size;
+    time_t expires;
+    struct disk_entry *next;
+    struct disk_entry *seg_prev; // In the entries of its segment
+    struct disk_entry *seg_next;
+} disk_entry;
+
+extern int disk_enabled;
+
+void disk_init(char *dir, size_t capacity);
+disk_segment *disk_find(char *key, char **value, size_t *size, time_t *expires);
+void disk_release(disk_segment *segment);
+void disk_store(char *key, char *value, size_t size, time_t expires);
+void disk_stats(FILE *fp);
@@ -0,0 +1,324 @@
+/*
+ * dns.c - Cache of upstream name resolutions
+ *
+ * getaddrinfo() blocks, often for milliseconds, so its results are kept
+ * for dns_ttl seconds and failures for DNS_NEGATIVE_TTL. An entry used
+ * shortly before it expires is re-resolved by a background thread while
+ * requests keep using the old addresses.
+ */
+#include <poll.h>
+#include <stdatomic.h>
+#include "csapp.h"
+#include "cache.h"
+#include "dns.h"
+#include "metrics.h"
+
+int dns_ttl = DNS_TTL;
+
+static dns_entry *buckets[DNS_BUCKETS];
+static pthread_rwlock_t dns_lock = PTHREAD_RWLOCK_INITIALIZER;
+static int nentries;
+
+// Statistics
+static atomic_ulong dns_hits, dns_misses, dns_negative_hits, dns_refreshes;
+static atomic_ulong dns_resolve_ns, connect_count, connect_ns;
+
+// Helper functions
+static int lookup(const char *key, dns_addr *addrs, int *refresh);
+static int resolve(char *hostname, char *port, dns_addr *addrs);
+static void store(const char *key, dns_addr *addrs, int naddrs);
+static void *refresh_thread(void *vargp);
+static void refresh_cancel(const char *key);
+static dns_entry **entry_slot(const char *key);
+static unsigned long now_ns();
+static int connect_within(int fd, dns_addr *addr, int timeout_ms);
+
+void dns_init(int ttl)
+{
+    dns_ttl = ttl;
+}
+
+// Resolves hostname:port into at most DNS_MAX_ADDRS addresses.
+// Returns how many, 0 if the name does not resolve.
+int dns_resolve(char *hostname, char *port, dns_addr *addrs)
+{
+    char key[MAXLINE];
+    int n;
+
+    if ((n = dns_lookup(hostname, port, addrs)) >= 0) {
+        return n;
+    }
+
+    atomic_fetch_add(&dns_misses, 1);
+    n = resolve(hostname, port, addrs);
+    if (dns_ttl != 0) {
+        snprintf(key, MAXLINE, "%s:%s", hostname, port);
+        store(key, addrs, n);
+    }
+    return n;
+}
+
+// Like dns_resolve(), but answers only from the cache, so it never
+// blocks. Returns -1 if the name would have to be resolved.
+int dns_lookup(char *hostname, char *port, dns_addr *addrs)
+{
+    char key[MAXLINE];
+    int n, refresh;
+
+    if (dns_ttl == 0) {
+        return -1;
+    }
+
+    snprintf(key, MAXLINE, "%s:%s", hostname, port);
+    if ((n = lookup(key, addrs, &refresh)) >= 0) {
+        atomic_fetch_add(n > 0 ? &dns_hits : &dns_negative_hits, 1);
+        if (refresh) {
+            pthread_t tid;
+            char *copy = strdup(key);
+
+            // Without a thread the refresh is skipped; the addresses are
+            // still good, and a later hit tries again
+            if (copy == NULL || pthread_create(&tid, NULL, refresh_thread, copy) != 0) {
+                free(copy);
+                refresh_cancel(key);
+            } else {
+                atomic_fetch_add(&dns_refreshes, 1);
+            }
+        }
+    }
+    return n;
+}
+
+// Like open_clientfd(), but with cached addresses, and giving up after
+// timeout_ms in all. Returns the connected socket, or -1 with errno set:
+// ETIMEDOUT if time ran out, EHOSTUNREACH if the name does not resolve.
+int dns_connect(char *hostname, char *port, int timeout_ms)
+{
+    dns_addr addrs[DNS_MAX_ADDRS];
+    unsigned long start = now_ns();
+    int fd = -1, n = dns_resolve(hostname, port, addrs);
+
+    errno = EHOSTUNREACH;
+    for (int i = 0; i < n; i++) {
+        int left = timeout_ms - (int)((now_ns() - start) / 1000000);
+        if (left <= 0) {
+            errno = ETIMEDOUT;
+            break;
+        }
+        if ((fd = socket(addrs[i].family, addrs[i].socktype, addrs[i].protocol)) < 0) {
+            continue;
+        }
+        if (connect_within(fd, &addrs[i], left) == 0) {
+            break;
+        }
+        int err = errno;
+        close(fd);
+        errno = err;
+        fd = -1;
+    }
+
+    unsigned long elapsed = now_ns() - start;
+    atomic_fetch_add(&connect_count, 1);
+    atomic_fetch_add(&connect_ns, elapsed);
+    metrics_observe(METRICS_CONNECT, elapsed / 1000);
+    return fd;
+}
+
+// Misses pay for getaddrinfo(); every hit saves about that much
+void dns_stats(FILE *fp)
+{
+    unsigned long misses = atomic_load(&dns_misses);
+    unsigned long hits = atomic_load(&dns_hits) + atomic_load(&dns_negative_hits);
+    unsigned long connects = atomic_load(&connect_count);
+    double resolve_us = misses ? atomic_load(&dns_resolve_ns) / 1e3 / misses : 0;
+
+    pthread_rwlock_rdlock(&dns_lock);
+    int entries = nentries;
+    pthread_rwlock_unlock(&dns_lock);
+
+    fprintf(fp, "dns: ttl=%d entries=%d hits=%lu negative_hits=%lu misses=%lu refreshes=%lu "
+            "resolve_us=%.1f connect_us=%.1f saved_ms=%.1f\n",
+            dns_ttl, entries, atomic_load(&dns_hits), atomic_load(&dns_negative_hits), misses,
+            atomic_load(&dns_refreshes), resolve_us,
+            connects ? atomic_load(&connect_ns) / 1e3 / connects : 0,
+            hits * resolve_us / 1e3);
+}
+
+// ========================================================== //
+// ==================== Helper Functions ==================== //
+// ========================================================== //
+
+// Copies a live entry's addresses. Returns their count, or -1 on a miss.
+// *refresh is set for the one caller that should renew the entry.
+static int lookup(const char *key, dns_addr *addrs, int *refresh)
+{
+    int n = -1;
+    time_t now = time(NULL);
+
+    *refresh = 0;
+    pthread_rwlock_rdlock(&dns_lock);
+    dns_entry *entry = *entry_slot(key);
+    if (entry != NULL && now < entry->expires) {
+        n = entry->naddrs;
+        memcpy(addrs, entry->addrs, n * sizeof(dns_addr));
+        int ahead = dns_ttl / 4 < DNS_REFRESH_AHEAD ? dns_ttl / 4 : DNS_REFRESH_AHEAD;
+        if (n > 0 && entry->expires - now <= ahead) {
+            *refresh = !atomic_exchange(&entry->refreshing, 1);
+        }
+    }
+    pthread_rwlock_unlock(&dns_lock);
+
+    return n;
+}
+
+static int resolve(char *hostname, char *port, dns_addr *addrs)
+{
+    struct addrinfo hints, *list, *p;
+    unsigned long start = now_ns();
+    int n = 0;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICSERV | AI_ADDRCONFIG;
+    if (getaddrinfo(hostname, port, &hints, &list) == 0) {
+        for (p = list; p != NULL && n < DNS_MAX_ADDRS; p = p->ai_next) {
+            addrs[n].family = p->ai_family;
+            addrs[n].socktype = p->ai_socktype;
+            addrs[n].protocol = p->ai_protocol;
+            addrs[n].addrlen = p->ai_addrlen;
+            memcpy(&addrs[n].addr, p->ai_addr, p->ai_addrlen);
+            n++;
+        }
+        freeaddrinfo(list);
+    }
+
+    atomic_fetch_add(&dns_resolve_ns, now_ns() - start);
+    return n;
+}
+
+// Inserts or replaces key's entry
+static void store(const char *key, dns_addr *addrs, int naddrs)
+{
+    pthread_rwlock_wrlock(&dns_lock);
+    dns_entry **slot = entry_slot(key);
+    dns_entry *entry = *slot;
+
+    if (entry == NULL) {
+        // Past the limit, make room by dropping expired entries
+        if (nentries >= DNS_MAX_ENTRIES) {
+            time_t now = time(NULL);
+            for (int i = 0; i < DNS_BUCKETS; i++) {
+                for (dns_entry **p = &buckets[i]; *p != NULL;) {
+                    dns_entry *old = *p;
+                    if (old->expires <= now && !atomic_load(&old->refreshing)) {
+                        *p = old->next;
+                        Free(old->key);
+                        Free(old);
+                        nentries--;
+                    } else {
+                        p = &old->next;
+                    }
+                }
+            }
+            slot = entry_slot(key);
+        }
+        if (nentries >= DNS_MAX_ENTRIES) {
+            pthread_rwlock_unlock(&dns_lock);
+            return;
+        }
+
+        entry = Calloc(1, sizeof(dns_entry));
+        entry->key = strdup(key);
+        *slot = entry;
+        nentries++;
+    }
+
+    entry->naddrs = naddrs;
+    memcpy(entry->addrs, addrs, naddrs * sizeof(dns_addr));
+    entry->expires = time(NULL) + (naddrs > 0 ? dns_ttl : DNS_NEGATIVE_TTL);
+    atomic_store(&entry->refreshing, 0);
+    pthread_rwlock_unlock(&dns_lock);
+}
+
+// Re-resolves a key ("hostname:port") off the request path. After a
+// failed refresh the old addresses serve until they expire.
+static void *refresh_thread(void *vargp)
+{
+    char *key = vargp, *port = strrchr(key, ':');
+    dns_addr addrs[DNS_MAX_ADDRS];
+    int n;
+
+    Pthread_detach(pthread_self());
+
+    *port = '\0';
+    n = resolve(key, port + 1, addrs);
+    *port = ':';
+    if (n > 0) {
+        store(key, addrs, n);
+    }
+
+    Free(key);
+    return NULL;
+}
+
+// Lets the next hit on key start the refresh this one could not
+static void refresh_cancel(const char *key)
+{
+    pthread_rwlock_rdlock(&dns_lock);
+    dns_entry *entry = *entry_slot(key);
+    if (entry != NULL) {
+        atomic_store(&entry->refreshing, 0);
+    }
+    pthread_rwlock_unlock(&dns_lock);
+}
+
+// Returns the link pointing at key's entry, or at the NULL ending its
+// bucket. Requires dns_lock.
+static dns_entry **entry_slot(const char *key)
+{
+    dns_entry **slot = &buckets[cache_hash(key) & (DNS_BUCKETS - 1)];
+
+    while (*slot != NULL && strcmp((*slot)->key, key) != 0) {
+        slot = &(*slot)->next;
+    }
+    return slot;
+}
+
+static unsigned long now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+// Connects fd to addr, waiting at most timeout_ms. Returns 0, or -1 with
+// errno set. The socket is left blocking.
+static int connect_within(int fd, dns_addr *addr, int timeout_ms)
+{
+    struct pollfd pfd = {fd, POLLOUT, 0};
+    int flags = fcntl(fd, F_GETFL), err = 0, rc;
+    socklen_t len = sizeof(err);
+
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    if (connect(fd, (SA *)&addr->addr, addr->addrlen) < 0) {
+        if (errno != EINPROGRESS) {
+            return -1;
+        }
+        while ((rc = poll(&pfd, 1, timeout_ms)) < 0 && errno == EINTR) {
+        }
+        if (rc == 0) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        if (rc < 0 || getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0) {
+            return -1;
+        }
+        if (err != 0) {
+            errno = err;
+            return -1;
+        }
+    }
+    fcntl(fd, F_SETFL, flags);
+
+    return 0;
+}
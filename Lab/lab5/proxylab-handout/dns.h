@@ -0,0 +1,37 @@
+/* Seconds a resolution is trusted by default (0 disables the cache) */
+#define DNS_TTL 60
+
+/* Seconds a failed resolution is remembered */
+#define DNS_NEGATIVE_TTL 5
+
+/* Hits this close to expiry refresh the entry in the background */
+#define DNS_REFRESH_AHEAD 10
+
+#define DNS_MAX_ADDRS 8
+#define DNS_BUCKETS 256
+#define DNS_MAX_ENTRIES 4096
+
+typedef struct dns_addr {
+    int family;
+    int socktype;
+    int protocol;
+    socklen_t addrlen;
+    struct sockaddr_storage addr;
+} dns_addr;
+
+typedef struct dns_entry {
+    char *key;                  // "hostname:port"
+    int naddrs;                 // 0 for a failed resolution
+    dns_addr addrs[DNS_MAX_ADDRS];
+    time_t expires;
+    _Atomic int refreshing;
+    struct dns_entry *next;
+} dns_entry;
+
+extern int dns_ttl;
+
+void dns_init(int ttl);
+int dns_resolve(char *hostname, char *port, dns_addr *addrs);
+int dns_lookup(char *hostname, char *port, dns_addr *addrs);
+int dns_connect(char *hostname, char *port, int timeout_ms);
+void dns_stats(FILE *fp);
@@ -249,11 +249,23 @@ do
     # Compare the two files
     echo "   Comparing the two files"
     diff -q ${PROXY_DIR}/${file} ${NOPROXY_DIR}/${file} &> /dev/null
+    if [ $? -ne 0 ]; then
+        echo "   Failure: Files differ."
+        continue
+    fi
+
+    # Fetch again using the proxy, which may now answer from its cache
+    echo "   Fetching ./tiny/${file} into ${PROXY_DIR} again using the proxy"
+    rm -f ${PROXY_DIR}/${file}
+    download_proxy $PROXY_DIR ${file} "http://localhost:${tiny_port}/${file}" "http://localhost:${proxy_port}"
+
+    echo "   Comparing the second fetch"
+    cmp -s ${PROXY_DIR}/${file} ${NOPROXY_DIR}/${file}
     if [ $? -eq 0 ]; then
         numSucceeded=`expr ${numSucceeded} + 1`
         echo "   Success: Files are identical."
     else
-        echo "   Failure: Files differ."
+        echo "   Failure: Second fetch differs."
     fi
 done
 
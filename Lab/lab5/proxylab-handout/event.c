@@ -0,0 +1,993 @@
+/*
+ * event.c - Single-threaded epoll engine
+ *
+ * Every socket is non-blocking and every client is a small state machine
+ * (conn) driven by readiness events, so idle connections cost a few
+ * hundred bytes instead of a thread. Buffers are allocated from the slab
+ * only while a connection needs them. Client connections are kept open
+ * and pipelined requests are answered in order, as in serve().
+ *
+ * Nothing on the loop may block: names the DNS cache does not hold are
+ * resolved by EVENT_RESOLVERS threads, which post the connections back
+ * through an eventfd, and every wait is bounded by a timer.
+ */
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include "csapp.h"
+#include "cache.h"
+#include "slab.h"
+#include "http.h"
+#include "dns.h"
+#include "upstream.h"
+#include "log.h"
+#include "metrics.h"
+#include "compress.h"
+#include "event.h"
+
+static int epfd;
+
+// Connections waiting for a resolver, and those it is done with
+static conn *resolve_head, *resolve_tail, *resolved;
+static pthread_mutex_t resolve_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t resolve_cond = PTHREAD_COND_INITIALIZER;
+static int resolve_fd;
+static conn_side resolve_side;
+
+// Every timer has a fixed length, so appending keeps each list in
+// deadline order
+static conn *timer_head[TIMER_NONE], *timer_tail[TIMER_NONE];
+
+// Helper functions
+static void raise_fd_limit();
+static void accept_clients(int listenfd);
+static void *resolver_thread(void *vargp);
+static void finish_resolves();
+static void start_connect(conn *c);
+static void handle_client(conn *c, unsigned int events);
+static void handle_upstream(conn *c, unsigned int events);
+static int read_request(conn *c);
+static void start_response(conn *c);
+static int relay_response(conn *c);
+static int start_head(conn *c);
+static int end_response(conn *c);
+static int finish_request(conn *c);
+static void serve_cached(conn *c, char *value, size_t size);
+static int flush_out(conn *c, conn_side *side);
+static void set_interest(conn_side *side, unsigned int events);
+static int connect_upstream(dns_addr *addrs, int naddrs);
+static void conn_wait(conn *c, conn_timer timer);
+static int expire_timers();
+static void conn_expire(conn *c, conn_timer timer);
+static void conn_close(conn *c);
+static void conn_reset(conn *c);
+static void log_request(conn *c);
+static void send_error(conn *c, int status);
+static int peek_status(const char *buf, size_t len);
+static size_t response_head_len(const char *buf, size_t len);
+static size_t strip_hop_headers(const char *head, size_t len, char *dst);
+static int timer_seconds(conn_timer timer);
+static long long now_ms();
+
+void event_loop(int listenfd)
+{
+    struct epoll_event ev, events[EVENT_MAX_EVENTS];
+
+    raise_fd_limit();
+
+    if ((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        unix_error("epoll_create1 error");
+    }
+
+    // The listening socket is the only registration without a conn
+    fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL) | O_NONBLOCK);
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, listenfd, &ev) < 0) {
+        unix_error("epoll_ctl error");
+    }
+
+    // Resolvers wake the loop through resolve_fd
+    if ((resolve_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+        unix_error("eventfd error");
+    }
+    ev.data.ptr = &resolve_side;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, resolve_fd, &ev) < 0) {
+        unix_error("epoll_ctl error");
+    }
+    for (int i = 0; i < EVENT_RESOLVERS; i++) {
+        pthread_t tid;
+        Pthread_create(&tid, NULL, resolver_thread, NULL);
+    }
+
+    while (1) {
+        int n = epoll_wait(epfd, events, EVENT_MAX_EVENTS, expire_timers());
+        if (n < 0 && errno != EINTR) {
+            unix_error("epoll_wait error");
+        }
+
+        for (int i = 0; i < n; i++) {
+            conn_side *side = events[i].data.ptr;
+
+            if (side == NULL) {
+                accept_clients(listenfd);
+            } else if (side == &resolve_side) {
+                finish_resolves();
+            } else if (side == &side->conn->client) {
+                handle_client(side->conn, events[i].events);
+            } else {
+                handle_upstream(side->conn, events[i].events);
+            }
+        }
+    }
+}
+
+static void accept_clients(int listenfd)
+{
+    int connfd;
+
+    while ((connfd = accept(listenfd, NULL, NULL)) >= 0) {
+        fcntl(connfd, F_SETFL, O_NONBLOCK);
+
+        conn *c = slab_alloc(sizeof(conn));
+        memset(c, 0, sizeof(conn));
+
+        c->state = CONN_READ_REQUEST;
+        c->client.conn = c;
+        c->client.fd = connfd;
+        c->upstream.conn = c;
+        c->upstream.fd = -1;
+        c->accepted_us = metrics_enabled ? metrics_now_us() : 0;
+        c->timer = TIMER_NONE;
+        http_request_init(&c->request);
+
+        set_interest(&c->client, EPOLLIN);
+        conn_wait(c, TIMER_IDLE);
+    }
+
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        fprintf(stderr, "ERROR, while accepting a connection\n");
+    }
+}
+
+// Resolves the names of queued connections. The loop does not touch a
+// connection while it is queued, so its request is read without a lock.
+static void *resolver_thread(void *vargp)
+{
+    uint64_t one = 1;
+
+    Pthread_detach(pthread_self());
+    while (1) {
+        pthread_mutex_lock(&resolve_mutex);
+        while (resolve_head == NULL) {
+            pthread_cond_wait(&resolve_cond, &resolve_mutex);
+        }
+        conn *c = resolve_head;
+        if ((resolve_head = c->resolve_next) == NULL) {
+            resolve_tail = NULL;
+        }
+        pthread_mutex_unlock(&resolve_mutex);
+
+        c->naddrs = dns_resolve(c->request.hostname, c->request.port, c->addrs);
+
+        pthread_mutex_lock(&resolve_mutex);
+        c->resolve_next = resolved;
+        resolved = c;
+        pthread_mutex_unlock(&resolve_mutex);
+        write(resolve_fd, &one, sizeof(one));
+    }
+
+    return NULL;
+}
+
+// Connects the connections whose names the resolvers are done with
+static void finish_resolves()
+{
+    uint64_t count;
+
+    read(resolve_fd, &count, sizeof(count));
+    pthread_mutex_lock(&resolve_mutex);
+    conn *c = resolved;
+    resolved = NULL;
+    pthread_mutex_unlock(&resolve_mutex);
+
+    while (c != NULL) {
+        conn *next = c->resolve_next;
+        start_connect(c);
+        c = next;
+    }
+}
+
+static void handle_client(conn *c, unsigned int events)
+{
+    switch (c->state) {
+    case CONN_READ_REQUEST:
+        if (read_request(c) < 0) {
+            conn_close(c);
+        }
+        return;
+
+    case CONN_RELAY:
+        // The client drained; resume reading upstream
+        if (relay_response(c) < 0) {
+            conn_close(c);
+        }
+        return;
+
+    case CONN_SEND_CACHED: {
+        int rc = flush_out(c, &c->client);
+        if (rc < 0 || (rc == 0 && finish_request(c) < 0)) {
+            conn_close(c);
+        } else if (rc > 0) {
+            conn_wait(c, TIMER_CLIENT);
+        }
+        return;
+    }
+
+    default:
+        if (events & (EPOLLERR | EPOLLHUP)) {
+            conn_close(c);
+        }
+    }
+}
+
+static void handle_upstream(conn *c, unsigned int events)
+{
+    int err = 0;
+    socklen_t len = sizeof(err);
+
+    switch (c->state) {
+    case CONN_CONNECT:
+        if (getsockopt(c->upstream.fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0) {
+            log_debug("cannot connect to %s:%s: %s", c->request.hostname, c->request.port, strerror(err));
+            send_error(c, err == ETIMEDOUT ? 504 : 502);
+            return;
+        }
+        if (metrics_enabled) {
+            metrics_observe(METRICS_CONNECT, metrics_now_us() - c->connect_us);
+        }
+
+        // The relay buffer holds the request until it is sent
+        c->relay = slab_alloc(EVENT_RELAY_SIZE);
+        c->out[0] = (struct iovec){c->relay, http_format_request(&c->request, c->relay, EVENT_RELAY_SIZE, 0)};
+        c->out_cnt = 1;
+        c->out_idx = 0;
+        if (c->out[0].iov_len == 0) {
+            conn_close(c);
+            return;
+        }
+        c->state = CONN_SEND_REQUEST;
+        /* fall through */
+
+    case CONN_SEND_REQUEST: {
+        int rc = flush_out(c, &c->upstream);
+        if (rc < 0) {
+            conn_close(c);
+        } else if (rc == 0) {
+            start_response(c);
+        } else {
+            conn_wait(c, TIMER_UPSTREAM);
+        }
+        return;
+    }
+
+    case CONN_RELAY:
+        if (relay_response(c) < 0) {
+            conn_close(c);
+        }
+        return;
+
+    default:
+        return;
+    }
+}
+
+// Reads the next request head, starting with any the client pipelined.
+// Returns -1 if the connection should be closed.
+static int read_request(conn *c)
+{
+    ssize_t n;
+    int rc;
+
+    if (c->parser == NULL) {
+        c->parser = slab_alloc(sizeof(http_parser));
+        http_parser_init(c->parser);
+    }
+
+    // Only the lines that arrived since the last read are scanned
+    while ((rc = http_parser_next(c->parser, &c->request)) == 0) {
+        n = recv(c->client.fd, c->parser->buf + c->parser->len, HTTP_HEAD_SIZE - c->parser->len, 0);
+        if (n < 0) {
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+        }
+        if (n == 0) {
+            return -1;
+        }
+        c->parser->len += n;
+    }
+
+    // Requests after the first are timed from their arrival
+    c->log_start = log_level >= LOG_ACCESS ? log_now_us() : 0;
+    if (metrics_enabled && c->accepted_us == 0) {
+        c->accepted_us = metrics_now_us();
+    }
+
+    // Nothing after a refused request can be trusted to be framed
+    if (rc < 0) {
+        http_request_init(&c->request);
+        c->keep_alive = 0;
+        send_error(c, -rc);
+        return 0;
+    }
+    c->keep_alive = c->request.keep_alive;
+
+    // Check if request is in cache. Stale objects are simply fetched again.
+    c->cached = cache_find(c->request.uri);
+    if (c->cached != NULL && cache_is_stale(c->cached, time(NULL))) {
+        cache_release(c->cached);
+        c->cached = NULL;
+    }
+    if (c->cached != NULL) {
+        char *value;
+        size_t size;
+
+        // An expanded copy is owned as the body, freed with the request
+        if ((value = compress_open(c->cached, c->request.accept_gzip, &size)) == NULL) {
+            cache_release(c->cached);
+            c->cached = NULL;
+            send_error(c, 502);
+            return 0;
+        }
+        if (value != c->cached->value) {
+            c->body = value;
+            c->body_cap = size;
+        }
+        serve_cached(c, value, size);
+        return 0;
+    }
+
+    // Names missing from the DNS cache would block the loop, so a
+    // resolver thread looks them up
+    c->connect_us = metrics_enabled ? metrics_now_us() : 0;
+    c->addrs = slab_alloc(DNS_MAX_ADDRS * sizeof(dns_addr));
+    set_interest(&c->client, 0);
+    if ((c->naddrs = dns_lookup(c->request.hostname, c->request.port, c->addrs)) >= 0) {
+        start_connect(c);
+        return 0;
+    }
+    c->state = CONN_RESOLVE;
+    conn_wait(c, TIMER_NONE);
+
+    pthread_mutex_lock(&resolve_mutex);
+    c->resolve_next = NULL;
+    if (resolve_tail != NULL) {
+        resolve_tail->resolve_next = c;
+    } else {
+        resolve_head = c;
+    }
+    resolve_tail = c;
+    pthread_cond_signal(&resolve_cond);
+    pthread_mutex_unlock(&resolve_mutex);
+
+    return 0;
+}
+
+// Starts connecting to the addresses the request's host resolved to
+static void start_connect(conn *c)
+{
+    c->upstream.fd = connect_upstream(c->addrs, c->naddrs);
+    slab_free(c->addrs, DNS_MAX_ADDRS * sizeof(dns_addr));
+    c->addrs = NULL;
+    if (c->upstream.fd < 0) {
+        log_debug("cannot connect to %s:%s: %s", c->request.hostname, c->request.port, strerror(errno));
+        send_error(c, 502);
+        return;
+    }
+    c->state = CONN_CONNECT;
+    set_interest(&c->upstream, EPOLLOUT);
+    conn_wait(c, TIMER_CONNECT);
+}
+
+// The request is sent; start relaying the response
+static void start_response(conn *c)
+{
+    c->state = CONN_RELAY;
+    c->out_cnt = c->out_idx = 0;
+    c->relay_len = 0;
+
+    set_interest(&c->upstream, EPOLLIN);
+    conn_wait(c, TIMER_UPSTREAM);
+}
+
+// Moves response bytes from upstream to the client until one of them
+// would block. Upstream is paused while the client has unsent bytes.
+// Returns -1 if the connection should be closed.
+static int relay_response(conn *c)
+{
+    ssize_t n;
+    size_t want;
+    char *dst;
+
+    while (1) {
+        int rc = flush_out(c, &c->client);
+        if (rc < 0) {
+            return -1;
+        }
+        if (rc > 0) {
+            set_interest(&c->upstream, 0);
+            set_interest(&c->client, EPOLLOUT);
+            conn_wait(c, TIMER_CLIENT);
+            return 0;
+        }
+
+        if (c->head_done && (c->remaining == 0 || c->upstream_eof)) {
+            return end_response(c);
+        }
+
+        if (!c->head_done) {
+            // The head is gathered whole before any of it is forwarded
+            if (c->relay_len == EVENT_RELAY_SIZE) {
+                send_error(c, 502);
+                return 0;
+            }
+            dst = c->relay + c->relay_len;
+            want = EVENT_RELAY_SIZE - c->relay_len;
+        } else {
+            // Grow the object buffer up to cache_max_object
+            if (c->body != NULL && c->body_size == c->body_cap && c->body_cap < cache_max_object) {
+                size_t new_cap = c->body_cap * 2 < cache_max_object ? c->body_cap * 2 : cache_max_object;
+                c->body = slab_realloc(c->body, c->body_cap, new_cap);
+                c->body_cap = new_cap;
+            }
+
+            // Read straight into the object buffer while the object still fits
+            if (c->body != NULL && c->body_size < c->body_cap) {
+                dst = c->body + c->body_size;
+                want = c->body_cap - c->body_size < EVENT_RELAY_SIZE ? c->body_cap - c->body_size : EVENT_RELAY_SIZE;
+            } else {
+                dst = c->relay;
+                want = EVENT_RELAY_SIZE;
+            }
+
+            // Nothing past the body is read
+            if (c->remaining >= 0 && (long long)want > c->remaining) {
+                want = c->remaining;
+            }
+        }
+
+        n = recv(c->upstream.fd, dst, want, 0);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                set_interest(&c->client, 0);
+                set_interest(&c->upstream, EPOLLIN);
+                conn_wait(c, TIMER_UPSTREAM);
+                return 0;
+            }
+        }
+
+        // The server went away before its head was complete; nothing has
+        // reached the client, so it can be told
+        if (n <= 0 && !c->head_done) {
+            send_error(c, 502);
+            return 0;
+        }
+        if (n < 0) {
+            return -1;
+        }
+        if (n == 0) {
+            c->upstream_eof = 1;
+            continue;
+        }
+
+        if (!c->head_done) {
+            c->relay_len += n;
+            if (start_head(c) < 0) {
+                send_error(c, 502);
+                return 0;
+            }
+            continue;
+        }
+
+        if (c->remaining > 0) {
+            c->remaining -= n;
+        }
+        if (c->body != NULL && dst == c->relay) {
+            // Too large to cache
+            slab_free(c->body, c->body_cap);
+            c->body = NULL;
+        } else if (c->body != NULL) {
+            c->body_size += n;
+        }
+
+        c->out[0] = (struct iovec){dst, n};
+        c->out_cnt = 1;
+        c->out_idx = 0;
+    }
+}
+
+// Lays out the response head once relay holds all of it: the client gets
+// it without the server's hop-by-hop headers and with the proxy's own
+// Connection header, and the cached object starts with it the same way
+// serve() stores one. Returns -1 if the head is not one the proxy can
+// forward.
+static int start_head(conn *c)
+{
+    http_response resp;
+    size_t raw_len, len, body_len;
+    long head_end;
+    const char *conn_hdr;
+
+    // Anything but HTTP/1.x is relayed as it is, up to EOF
+    if (strncmp(c->relay, "HTTP/", c->relay_len < 5 ? c->relay_len : 5) != 0) {
+        c->head_done = 1;
+        c->keep_alive = 0;
+        c->remaining = -1;
+        c->out[0] = (struct iovec){c->relay, c->relay_len};
+        c->out_cnt = 1;
+        c->out_idx = 0;
+        return 0;
+    }
+
+    if ((raw_len = response_head_len(c->relay, c->relay_len)) == 0) {
+        return 0;
+    }
+    if ((head_end = http_parse_response_head(c->relay, raw_len, &resp)) < 0) {
+        return -1;
+    }
+
+    // Chunks are not parsed, so a chunked body runs to EOF
+    c->keep_alive = c->keep_alive && http_response_is_framed(&resp) && !resp.chunked;
+    if (!http_response_has_body(&resp)) {
+        c->remaining = 0;
+    } else if (!resp.chunked && resp.content_length >= 0) {
+        c->remaining = resp.content_length;
+    } else {
+        c->remaining = -1;
+    }
+
+    conn_hdr = c->keep_alive ? keep_alive_hdr : close_hdr;
+    c->resp_head = slab_alloc(EVENT_RELAY_SIZE);
+    len = strip_hop_headers(c->relay, head_end, c->resp_head);
+    if (len + strlen(conn_hdr) + 2 > EVENT_RELAY_SIZE) {
+        return -1;
+    }
+
+    // Body bytes that came with the head
+    body_len = c->relay_len - raw_len;
+    if (c->remaining >= 0 && (long long)body_len > c->remaining) {
+        body_len = c->remaining;
+    }
+    if (c->remaining > 0) {
+        c->remaining -= body_len;
+    }
+
+    // Only responses that are cacheable and may fit are captured
+    if (http_response_cacheable(&resp) && !resp.chunked && len + 2 + body_len <= cache_max_object &&
+        (resp.content_length < 0 || resp.content_length <= (long long)(cache_max_object - len - 2))) {
+        c->body_cap = MAXLINE < cache_max_object ? MAXLINE : cache_max_object;
+        while (c->body_cap < len + 2 + body_len) {
+            c->body_cap = c->body_cap * 2 < cache_max_object ? c->body_cap * 2 : cache_max_object;
+        }
+        c->body = slab_alloc(c->body_cap);
+        memcpy(c->body, c->resp_head, len);
+        memcpy(c->body + len, "\r\n", 2);
+        memcpy(c->body + len + 2, c->relay + raw_len, body_len);
+        c->body_size = len + 2 + body_len;
+    }
+
+    memcpy(c->resp_head + len, conn_hdr, strlen(conn_hdr));
+    len += strlen(conn_hdr);
+    memcpy(c->resp_head + len, "\r\n", 2);
+    c->out[0] = (struct iovec){c->resp_head, len + 2};
+    c->out[1] = (struct iovec){c->relay + raw_len, body_len};
+    c->out_cnt = 2;
+    c->out_idx = 0;
+    c->head_done = 1;
+
+    return 0;
+}
+
+// The response is over, or upstream closed early. Whole responses are
+// cached. Returns -1 if the connection should be closed.
+static int end_response(conn *c)
+{
+    if (c->remaining > 0) {
+        return -1;
+    }
+
+    // The cache takes ownership of the body
+    if (c->body != NULL) {
+        http_response resp;
+        http_parse_response_head(c->body, c->body_size, &resp);
+        time_t expires = http_response_expires(&resp, time(NULL));
+        cache_insert(c->request.uri, slab_realloc(c->body, c->body_cap, c->body_size), c->body_size, expires);
+        c->body = NULL;
+    }
+
+    return finish_request(c);
+}
+
+// The response has been sent; ready the connection for the client's next
+// request. Returns -1 if the connection should be closed instead.
+static int finish_request(conn *c)
+{
+    log_request(c);
+    c->state = CONN_READ_REQUEST;
+    if (!c->keep_alive) {
+        return -1;
+    }
+
+    conn_reset(c);
+    set_interest(&c->client, EPOLLIN);
+    conn_wait(c, TIMER_IDLE);
+
+    // A pipelined request may already be buffered
+    return read_request(c);
+}
+
+// Sends a cached object with the proxy's own Connection header, which
+// goes right before the empty line ending the head
+static void serve_cached(conn *c, char *value, size_t size)
+{
+    http_response resp;
+    long head_end = http_parse_response_head(value, size, &resp);
+
+    c->keep_alive = c->keep_alive && head_end >= 0 && http_response_is_framed(&resp);
+    if (head_end < 0) {
+        c->out[0] = (struct iovec){value, size};
+        c->out_cnt = 1;
+    } else {
+        const char *conn_hdr = c->keep_alive ? keep_alive_hdr : close_hdr;
+        c->out[0] = (struct iovec){value, head_end};
+        c->out[1] = (struct iovec){(char *)conn_hdr, strlen(conn_hdr)};
+        c->out[2] = (struct iovec){value + head_end, size - head_end};
+        c->out_cnt = 3;
+    }
+    c->out_idx = 0;
+    c->state = CONN_SEND_CACHED;
+    set_interest(&c->client, EPOLLOUT);
+    conn_wait(c, TIMER_CLIENT);
+}
+
+// Writes pending output to side. Returns 0 once everything is sent,
+// 1 if the socket would block, -1 on error.
+static int flush_out(conn *c, conn_side *side)
+{
+    // The status line leads the first bytes for the client
+    if (side == &c->client && c->sent == 0 && c->out_idx < c->out_cnt) {
+        c->status = peek_status(c->out[c->out_idx].iov_base, c->out[c->out_idx].iov_len);
+    }
+
+    while (1) {
+        // Slices already sent are skipped, empty ones included
+        while (c->out_idx < c->out_cnt && c->out[c->out_idx].iov_len == 0) {
+            c->out_idx++;
+        }
+        if (c->out_idx == c->out_cnt) {
+            return 0;
+        }
+
+        struct msghdr msg = {0};
+        msg.msg_iov = c->out + c->out_idx;
+        msg.msg_iovlen = c->out_cnt - c->out_idx;
+        ssize_t n = sendmsg(side->fd, &msg, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                set_interest(side, EPOLLOUT);
+                return 1;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (side == &c->client) {
+            if (c->sent == 0 && metrics_enabled) {
+                metrics_observe(METRICS_FIRST_BYTE, metrics_now_us() - c->accepted_us);
+            }
+            c->sent += n;
+        }
+        for (size_t left = n; left > 0; c->out_idx++) {
+            struct iovec *iov = &c->out[c->out_idx];
+            if (left < iov->iov_len) {
+                iov->iov_base = (char *)iov->iov_base + left;
+                iov->iov_len -= left;
+                break;
+            }
+            left -= iov->iov_len;
+            iov->iov_len = 0;
+        }
+    }
+}
+
+// Changes the events watched on side. Sockets with no interest are
+// removed from the epoll set so hangups on paused sockets do not spin.
+static void set_interest(conn_side *side, unsigned int events)
+{
+    struct epoll_event ev;
+    int op;
+
+    if (side->events == events) {
+        return;
+    }
+    if (events == 0) {
+        op = EPOLL_CTL_DEL;
+    } else if (side->events == 0) {
+        op = EPOLL_CTL_ADD;
+    } else {
+        op = EPOLL_CTL_MOD;
+    }
+
+    ev.events = events;
+    ev.data.ptr = side;
+    if (epoll_ctl(epfd, op, side->fd, &ev) < 0) {
+        unix_error("epoll_ctl error");
+    }
+    side->events = events;
+}
+
+// Starts a non-blocking connect to the first address a socket can be
+// made for. Returns the socket, or -1 with errno set.
+static int connect_upstream(dns_addr *addrs, int naddrs)
+{
+    int fd = -1;
+
+    errno = EHOSTUNREACH;
+    for (int i = 0; i < naddrs; i++) {
+        fd = socket(addrs[i].family, addrs[i].socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, addrs[i].protocol);
+        if (fd < 0) {
+            continue;
+        }
+        if (connect(fd, (SA *)&addrs[i].addr, addrs[i].addrlen) == 0 || errno == EINPROGRESS) {
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+
+    return fd;
+}
+
+// Times what c waits for from now on, in place of what it waited for
+// before. Timers of length 0 never run out.
+static void conn_wait(conn *c, conn_timer timer)
+{
+    if (c->timer != TIMER_NONE) {
+        if (c->timer_prev != NULL) {
+            c->timer_prev->timer_next = c->timer_next;
+        } else {
+            timer_head[c->timer] = c->timer_next;
+        }
+        if (c->timer_next != NULL) {
+            c->timer_next->timer_prev = c->timer_prev;
+        } else {
+            timer_tail[c->timer] = c->timer_prev;
+        }
+    }
+
+    c->timer = timer != TIMER_NONE && timer_seconds(timer) > 0 ? timer : TIMER_NONE;
+    if (c->timer == TIMER_NONE) {
+        return;
+    }
+    c->deadline = now_ms() + timer_seconds(timer) * 1000LL;
+    c->timer_prev = timer_tail[timer];
+    c->timer_next = NULL;
+    if (timer_tail[timer] != NULL) {
+        timer_tail[timer]->timer_next = c;
+    } else {
+        timer_head[timer] = c;
+    }
+    timer_tail[timer] = c;
+}
+
+// Ends the waits that ran out. Returns the milliseconds until the next
+// one does, or -1 if nothing is timed.
+static int expire_timers()
+{
+    long long now = now_ms(), next = -1;
+
+    for (int timer = 0; timer < TIMER_NONE; timer++) {
+        conn *c;
+        while ((c = timer_head[timer]) != NULL && c->deadline <= now) {
+            conn_wait(c, TIMER_NONE);
+            conn_expire(c, timer);
+        }
+        if (c != NULL && (next < 0 || c->deadline - now < next)) {
+            next = c->deadline - now;
+        }
+    }
+
+    return next;
+}
+
+// A silent upstream is answered with a 504 while the client has not seen
+// any of the response; every other wait that runs out ends the connection
+static void conn_expire(conn *c, conn_timer timer)
+{
+    if ((timer == TIMER_CONNECT || timer == TIMER_UPSTREAM) && !c->head_done) {
+        log_debug("%s:%s timed out", c->request.hostname, c->request.port);
+        send_error(c, 504);
+        return;
+    }
+    conn_close(c);
+}
+
+// Answers the request with a response of the proxy's own, after which
+// the connection goes on only if the client and the request allow it
+static void send_error(conn *c, int status)
+{
+    if (c->upstream.fd >= 0) {
+        set_interest(&c->upstream, 0);
+        close(c->upstream.fd);
+        c->upstream.fd = -1;
+    }
+    if (c->relay == NULL) {
+        c->relay = slab_alloc(EVENT_RELAY_SIZE);
+    }
+    if (c->body != NULL) {
+        slab_free(c->body, c->body_cap);
+        c->body = NULL;
+    }
+
+    c->state = CONN_SEND_CACHED;
+    c->out[0] = (struct iovec){c->relay, http_format_error(status, c->keep_alive, c->relay, EVENT_RELAY_SIZE)};
+    c->out_cnt = 1;
+    c->out_idx = 0;
+    set_interest(&c->client, EPOLLOUT);
+    conn_wait(c, TIMER_CLIENT);
+}
+
+// Closing a socket also drops it from the epoll set
+static void conn_close(conn *c)
+{
+    if (c->state != CONN_READ_REQUEST) {
+        log_request(c);
+    }
+
+    close(c->client.fd);
+    conn_wait(c, TIMER_NONE);
+    conn_reset(c);
+    if (c->parser != NULL) {
+        slab_free(c->parser, sizeof(http_parser));
+    }
+    slab_free(c, sizeof(conn));
+}
+
+// Frees what the last request held, so an idle connection keeps only its
+// parser, and only while it buffers a pipelined request
+static void conn_reset(conn *c)
+{
+    if (c->upstream.fd >= 0) {
+        set_interest(&c->upstream, 0);
+        close(c->upstream.fd);
+        c->upstream.fd = -1;
+    }
+    if (c->cached != NULL) {
+        cache_release(c->cached);
+        c->cached = NULL;
+    }
+    if (c->relay != NULL) {
+        slab_free(c->relay, EVENT_RELAY_SIZE);
+        c->relay = NULL;
+    }
+    if (c->resp_head != NULL) {
+        slab_free(c->resp_head, EVENT_RELAY_SIZE);
+        c->resp_head = NULL;
+    }
+    if (c->body != NULL) {
+        slab_free(c->body, c->body_cap);
+        c->body = NULL;
+    }
+    if (c->addrs != NULL) {
+        slab_free(c->addrs, DNS_MAX_ADDRS * sizeof(dns_addr));
+        c->addrs = NULL;
+    }
+    if (c->parser != NULL && !http_parser_pending(c->parser)) {
+        slab_free(c->parser, sizeof(http_parser));
+        c->parser = NULL;
+    }
+
+    http_request_init(&c->request);
+    c->out_cnt = c->out_idx = 0;
+    c->relay_len = 0;
+    c->head_done = 0;
+    c->remaining = 0;
+    c->body_size = c->body_cap = 0;
+    c->upstream_eof = 0;
+    c->log_start = 0;
+    c->accepted_us = 0;
+    c->sent = 0;
+    c->status = 0;
+}
+
+// Writes the access record and metrics of the request being answered
+static void log_request(conn *c)
+{
+    log_response(c->status, c->sent);
+    log_access(c->request.uri != NULL ? c->request.uri : "-", c->cached != NULL ? LOG_HIT : LOG_MISS, c->log_start);
+    metrics_request(c->cached != NULL ? LOG_HIT : LOG_MISS, c->status, c->sent, c->accepted_us);
+}
+
+// ========================================================== //
+// ==================== Helper Functions ==================== //
+// ========================================================== //
+
+// Every connection needs a descriptor, so allow as many as the hard limit
+static void raise_fd_limit()
+{
+    struct rlimit rl;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+// Returns the status code a response starting with buf carries, or 0
+static int peek_status(const char *buf, size_t len)
+{
+    if (len < 12 || strncmp(buf, "HTTP/", 5) != 0 || buf[8] != ' ') {
+        return 0;
+    }
+    return atoi(buf + 9);
+}
+
+// Returns the length of the response head at the start of buf, up to and
+// including the empty line, or 0 if it is not all there yet
+static size_t response_head_len(const char *buf, size_t len)
+{
+    const char *p = buf, *end = buf + len, *eol;
+
+    while ((eol = memchr(p, '\n', end - p)) != NULL) {
+        if (p != buf && (eol == p || (eol == p + 1 && *p == '\r'))) {
+            return eol + 1 - buf;
+        }
+        p = eol + 1;
+    }
+    return 0;
+}
+
+// Copies the first len bytes of a response head to dst, without the
+// server's Connection headers. Returns the bytes copied.
+static size_t strip_hop_headers(const char *head, size_t len, char *dst)
+{
+    const char *p = head, *end = head + len, *eol;
+    size_t n = 0;
+
+    for (; p < end; p = eol + 1) {
+        if ((eol = memchr(p, '\n', end - p)) == NULL) {
+            eol = end - 1;
+        }
+        if (p != head && http_is_hop_header(p)) {
+            continue;
+        }
+        memcpy(dst + n, p, eol + 1 - p);
+        n += eol + 1 - p;
+    }
+    return n;
+}
+
+// Seconds a wait of the kind may last, 0 for no limit
+static int timer_seconds(conn_timer timer)
+{
+    switch (timer) {
+    case TIMER_IDLE:
+        return EVENT_IDLE_TIMEOUT;
+    case TIMER_CONNECT:
+        return UPSTREAM_CONNECT_TIMEOUT;
+    case TIMER_UPSTREAM:
+        return upstream_timeout;
+    case TIMER_CLIENT:
+        return EVENT_SEND_TIMEOUT;
+    default:
+        return 0;
+    }
+}
+
+static long long now_ms()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
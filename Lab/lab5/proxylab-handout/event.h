@@ -0,0 +1,84 @@
+/* Events handled per epoll_wait() call */
+#define EVENT_MAX_EVENTS 256
+
+/* Relay buffer for responses that are not being cached; a response head
+ * has to fit in it */
+#define EVENT_RELAY_SIZE MAXBUF
+
+/* Threads resolving names the DNS cache does not hold, off the loop */
+#define EVENT_RESOLVERS 4
+
+/* Seconds a client has to send a request once it is idle, like
+ * KEEPALIVE_TIMEOUT for the threads */
+#define EVENT_IDLE_TIMEOUT 5
+
+/* Seconds a client may stall a response before it is given up on */
+#define EVENT_SEND_TIMEOUT 30
+
+typedef enum conn_state {
+    CONN_READ_REQUEST,          // Reading the request head from the client
+    CONN_RESOLVE,               // Waiting for a resolver thread
+    CONN_CONNECT,               // Waiting for the upstream connect to finish
+    CONN_SEND_REQUEST,          // Writing the request upstream
+    CONN_RELAY,                 // Relaying the response to the client
+    CONN_SEND_CACHED,           // Writing a cached object to the client
+} conn_state;
+
+/* What a connection is waiting for, each with its own timeout. The
+ * first that runs out ends the wait. */
+typedef enum conn_timer {
+    TIMER_IDLE,                 // The client's next request
+    TIMER_CONNECT,              // The upstream connect
+    TIMER_UPSTREAM,             // Upstream taking or sending bytes
+    TIMER_CLIENT,               // The client taking bytes
+    TIMER_NONE,                 // Nothing timed
+} conn_timer;
+
+typedef struct conn_side {
+    struct conn *conn;
+    int fd;
+    unsigned int events;        // Current epoll interest, 0 if unregistered
+} conn_side;
+
+typedef struct conn {
+    conn_state state;
+    conn_side client;
+    conn_side upstream;
+
+    http_request request;       // Fields point into parser
+    http_parser *parser;        // Request heads, pipelined ones included
+    int keep_alive;             // The client may send another request
+
+    struct iovec out[3];        // Bytes waiting to be written
+    int out_cnt;
+    int out_idx;                // First slice not wholly sent
+
+    char *relay;                // Response head until it is complete, then
+    size_t relay_len;           // whatever is too large to cache
+    char *resp_head;            // Response head as the client gets it
+    int head_done;              // The response head has been laid out
+    long long remaining;        // Body bytes still to come, -1 until EOF
+    char *body;                 // Response captured for the cache
+    size_t body_size;
+    size_t body_cap;
+    int upstream_eof;
+
+    cache_entry *cached;        // Pinned entry being served on a hit
+
+    struct dns_addr *addrs;     // Upstream addresses, until connecting
+    int naddrs;
+    struct conn *resolve_next;  // In a resolver queue
+
+    conn_timer timer;
+    long long deadline;         // Monotonic milliseconds
+    struct conn *timer_prev;    // In the list of its timer, by deadline
+    struct conn *timer_next;
+
+    long long log_start;        // When the request was read
+    long long accepted_us;      // Monotonic, for the metrics
+    long long connect_us;       // When the upstream connect started
+    size_t sent;                // Response bytes sent to the client
+    int status;                 // Of the response, 0 if unknown
+} conn;
+
+void event_loop(int listenfd);
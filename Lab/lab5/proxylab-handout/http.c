@@ -0,0 +1,861 @@
+#include "csapp.h"
+#include "http.h"
+
+/* You won't lose style points for including this long line in your code */
+#define USER_AGENT_HDR "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n"
+const char *user_agent_hdr = USER_AGENT_HDR;
+const char *keep_alive_hdr = "Connection: keep-alive\r\n";
+const char *close_hdr = "Connection: close\r\n";
+
+/* Every upstream head from the Host value's line ending to the extra
+ * headers, serialized once */
+static const char keep_alive_fixed[] = "\r\n" USER_AGENT_HDR "Connection: keep-alive\r\n";
+static const char close_fixed[] = "\r\n" USER_AGENT_HDR "Connection: close\r\nProxy-Connection: close\r\n";
+
+// Helper functions
+static int has_token(const char *value, const char *token);
+static int name_is(const char *key, size_t len, const char *name);
+static int accepts_gzip(const char *value, size_t len);
+static int parse_range(const char *value, size_t len, long long *first, long long *last);
+static const char *header_value(const char *head, size_t len, const char *name, size_t *value_len);
+static void parse_cache_control(const char *value, http_response *response);
+static int cacheable_by_default(int status);
+static time_t parse_http_date(const char *value);
+
+void http_request_init(http_request *request)
+{
+    request->uri = request->path = request->host = request->hostname = request->port = NULL;
+    request->keep_alive = 0;
+    request->conditional = 0;
+    request->accept_gzip = 0;
+    request->range = 0;
+    request->range_first = request->range_last = -1;
+    request->if_range = NULL;
+    request->if_range_len = 0;
+    request->own_range = 0;
+    request->nhdrs = 0;
+}
+
+// Looks for the empty line ending a request head in buf, resuming at
+// *scanned, the start of the first line not yet seen whole. Empty lines
+// ahead of a request are dropped, which shortens *len. Returns the length
+// of the head, or 0 if it is not complete yet.
+size_t http_request_head_end(char *buf, size_t *len, size_t *scanned)
+{
+    char *eol;
+
+    while ((eol = memchr(buf + *scanned, '\n', *len - *scanned)) != NULL) {
+        size_t line = *scanned, next = eol + 1 - buf;
+        int empty = next - line == 1 || (next - line == 2 && buf[line] == '\r');
+
+        if (empty && line == 0) {
+            memmove(buf, buf + next, *len - next);
+            *len -= next;
+            continue;
+        }
+        *scanned = next;
+        if (empty) {
+            return next;
+        }
+    }
+
+    return 0;
+}
+
+// Parses a complete request head of len bytes in place: "GET <uri>
+// [HTTP/x.y]" and then "Key: value" lines. The fields of request point
+// into buf, which is modified. Returns 0, or minus the status to refuse
+// the request with: -400 if the head is malformed or announces a body,
+// which the proxy never reads, and -501 for methods other than GET.
+int http_parse_request(char *buf, size_t len, http_request *request)
+{
+    char *p = buf, *end = buf + len, *eol, *line_end, *sp;
+
+    http_request_init(request);
+    if (memchr(buf, '\0', len) != NULL) {
+        return -400;
+    }
+
+    // Request line
+    eol = memchr(p, '\n', end - p);
+    line_end = eol > p && eol[-1] == '\r' ? eol - 1 : eol;
+    *line_end = '\0';
+    if ((sp = strchr(p, ' ')) == NULL || sp == p) {
+        return -400;
+    }
+    int is_get = sp - p == 3 && memcmp(p, "GET", 3) == 0;
+    request->uri = sp + 1;
+    if ((sp = strchr(request->uri, ' ')) != NULL) {
+        char *v = sp + 1;
+        *sp = '\0';
+        if (strncmp(v, "HTTP/", 5) != 0 || !isdigit((unsigned char)v[5]) || v[6] != '.' ||
+            !isdigit((unsigned char)v[7]) || v[8] != '\0') {
+            return -400;
+        }
+
+        // HTTP/1.1 connections persist unless the client says otherwise
+        request->keep_alive = v[5] > '1' || (v[5] == '1' && v[7] >= '1');
+    }
+    if (!is_get) {
+        return -501;
+    }
+
+    // Only absolute URIs name the server. Host and port are copied out
+    // since the URI, the cache key, must stay whole.
+    if (strncasecmp(request->uri, "http://", 7) != 0) {
+        return -400;
+    }
+    char *authority = request->uri + 7;
+    size_t n = strcspn(authority, "/");
+    if (n == 0 || n > HTTP_MAX_HOST) {
+        return -400;
+    }
+    request->path = authority[n] != '\0' ? authority + n : "/";
+    request->host = memcpy(request->names, authority, n);
+    request->host[n] = '\0';
+
+    char *colon = memchr(request->host, ':', n);
+    if (colon != NULL) {
+        request->hostname = memcpy(request->host + n + 1, request->host, colon - request->host);
+        request->hostname[colon - request->host] = '\0';
+        request->port = colon[1] != '\0' ? colon + 1 : "80";
+    } else {
+        request->hostname = request->host;
+        request->port = "80";
+    }
+
+    // Headers, up to the empty line
+    for (p = eol + 1; p < end; p = eol + 1) {
+        eol = memchr(p, '\n', end - p);
+        line_end = eol > p && eol[-1] == '\r' ? eol - 1 : eol;
+        if (line_end == p) {
+            break;
+        }
+
+        // Folded lines and whitespace before the colon are not allowed
+        char *colon = memchr(p, ':', line_end - p);
+        if (*p == ' ' || *p == '\t' || colon == NULL || colon == p || colon[-1] == ' ' || colon[-1] == '\t') {
+            return -400;
+        }
+        size_t key_len = colon - p;
+        char *value = colon + 1;
+        while (value < line_end && (*value == ' ' || *value == '\t')) {
+            value++;
+        }
+        while (line_end > value && (line_end[-1] == ' ' || line_end[-1] == '\t')) {
+            line_end--;
+        }
+
+        if (name_is(p, key_len, "Connection") || name_is(p, key_len, "Proxy-Connection")) {
+            *line_end = '\0';
+            if (has_token(value, "close")) {
+                request->keep_alive = 0;
+            } else if (has_token(value, "keep-alive")) {
+                request->keep_alive = 1;
+            }
+            continue;
+        }
+        // A body would be read as the next request
+        if (name_is(p, key_len, "Transfer-Encoding") ||
+            (name_is(p, key_len, "Content-Length") && (line_end - value != 1 || *value != '0'))) {
+            return -400;
+        }
+        if (name_is(p, key_len, "If-None-Match") || name_is(p, key_len, "If-Modified-Since")) {
+            request->conditional = 1;
+        }
+        if (name_is(p, key_len, "Accept-Encoding")) {
+            request->accept_gzip = accepts_gzip(value, line_end - value);
+        }
+        if (name_is(p, key_len, "Range")) {
+            request->range = parse_range(value, line_end - value, &request->range_first, &request->range_last);
+        }
+        if (name_is(p, key_len, "If-Range")) {
+            request->if_range = value;
+            request->if_range_len = line_end - value;
+        }
+
+        // The proxy sends its own
+        if (name_is(p, key_len, "Host") || name_is(p, key_len, "User-Agent")) {
+            continue;
+        }
+
+        if (request->nhdrs == HTTP_MAX_HEADERS) {
+            return -400;
+        }
+        request->hdrs[request->nhdrs].key = p;
+        request->hdrs[request->nhdrs].key_len = key_len;
+        request->hdrs[request->nhdrs].value = value;
+        request->hdrs[request->nhdrs].value_len = line_end - value;
+        request->nhdrs++;
+    }
+
+    return 0;
+}
+
+void http_parser_init(http_parser *parser)
+{
+    parser->len = 0;
+    parser->scanned = 0;
+    parser->consumed = 0;
+}
+
+// Parses the next buffered request; its fields stay valid until the next
+// call. Returns 1 on success, 0 if more bytes have to be read into
+// buf + len first, and otherwise minus the status to refuse the request
+// with, as http_parse_request() does; a head that does not fit is -400.
+int http_parser_next(http_parser *parser, http_request *request)
+{
+    size_t head_len;
+
+    // Pipelined bytes after the last request move to the front
+    if (parser->consumed > 0) {
+        parser->len -= parser->consumed;
+        memmove(parser->buf, parser->buf + parser->consumed, parser->len);
+        parser->consumed = 0;
+        parser->scanned = 0;
+    }
+
+    if ((head_len = http_request_head_end(parser->buf, &parser->len, &parser->scanned)) == 0) {
+        return parser->len == HTTP_HEAD_SIZE ? -400 : 0;
+    }
+    parser->consumed = head_len;
+
+    int rc = http_parse_request(parser->buf, head_len, request);
+    return rc < 0 ? rc : 1;
+}
+
+// Whether the client already sent part of another request
+int http_parser_pending(http_parser *parser)
+{
+    return parser->len > parser->consumed;
+}
+
+// Lays the upstream request out in iov, as HTTP/1.1 keep-alive or
+// HTTP/1.0 close, with extra header lines (validators or the proxy's own
+// Range, or NULL) before the empty line. Accept-Encoding is left out:
+// the proxy compresses its own copies, and an origin's gzip body would
+// be cached for clients that cannot take it. Nothing is copied: the
+// slices point at the request and at static strings, and consecutive
+// "Key: value\r\n" lines of the head go as one slice. iov needs
+// HTTP_REQUEST_IOV entries. Returns the count.
+int http_request_iov(http_request *request, struct iovec *iov, int keep_alive, const char *extra)
+{
+    int n = 0;
+
+#define SLICE(p, len) (iov[n++] = (struct iovec){(char *)(p), (len)})
+#define LITERAL(str) SLICE(str, sizeof(str) - 1)
+    LITERAL("GET ");
+    SLICE(request->path, strlen(request->path));
+    if (keep_alive) {
+        LITERAL(" HTTP/1.1\r\nHost: ");
+    } else {
+        LITERAL(" HTTP/1.0\r\nHost: ");
+    }
+    SLICE(request->host, strlen(request->host));
+    if (keep_alive) {
+        LITERAL(keep_alive_fixed);
+    } else {
+        LITERAL(close_fixed);
+    }
+    for (int i = 0; i < request->nhdrs; i++) {
+        http_header *h = &request->hdrs[i];
+        char *line_end = h->value + h->value_len;
+
+        if (name_is(h->key, h->key_len, "Accept-Encoding")) {
+            continue;
+        }
+        if (request->own_range && (name_is(h->key, h->key_len, "Range") || name_is(h->key, h->key_len, "If-Range"))) {
+            continue;
+        }
+        if (h->value != h->key + h->key_len + 2 || h->key[h->key_len + 1] != ' ' ||
+            line_end[0] != '\r' || line_end[1] != '\n') {
+            SLICE(h->key, h->key_len);
+            LITERAL(": ");
+            SLICE(h->value, h->value_len);
+            LITERAL("\r\n");
+        } else if ((char *)iov[n - 1].iov_base + iov[n - 1].iov_len == h->key) {
+            iov[n - 1].iov_len += line_end + 2 - h->key;
+        } else {
+            SLICE(h->key, line_end + 2 - h->key);
+        }
+    }
+    if (extra != NULL) {
+        SLICE(extra, strlen(extra));
+    }
+    LITERAL("\r\n");
+#undef LITERAL
+#undef SLICE
+
+    return n;
+}
+
+// Serializes the upstream request into buf, as HTTP/1.1 keep-alive or
+// HTTP/1.0 close. Returns its length, or 0 if it does not fit.
+size_t http_format_request(http_request *request, char *buf, size_t size, int keep_alive)
+{
+    struct iovec iov[HTTP_REQUEST_IOV];
+    int iovcnt = http_request_iov(request, iov, keep_alive, NULL);
+    size_t len = 0;
+
+    for (int i = 0; i < iovcnt; i++) {
+        if (iov[i].iov_len >= size - len) {
+            return 0;
+        }
+        memcpy(buf + len, iov[i].iov_base, iov[i].iov_len);
+        len += iov[i].iov_len;
+    }
+
+    return len;
+}
+
+void http_response_init(http_response *response)
+{
+    memset(response, 0, sizeof(http_response));
+    response->content_length = -1;
+    response->max_age = -1;
+    response->s_maxage = -1;
+    response->range_first = response->range_last = response->range_length = -1;
+}
+
+// Parses "HTTP/<major>.<minor> <status> ...". Returns -1 if malformed.
+int http_parse_status_line(const char *line, http_response *response)
+{
+    int major, minor;
+
+    if (sscanf(line, "HTTP/%d.%d %d", &major, &minor, &response->status) != 3) {
+        return -1;
+    }
+
+    // Before HTTP/1.1 connections close unless the server says otherwise
+    response->close = major < 1 || (major == 1 && minor == 0);
+
+    return 0;
+}
+
+// Picks the framing and caching headers out of one response header line. The line is
+// left untouched since it is forwarded as is.
+void http_parse_response_header(const char *line, http_response *response)
+{
+    const char *value = strchr(line, ':');
+    size_t len;
+
+    if (value == NULL) {
+        return;
+    }
+    len = value - line;
+    value++;
+
+    if (len == strlen("Content-Length") && strncasecmp(line, "Content-Length", len) == 0) {
+        response->content_length = strtoll(value, NULL, 10);
+    } else if (len == strlen("Transfer-Encoding") && strncasecmp(line, "Transfer-Encoding", len) == 0) {
+        response->chunked = has_token(value, "chunked");
+    } else if (len == strlen("Connection") && strncasecmp(line, "Connection", len) == 0) {
+        if (has_token(value, "close")) {
+            response->close = 1;
+        } else if (has_token(value, "keep-alive")) {
+            response->close = 0;
+        }
+    } else if (len == strlen("Cache-Control") && strncasecmp(line, "Cache-Control", len) == 0) {
+        parse_cache_control(value, response);
+    } else if (len == strlen("Expires") && strncasecmp(line, "Expires", len) == 0) {
+        response->expires = parse_http_date(value);
+    } else if (len == strlen("Date") && strncasecmp(line, "Date", len) == 0) {
+        response->date = parse_http_date(value);
+        if (response->date < 0) {
+            response->date = 0;
+        }
+    } else if (len == strlen("Age") && strncasecmp(line, "Age", len) == 0) {
+        response->age = atol(value);
+    } else if (len == strlen("Content-Range") && strncasecmp(line, "Content-Range", len) == 0) {
+        if (sscanf(value, " bytes %lld-%lld/%lld", &response->range_first, &response->range_last,
+                   &response->range_length) < 2) {
+            response->range_first = response->range_last = -1;
+        }
+    }
+}
+
+// 1xx, 204 and 304 responses end with their headers
+int http_response_has_body(http_response *response)
+{
+    return response->status >= 200 && response->status != 204 && response->status != 304;
+}
+
+// Whether the end of the body can be told without the connection closing
+int http_response_is_framed(http_response *response)
+{
+    return !http_response_has_body(response) || response->chunked || response->content_length >= 0;
+}
+
+// Whether a shared cache may store the response. Partial content and
+// 304s only make sense to the client that asked for them. Statuses not
+// cacheable by default need an explicit lifetime, since without one the
+// object would be kept until evicted.
+int http_response_cacheable(http_response *response)
+{
+    if (response->no_store || response->status == 206 || response->status == 304) {
+        return 0;
+    }
+    return cacheable_by_default(response->status) || response->s_maxage >= 0 || response->max_age >= 0 ||
+           response->expires != 0;
+}
+
+// When a response received at now goes stale. Returns 0 if it carries no
+// freshness information, in which case it is kept until evicted.
+time_t http_response_expires(http_response *response, time_t now)
+{
+    long lifetime;
+
+    if (response->no_cache) {
+        return now;
+    }
+    if (response->s_maxage >= 0) {
+        lifetime = response->s_maxage;
+    } else if (response->max_age >= 0) {
+        lifetime = response->max_age;
+    } else if (response->expires > 0) {
+        lifetime = response->expires - (response->date > 0 ? response->date : now);
+    } else if (response->expires < 0) {
+        lifetime = 0;
+    } else {
+        return 0;
+    }
+
+    return lifetime > response->age ? now + lifetime - response->age : now;
+}
+
+// Formats a complete response the proxy itself answers with, such as a
+// 502 when the origin cannot be reached. Returns its length, or 0 if it
+// does not fit in size bytes.
+size_t http_format_error(int status, int keep_alive, char *buf, size_t size)
+{
+    const char *reason;
+    char body[64];
+
+    switch (status) {
+    case 400:
+        reason = "Bad Request";
+        break;
+    case 501:
+        reason = "Not Implemented";
+        break;
+    case 502:
+        reason = "Bad Gateway";
+        break;
+    case 504:
+        reason = "Gateway Timeout";
+        break;
+    default:
+        reason = "Error";
+    }
+
+    int body_len = snprintf(body, sizeof(body), "%d %s\n", status, reason);
+    int n = snprintf(buf, size, "HTTP/1.1 %d %s\r\nContent-Type: text/plain\r\nContent-Length: %d\r\n%s\r\n%s",
+                     status, reason, body_len, keep_alive ? keep_alive_hdr : close_hdr, body);
+
+    return n < 0 || (size_t)n >= size ? 0 : n;
+}
+
+// Turns the ETag and Last-Modified of a cached response head into the
+// header lines revalidating it. Returns their length, 0 if it has neither
+// or they do not fit.
+size_t http_format_validators(const char *head, size_t len, char *buf, size_t size)
+{
+    const char *p = head, *end = head + len;
+    size_t n = 0;
+
+    while (p < end) {
+        const char *eol = memchr(p, '\n', end - p);
+        const char *name = NULL;
+        size_t skip = 0;
+
+        if (eol == NULL || eol - p <= 1) {
+            break;
+        }
+        if (strncasecmp(p, "ETag:", 5) == 0) {
+            name = "If-None-Match:";
+            skip = 5;
+        } else if (strncasecmp(p, "Last-Modified:", 14) == 0) {
+            name = "If-Modified-Since:";
+            skip = 14;
+        }
+        if (name != NULL) {
+            int m = snprintf(buf + n, size - n, "%s%.*s", name, (int)(eol + 1 - p - skip), p + skip);
+            if (m < 0 || m >= size - n) {
+                return 0;
+            }
+            n += m;
+        }
+        p = eol + 1;
+    }
+
+    return n;
+}
+
+// Turns the strong ETag of a response head, or failing that its
+// Last-Modified, into an If-Range line. Returns its length, 0 if it has
+// neither or the line does not fit.
+size_t http_format_if_range(const char *head, size_t len, char *buf, size_t size)
+{
+    const char *value;
+    size_t n;
+    int m;
+
+    if ((value = header_value(head, len, "ETag", &n)) == NULL || n < 2 || value[0] != '"') {
+        value = header_value(head, len, "Last-Modified", &n);
+    }
+    if (value == NULL || n == 0) {
+        return 0;
+    }
+    m = snprintf(buf, size, "If-Range: %.*s\r\n", (int)n, value);
+    return m < 0 || (size_t)m >= size ? 0 : m;
+}
+
+// Parses a complete response head held in buf. Returns the offset of the
+// empty line ending it, or -1 if buf holds no HTTP/1.x head.
+long http_parse_response_head(const char *buf, size_t len, http_response *response)
+{
+    char line[MAXLINE];
+    const char *p = buf, *end = buf + len;
+
+    http_response_init(response);
+    while (p < end) {
+        const char *eol = memchr(p, '\n', end - p);
+        size_t n = eol != NULL ? eol + 1 - p : 0;
+
+        if (n == 0 || n >= MAXLINE) {
+            return -1;
+        }
+        memcpy(line, p, n);
+        line[n] = '\0';
+
+        if (p == buf) {
+            if (http_parse_status_line(line, response) < 0) {
+                return -1;
+            }
+        } else if (strcmp(line, "\r\n") == 0 || strcmp(line, "\n") == 0) {
+            return p - buf;
+        } else {
+            http_parse_response_header(line, response);
+        }
+        p += n;
+    }
+
+    return -1;
+}
+
+// Resolves the request's byte range against a body of length bytes into
+// *first and *last. Returns 206 if the range can be served, 416 if it
+// lies wholly past the end, and 200 if the whole body is to be sent.
+int http_range_resolve(http_request *request, long long length, long long *first, long long *last)
+{
+    if (!request->range) {
+        return 200;
+    }
+
+    // A suffix takes the last bytes, however many there are
+    if (request->range_first < 0) {
+        if (request->range_last == 0 || length == 0) {
+            return 416;
+        }
+        *first = request->range_last < length ? length - request->range_last : 0;
+        *last = length - 1;
+        return 206;
+    }
+
+    if (request->range_first >= length) {
+        return 416;
+    }
+    *first = request->range_first;
+    *last = request->range_last < 0 || request->range_last >= length ? length - 1 : request->range_last;
+    return 206;
+}
+
+// Whether the response head of len bytes is the one If-Range names, so
+// a range of it may be sent; without If-Range any will do. Weak entity
+// tags never match.
+int http_if_range_matches(http_request *request, const char *head, size_t len)
+{
+    const char *value;
+    size_t n;
+
+    if (request->if_range == NULL) {
+        return 1;
+    }
+    if (request->if_range_len >= 2 && strncmp(request->if_range, "W/", 2) == 0) {
+        return 0;
+    }
+
+    // An entity tag is quoted; anything else is a Last-Modified date
+    if (request->if_range[0] == '"') {
+        value = header_value(head, len, "ETag", &n);
+    } else {
+        value = header_value(head, len, "Last-Modified", &n);
+    }
+    return value != NULL && n == request->if_range_len && memcmp(value, request->if_range, n) == 0;
+}
+
+// Lays out the head of a 206 carrying bytes first..last of a cached
+// response, whose head is len bytes and whose body is length bytes, or of
+// a 416 if first is -1. Framing headers are replaced, and the head is
+// left open for the Connection header and the empty line. Returns its
+// length, 0 if it does not fit.
+size_t http_format_partial(const char *head, size_t len, long long first, long long last, long long length,
+                           char *buf, size_t size)
+{
+    const char *p = memchr(head, '\n', len), *end = head + len, *eol;
+    size_t n;
+    int m;
+
+    if (first < 0) {
+        m = snprintf(buf, size, "HTTP/1.1 416 Range Not Satisfiable\r\nContent-Range: bytes */%lld\r\n"
+                     "Content-Length: 0\r\n", length);
+        return m < 0 || (size_t)m >= size ? 0 : m;
+    }
+
+    // The status line keeps the cached response's version
+    m = snprintf(buf, size, "%.8s 206 Partial Content\r\n", head);
+    if (m < 0 || (size_t)m >= size || p == NULL) {
+        return 0;
+    }
+    n = m;
+    for (p++; p < end; p = eol + 1) {
+        eol = memchr(p, '\n', end - p);
+        if (eol == NULL || eol - p <= 1) {
+            break;
+        }
+        if (strncasecmp(p, "Content-Length:", 15) == 0 || strncasecmp(p, "Content-Range:", 14) == 0) {
+            continue;
+        }
+        if (n + (eol + 1 - p) >= size) {
+            return 0;
+        }
+        memcpy(buf + n, p, eol + 1 - p);
+        n += eol + 1 - p;
+    }
+
+    m = snprintf(buf + n, size - n, "Content-Range: bytes %lld-%lld/%lld\r\nContent-Length: %lld\r\n",
+                 first, last, length, last - first + 1);
+    return m < 0 || (size_t)m >= size - n ? 0 : n + m;
+}
+
+// Connection headers describe one hop; the proxy sends its own
+int http_is_hop_header(const char *line)
+{
+    const char *hop_hdrs[] = {"Connection:", "Keep-Alive:", "Proxy-Connection:"};
+
+    for (int i = 0; i < sizeof(hop_hdrs) / sizeof(hop_hdrs[0]); i++) {
+        if (strncasecmp(line, hop_hdrs[i], strlen(hop_hdrs[i])) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// ========================================================== //
+// ==================== Helper Functions ==================== //
+// ========================================================== //
+
+// Case-insensitive match of a header name that is not NUL-terminated
+static int name_is(const char *key, size_t len, const char *name)
+{
+    return strlen(name) == len && strncasecmp(key, name, len) == 0;
+}
+
+// Whether a comma-separated header value lists token, as a whole item
+static int has_token(const char *value, const char *token)
+{
+    const char *p = value;
+
+    while (*p != '\0') {
+        p += strspn(p, " \t,");
+        size_t n = strcspn(p, ",\r\n"), len = n;
+        while (len > 0 && (p[len - 1] == ' ' || p[len - 1] == '\t')) {
+            len--;
+        }
+        if (name_is(p, len, token)) {
+            return 1;
+        }
+        p += n;
+        if (*p == '\r' || *p == '\n') {
+            break;
+        }
+    }
+    return 0;
+}
+
+// Whether an Accept-Encoding value lists gzip without ruling it out with q=0
+static int accepts_gzip(const char *value, size_t len)
+{
+    const char *p = value, *end = value + len;
+
+    while (p < end) {
+        const char *item_end = memchr(p, ',', end - p);
+        if (item_end == NULL) {
+            item_end = end;
+        }
+        while (p < item_end && (*p == ' ' || *p == '\t')) {
+            p++;
+        }
+        size_t n = 0;
+        while (p + n < item_end && p[n] != ';' && p[n] != ' ' && p[n] != '\t') {
+            n++;
+        }
+
+        if ((n == 4 && strncasecmp(p, "gzip", 4) == 0) || (n == 6 && strncasecmp(p, "x-gzip", 6) == 0)) {
+            const char *q = memchr(p, ';', item_end - p);
+            if (q == NULL) {
+                return 1;
+            }
+            q++;
+            while (q < item_end && (*q == ' ' || *q == '\t')) {
+                q++;
+            }
+            if (item_end - q < 2 || strncasecmp(q, "q=", 2) != 0) {
+                return 1;
+            }
+            // Any non-zero weight will do
+            q += 2;
+            while (q < item_end && (*q == '0' || *q == '.')) {
+                q++;
+            }
+            return q < item_end && *q >= '1' && *q <= '9';
+        }
+        p = item_end + 1;
+    }
+    return 0;
+}
+
+// Parses a Range value naming a single byte range: "bytes=first-last",
+// "bytes=first-" or "bytes=-suffix". Returns 0 for anything else, which
+// is served as if there were no Range.
+static int parse_range(const char *value, size_t len, long long *first, long long *last)
+{
+    const char *p = value + 6, *end = value + len;
+    char *q;
+
+    if (len < 7 || strncasecmp(value, "bytes=", 6) != 0 || memchr(value, ',', len) != NULL) {
+        return 0;
+    }
+    *first = *last = -1;
+    if (*p != '-') {
+        if (*p < '0' || *p > '9') {
+            return 0;
+        }
+        *first = strtoll(p, &q, 10);
+        p = q;
+        if (p >= end || *p != '-') {
+            return 0;
+        }
+    }
+    p++;
+    if (p < end) {
+        if (*p < '0' || *p > '9') {
+            return 0;
+        }
+        *last = strtoll(p, &q, 10);
+        p = q;
+    }
+    if (p != end || (*first < 0 && *last < 0) || (*first >= 0 && *last >= 0 && *last < *first)) {
+        return 0;
+    }
+    return 1;
+}
+
+// Finds a header in a response head of len bytes. Returns its value,
+// without surrounding whitespace, or NULL if it is absent.
+static const char *header_value(const char *head, size_t len, const char *name, size_t *value_len)
+{
+    const char *p = head, *end = head + len;
+    size_t name_len = strlen(name);
+
+    while (p < end) {
+        const char *eol = memchr(p, '\n', end - p);
+        if (eol == NULL) {
+            break;
+        }
+        if (eol - p > name_len && strncasecmp(p, name, name_len) == 0 && p[name_len] == ':') {
+            const char *value = p + name_len + 1, *value_end = eol;
+            while (value < value_end && (*value == ' ' || *value == '\t')) {
+                value++;
+            }
+            while (value_end > value && (value_end[-1] == '\r' || value_end[-1] == ' ' || value_end[-1] == '\t')) {
+                value_end--;
+            }
+            *value_len = value_end - value;
+            return value;
+        }
+        p = eol + 1;
+    }
+    return NULL;
+}
+
+// Directives are comma-separated; s-maxage must not be taken for max-age
+static void parse_cache_control(const char *value, http_response *response)
+{
+    const char *p = value;
+
+    while (*p != '\0') {
+        p += strspn(p, " \t,");
+        size_t n = strcspn(p, ",\r\n");
+
+        // A directive's name is compared whole, up to its argument
+        size_t len = strcspn(p, "=, \t\r\n");
+        int arg = p[len] == '=';
+
+        if (name_is(p, len, "s-maxage") && arg) {
+            response->s_maxage = atol(p + len + 1);
+        } else if (name_is(p, len, "max-age") && arg) {
+            response->max_age = atol(p + len + 1);
+        } else if (name_is(p, len, "no-store") || name_is(p, len, "private")) {
+            response->no_store = 1;
+        } else if (name_is(p, len, "no-cache")) {
+            response->no_cache = 1;
+        }
+        p += n;
+        if (*p == '\r' || *p == '\n') {
+            break;
+        }
+    }
+}
+
+// The statuses RFC 9110 lets a cache store without explicit freshness
+static int cacheable_by_default(int status)
+{
+    switch (status) {
+    case 200:
+    case 203:
+    case 204:
+    case 300:
+    case 301:
+    case 308:
+    case 404:
+    case 405:
+    case 410:
+    case 414:
+    case 501:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+// Parses an IMF-fixdate such as "Sun, 06 Nov 1994 08:49:37 GMT".
+// Returns -1 if malformed.
+static time_t parse_http_date(const char *value)
+{
+    const char *months = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    char month[4];
+    struct tm tm;
+    const char *m;
+
+    memset(&tm, 0, sizeof(tm));
+    if (sscanf(value, " %*3s, %d %3s %d %d:%d:%d GMT", &tm.tm_mday, month, &tm.tm_year,
+               &tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 6 || (m = strstr(months, month)) == NULL ||
+        (m - months) % 3 != 0) {
+        return -1;
+    }
+    tm.tm_mon = (m - months) / 3;
+    tm.tm_year -= 1900;
+
+    return timegm(&tm);
+}
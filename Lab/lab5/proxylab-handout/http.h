@@ -0,0 +1,101 @@
+/* Headers the proxy always sends upstream */
+extern const char *user_agent_hdr;
+extern const char *keep_alive_hdr;
+extern const char *close_hdr;
+
+/* Request headers forwarded upstream; a request with more is rejected */
+#define HTTP_MAX_HEADERS 32
+
+/* Slices http_request_iov() lays an upstream request out in */
+#define HTTP_REQUEST_IOV (4 * HTTP_MAX_HEADERS + 8)
+
+/* Longest "hostname:port" accepted in a request URI */
+#define HTTP_MAX_HOST 256
+
+/* Request head bytes buffered per connection, pipelined requests included */
+#define HTTP_HEAD_SIZE MAXBUF
+
+/* Name and value are slices of the request head, which is left intact so
+ * whole lines can be forwarded as they are */
+typedef struct http_header {
+    char *key;
+    size_t key_len;
+    char *value;
+    size_t value_len;
+} http_header;
+
+typedef struct http_request {
+    char *uri;                  // These point into the head...
+    char *path;
+    char *host;                 // ...or into names
+    char *hostname;
+    char *port;
+    int keep_alive;             // The client wants the connection kept open
+    int conditional;            // The client sent its own validators
+    int accept_gzip;            // The client takes Content-Encoding: gzip
+    int range;                  // The client asked for a single byte range:
+    long long range_first;      // -1 for the last range_last bytes
+    long long range_last;       // -1 for everything from range_first on
+    char *if_range;             // If-Range value in the head, or NULL
+    size_t if_range_len;
+    int own_range;              // Upstream requests carry the proxy's own
+                                // Range, so the client's range headers are
+                                // left out
+
+    http_header hdrs[HTTP_MAX_HEADERS];
+    int nhdrs;
+    char names[2 * HTTP_MAX_HOST + 2];
+} http_request;
+
+/* Incremental parser buffering one connection's request heads */
+typedef struct http_parser {
+    char buf[HTTP_HEAD_SIZE];
+    size_t len;                 // Bytes buffered
+    size_t scanned;             // Start of the first line not yet complete
+    size_t consumed;            // Head of the request last returned
+} http_parser;
+
+typedef struct http_response {
+    int status;
+    long long content_length;   // -1 if absent
+    int chunked;
+    int close;                  // The connection ends with this response
+    long long range_first;      // Content-Range of a 206, -1 if absent
+    long long range_last;
+    long long range_length;     // -1 if absent or unknown ("*")
+
+    // Caching
+    int no_store;               // no-store or private: not for a shared cache
+    int no_cache;               // Revalidate before every use
+    long max_age;               // -1 if absent
+    long s_maxage;              // -1 if absent; overrides max_age
+    long age;                   // Seconds the response already spent in caches
+    time_t date;                // 0 if absent
+    time_t expires;             // 0 if absent, -1 if invalid (already stale)
+} http_response;
+
+void http_request_init(http_request *request);
+size_t http_request_head_end(char *buf, size_t *len, size_t *scanned);
+int http_parse_request(char *buf, size_t len, http_request *request);
+void http_parser_init(http_parser *parser);
+int http_parser_next(http_parser *parser, http_request *request);
+int http_parser_pending(http_parser *parser);
+int http_request_iov(http_request *request, struct iovec *iov, int keep_alive, const char *validators);
+size_t http_format_request(http_request *request, char *buf, size_t size, int keep_alive);
+
+void http_response_init(http_response *response);
+int http_parse_status_line(const char *line, http_response *response);
+void http_parse_response_header(const char *line, http_response *response);
+int http_response_has_body(http_response *response);
+int http_response_is_framed(http_response *response);
+int http_response_cacheable(http_response *response);
+time_t http_response_expires(http_response *response, time_t now);
+size_t http_format_error(int status, int keep_alive, char *buf, size_t size);
+size_t http_format_validators(const char *head, size_t len, char *buf, size_t size);
+size_t http_format_if_range(const char *head, size_t len, char *buf, size_t size);
+long http_parse_response_head(const char *buf, size_t len, http_response *response);
+int http_range_resolve(http_request *request, long long length, long long *first, long long *last);
+int http_if_range_matches(http_request *request, const char *head, size_t len);
+size_t http_format_partial(const char *head, size_t len, long long first, long long last, long long length,
+                           char *buf, size_t size);
+int http_is_hop_header(const char *line);
@@ -0,0 +1,385 @@
+/*
+ * loadgen.c - HTTP load generator for the proxy
+ *
+ * Sends requests through the proxy from a number of concurrent client
+ * threads, cycling over the given URLs, and reports throughput and
+ * latency percentiles. By default every request opens a connection; with
+ * -k each client keeps one HTTP/1.1 connection open, and -P sends that
+ * many requests back to back before reading the responses. Keep-alive
+ * responses must carry a Content-Length.
+ *
+ * -f adds a request mix: one URL per line, optionally preceded by its
+ * weight. URLs are then drawn by weight from a hash of the request
+ * number, so every run sends the same requests whatever the timing.
+ *
+ * -a injects faults: that percentage of the requests is abandoned after a
+ * random part of the response, resetting the connection, so the proxy
+ * sees clients die mid-stream. Abandoned requests are neither failures
+ * nor part of the latency figures.
+ *
+ * usage: ./loadgen [-c concurrency] [-n requests] [-k] [-P depth] [-a percent]
+ *                  [-f mix_file] <proxy_host> <proxy_port> [url...]
+ */
+#include <stdatomic.h>
+#include <time.h>
+#include "csapp.h"
+
+#define DEFAULT_CONCURRENCY 16
+#define DEFAULT_REQUESTS 10000
+
+/* Abandoned requests read at most this much of the response first */
+#define ABORT_MAX_BYTES (256 * 1024)
+
+static char *proxy_host, *proxy_port;
+static char **urls;
+static double *cumulative;     // Running sum of the weights
+static int nurls, nrequests, weighted;
+static int keep_alive, depth = 1, abort_percent;
+
+static atomic_int next_request;
+static atomic_int failures, aborted;
+static atomic_long total_bytes;
+static double *latencies;      // Seconds, indexed by request number; -1 if abandoned
+
+// Adds url with weight to the mix
+static void add_url(char *url, double weight)
+{
+    urls = Realloc(urls, (nurls + 1) * sizeof(char *));
+    cumulative = Realloc(cumulative, (nurls + 1) * sizeof(double));
+    urls[nurls] = url;
+    cumulative[nurls] = (nurls > 0 ? cumulative[nurls - 1] : 0) + weight;
+    nurls++;
+}
+
+// Reads "[weight] url" lines; blank lines and # comments are skipped
+static int read_mix(const char *path)
+{
+    char line[MAXLINE], url[MAXLINE];
+    double weight;
+    FILE *fp = fopen(path, "r");
+
+    if (fp == NULL) {
+        return -1;
+    }
+    while (fgets(line, MAXLINE, fp) != NULL) {
+        if (sscanf(line, "%lf %s", &weight, url) == 2) {
+            if (weight > 0) {
+                add_url(strdup(url), weight);
+            }
+        } else if (sscanf(line, "%s", url) == 1 && url[0] != '#') {
+            add_url(strdup(url), 1);
+        }
+    }
+    fclose(fp);
+    return 0;
+}
+
+// Returns the URL of request i, drawn by weight from a hash of i
+static char *url_of(int i)
+{
+    unsigned long long x = i + 0x9e3779b97f4a7c15ULL;
+    int lo = 0, hi = nurls - 1;
+
+    if (!weighted) {
+        return urls[i % nurls];
+    }
+
+    // splitmix64
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    double r = (x >> 11) * 0x1p-53 * cumulative[nurls - 1];
+
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (cumulative[mid] > r) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    return urls[lo];
+}
+
+// Error statuses count as failures
+static int status_ok(const char *buf, size_t len)
+{
+    return len >= 12 && strncmp(buf, "HTTP/", 5) == 0 && (buf[9] == '2' || buf[9] == '3');
+}
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Fetches url through the proxy, or, if limit is not negative, about
+// limit bytes of it before resetting the connection. Returns bytes
+// received, or -1 on error or an error status.
+static long fetch(char *url, long limit)
+{
+    int fd, ok = 0;
+    long bytes = 0;
+    ssize_t n;
+    char buf[MAXBUF];
+    struct linger reset = {1, 0};
+
+    if ((fd = open_clientfd(proxy_host, proxy_port)) < 0) {
+        return -1;
+    }
+
+    snprintf(buf, MAXBUF, "GET %s HTTP/1.0\r\n\r\n", url);
+    if (rio_writen(fd, buf, strlen(buf)) < 0) {
+        close(fd);
+        return -1;
+    }
+    while ((limit < 0 || bytes <= limit) && (n = read(fd, buf, MAXBUF)) > 0) {
+        if (bytes == 0) {
+            ok = status_ok(buf, n);
+        }
+        bytes += n;
+    }
+    if (limit >= 0) {
+        setsockopt(fd, SOL_SOCKET, SO_LINGER, &reset, sizeof(reset));
+        close(fd);
+        return bytes;
+    }
+    close(fd);
+
+    return n < 0 || !ok ? -1 : bytes;
+}
+
+// Reads one response framed by Content-Length. Returns the bytes read,
+// or -1 on error or an error status. *closing is set if the proxy will
+// close the connection.
+static long read_response(rio_t *rio, int *closing)
+{
+    char buf[MAXBUF];
+    long bytes = 0, length = -1;
+    ssize_t n;
+    int ok = 0;
+
+    while ((n = rio_readlineb(rio, buf, MAXBUF)) > 0) {
+        if (bytes == 0) {
+            ok = status_ok(buf, n);
+        }
+        bytes += n;
+        if (strncasecmp(buf, "Content-Length:", 15) == 0) {
+            length = atol(buf + 15);
+        } else if (strncasecmp(buf, "Connection:", 11) == 0 && strstr(buf + 11, "close") != NULL) {
+            *closing = 1;
+        } else if (strcmp(buf, "\r\n") == 0) {
+            break;
+        }
+    }
+    if (n <= 0 || length < 0) {
+        return -1;
+    }
+
+    while (length > 0) {
+        if ((n = rio_readnb(rio, buf, length < MAXBUF ? length : MAXBUF)) <= 0) {
+            return -1;
+        }
+        bytes += n;
+        length -= n;
+    }
+
+    return ok ? bytes : -1;
+}
+
+// Keep-alive client: requests go depth at a time over one connection,
+// which is reopened whenever the proxy closes it
+static void keep_alive_client()
+{
+    int i, fd = -1, closing = 0;
+    char buf[MAXBUF * 4];
+    rio_t rio;
+
+    while ((i = atomic_fetch_add(&next_request, depth)) < nrequests) {
+        int batch = nrequests - i < depth ? nrequests - i : depth;
+        size_t len = 0;
+
+        if (fd < 0) {
+            if ((fd = open_clientfd(proxy_host, proxy_port)) < 0) {
+                atomic_fetch_add(&failures, batch);
+                continue;
+            }
+            rio_readinitb(&rio, fd);
+            closing = 0;
+        }
+
+        for (int j = 0; j < batch; j++) {
+            len += snprintf(buf + len, sizeof(buf) - len, "GET %s HTTP/1.1\r\n\r\n", url_of(i + j));
+        }
+
+        double start = now();
+        int sent = rio_writen(fd, buf, len) == len;
+        for (int j = 0; j < batch; j++) {
+            long bytes = sent ? read_response(&rio, &closing) : -1;
+            latencies[i + j] = now() - start;
+
+            if (bytes < 0) {
+                atomic_fetch_add(&failures, batch - j);
+                for (; j < batch; j++) {
+                    latencies[i + j] = now() - start;
+                }
+                closing = 1;
+                break;
+            }
+            atomic_fetch_add(&total_bytes, bytes);
+        }
+
+        if (closing) {
+            close(fd);
+            fd = -1;
+        }
+    }
+
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+static void *client_thread(void *vargp)
+{
+    int i;
+    unsigned int seed = (unsigned int)(long)vargp;
+
+    if (keep_alive) {
+        keep_alive_client();
+        return NULL;
+    }
+
+    while ((i = atomic_fetch_add(&next_request, 1)) < nrequests) {
+        if (rand_r(&seed) % 100 < abort_percent) {
+            fetch(url_of(i), rand_r(&seed) % ABORT_MAX_BYTES);
+            latencies[i] = -1;
+            atomic_fetch_add(&aborted, 1);
+            continue;
+        }
+
+        double start = now();
+        long bytes = fetch(url_of(i), -1);
+        latencies[i] = now() - start;
+
+        if (bytes < 0) {
+            atomic_fetch_add(&failures, 1);
+        } else {
+            atomic_fetch_add(&total_bytes, bytes);
+        }
+    }
+
+    return NULL;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Of the requests measured, which come first once sorted
+static double percentile(double p, int measured)
+{
+    int i = (int)(p / 100.0 * measured);
+    return latencies[i < measured ? i : measured - 1];
+}
+
+int main(int argc, char *argv[])
+{
+    int opt, concurrency = DEFAULT_CONCURRENCY;
+    pthread_t *tids;
+
+    nrequests = DEFAULT_REQUESTS;
+    while ((opt = getopt(argc, argv, "c:n:kP:a:f:")) != -1) {
+        switch (opt) {
+        case 'c':
+            concurrency = atoi(optarg);
+            break;
+        case 'n':
+            nrequests = atoi(optarg);
+            break;
+        case 'k':
+            keep_alive = 1;
+            break;
+        case 'P':
+            depth = atoi(optarg);
+            keep_alive = 1;
+            break;
+        case 'a':
+            abort_percent = atoi(optarg);
+            break;
+        case 'f':
+            if (read_mix(optarg) < 0) {
+                fprintf(stderr, "%s: cannot read %s\n", argv[0], optarg);
+                exit(1);
+            }
+            weighted = 1;
+            break;
+        default:
+            goto usage;
+        }
+    }
+    if (argc - optind < 2 || concurrency <= 0 || nrequests <= 0 || depth <= 0 || depth > 64 ||
+        abort_percent < 0 || abort_percent > 100 || (abort_percent > 0 && keep_alive)) {
+        goto usage;
+    }
+    proxy_host = argv[optind];
+    proxy_port = argv[optind + 1];
+    for (int i = optind + 2; i < argc; i++) {
+        add_url(argv[i], 1);
+    }
+    if (nurls == 0) {
+        goto usage;
+    }
+
+    // Closed connections mid-request must not kill the generator
+    Signal(SIGPIPE, SIG_IGN);
+
+    latencies = Calloc(nrequests, sizeof(double));
+    tids = Calloc(concurrency, sizeof(pthread_t));
+
+    double start = now();
+    for (int i = 0; i < concurrency; i++) {
+        Pthread_create(&tids[i], NULL, client_thread, (void *)(long)(i + 1));
+    }
+    for (int i = 0; i < concurrency; i++) {
+        Pthread_join(tids[i], NULL);
+    }
+    double elapsed = now() - start;
+
+    // Abandoned requests sort first
+    qsort(latencies, nrequests, sizeof(double), compare_double);
+    int measured = nrequests - atomic_load(&aborted);
+    latencies += nrequests - measured;
+
+    printf("requests:    %d (%d failed", nrequests, atomic_load(&failures));
+    if (abort_percent > 0) {
+        printf(", %d abandoned", atomic_load(&aborted));
+    }
+    printf(")\n");
+    if (weighted) {
+        printf("mix:         %d urls, weighted\n", nurls);
+    }
+    printf("concurrency: %d%s", concurrency, keep_alive ? ", keep-alive" : "");
+    if (depth > 1) {
+        printf(", pipeline depth %d", depth);
+    }
+    printf("\n");
+    printf("elapsed:     %.3f s\n", elapsed);
+    printf("throughput:  %.1f req/s, %.2f MB/s\n", nrequests / elapsed,
+           atomic_load(&total_bytes) / elapsed / (1 << 20));
+    if (measured > 0) {
+        printf("latency:     p50 %.3f ms, p99 %.3f ms, p999 %.3f ms, max %.3f ms\n",
+               percentile(50, measured) * 1e3, percentile(99, measured) * 1e3, percentile(99.9, measured) * 1e3,
+               latencies[measured - 1] * 1e3);
+    }
+
+    return 0;
+
+usage:
+    fprintf(stderr, "usage: %s [-c concurrency] [-n requests] [-k] [-P depth] [-a percent]\n", argv[0]);
+    fprintf(stderr, "          [-f mix_file] <proxy_host> <proxy_port> [url...]\n");
+    exit(1);
+}
@@ -0,0 +1,273 @@
+/*
+ * log.c - Access and debug log
+ *
+ * Request threads never touch the log stream. Each appends fixed-size
+ * binary records to a ring of its own, without locks, and a background
+ * thread drains every ring each LOG_FLUSH_MS and formats the records as
+ * text. A full ring drops records rather than stall its thread. Below the
+ * level a call is for, it returns at once.
+ */
+#include <stdatomic.h>
+#include <time.h>
+#include "csapp.h"
+#include "log.h"
+
+int log_level = LOG_OFF;
+
+static FILE *log_fp;
+static log_ring *rings;         // Every thread's ring, newest first
+static pthread_mutex_t rings_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t ring_key;
+static __thread log_ring *thread_ring;
+
+// Response noted by whoever sent it, for the thread's next access record
+static __thread int pending_status;
+static __thread size_t pending_bytes;
+static __thread int pending_outcome = -1;
+
+// Statistics
+static atomic_ulong log_records, log_dropped;
+
+static const char *level_names[] = {"off", "access", "debug"};
+static const char *outcome_names[] = {"MISS", "HIT", "DISK_HIT", "COALESCED", "REVALIDATED"};
+
+// Helper functions
+static log_record *ring_slot();
+static void ring_commit();
+static void ring_close(void *ring);
+static void *drain_thread(void *vargp);
+static void drain(log_ring *ring);
+static void format_record(log_record *rec);
+
+// Starts the drain thread writing to fp, unless level is LOG_OFF
+void log_init(int level, FILE *fp)
+{
+    pthread_t tid;
+
+    log_level = level;
+    log_fp = fp;
+    if (level == LOG_OFF) {
+        return;
+    }
+
+    pthread_key_create(&ring_key, ring_close);
+    Pthread_create(&tid, NULL, drain_thread, NULL);
+}
+
+// Returns the level called name, or -1
+int log_level_lookup(const char *name)
+{
+    for (int i = 0; i < sizeof(level_names) / sizeof(level_names[0]); i++) {
+        if (strcasecmp(level_names[i], name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+long long log_now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+// Notes the response the current request got, for log_access()
+void log_response(int status, size_t bytes)
+{
+    if (log_level < LOG_ACCESS) {
+        return;
+    }
+    pending_status = status;
+    pending_bytes = bytes;
+}
+
+// Overrides the outcome log_access() is given, for cases only the code
+// sending the response can tell
+void log_response_outcome(log_outcome outcome)
+{
+    if (log_level < LOG_ACCESS) {
+        return;
+    }
+    pending_outcome = outcome;
+}
+
+// Records a request that started at start_us and is now over, with the
+// response noted by log_response()
+void log_access(const char *uri, log_outcome outcome, long long start_us)
+{
+    log_record *rec;
+
+    if (log_level < LOG_ACCESS) {
+        return;
+    }
+
+    if ((rec = ring_slot()) != NULL) {
+        size_t len = strlen(uri);
+
+        rec->time_us = start_us;
+        rec->latency_us = log_now_us() - start_us;
+        rec->status = pending_status;
+        rec->outcome = pending_outcome >= 0 ? pending_outcome : outcome;
+        rec->bytes = pending_bytes;
+        rec->text_len = len < LOG_TEXT_MAX ? len : LOG_TEXT_MAX;
+        memcpy(rec->text, uri, rec->text_len);
+        ring_commit();
+    }
+
+    pending_status = 0;
+    pending_bytes = 0;
+    pending_outcome = -1;
+}
+
+// Records a formatted message at LOG_DEBUG
+void log_debug(const char *fmt, ...)
+{
+    log_record *rec;
+    char text[LOG_TEXT_MAX + 1];
+    va_list ap;
+
+    if (log_level < LOG_DEBUG || (rec = ring_slot()) == NULL) {
+        return;
+    }
+
+    va_start(ap, fmt);
+    int len = vsnprintf(text, sizeof(text), fmt, ap);
+    va_end(ap);
+    len = len < 0 ? 0 : len < LOG_TEXT_MAX ? len : LOG_TEXT_MAX;
+    while (len > 0 && text[len - 1] == '\n') {
+        len--;
+    }
+
+    rec->time_us = log_now_us();
+    rec->latency_us = 0;
+    rec->status = 0;
+    rec->outcome = LOG_MESSAGE;
+    rec->bytes = 0;
+    rec->text_len = len;
+    memcpy(rec->text, text, len);
+    ring_commit();
+}
+
+void log_stats(FILE *fp)
+{
+    fprintf(fp, "log: level=%s records=%lu dropped=%lu\n", level_names[log_level],
+            atomic_load(&log_records), atomic_load(&log_dropped));
+}
+
+// ========================================================== //
+// ==================== Helper Functions ==================== //
+// ========================================================== //
+
+// Returns the next free record of the thread's ring, creating the ring on
+// first use, or NULL if the ring is full
+static log_record *ring_slot()
+{
+    log_ring *ring = thread_ring;
+
+    if (ring == NULL) {
+        ring = Calloc(1, sizeof(log_ring));
+        pthread_mutex_lock(&rings_mutex);
+        ring->next = rings;
+        rings = ring;
+        pthread_mutex_unlock(&rings_mutex);
+        pthread_setspecific(ring_key, ring);
+        thread_ring = ring;
+    }
+
+    unsigned long head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&ring->tail, memory_order_acquire) == LOG_RING_SIZE) {
+        atomic_fetch_add(&log_dropped, 1);
+        return NULL;
+    }
+    return &ring->records[head % LOG_RING_SIZE];
+}
+
+// Hands the record ring_slot() returned to the drain thread
+static void ring_commit()
+{
+    log_ring *ring = thread_ring;
+    unsigned long head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+// Thread exit: the drain thread frees the ring once it is empty
+static void ring_close(void *ring)
+{
+    atomic_store(&((log_ring *)ring)->closed, 1);
+}
+
+static void *drain_thread(void *vargp)
+{
+    struct timespec interval = {0, LOG_FLUSH_MS * 1000000L};
+
+    Pthread_detach(pthread_self());
+    while (1) {
+        nanosleep(&interval, NULL);
+
+        // Rings are only ever added at the head, and only this thread
+        // removes them, so the list can be walked without the lock
+        pthread_mutex_lock(&rings_mutex);
+        log_ring *ring = rings;
+        pthread_mutex_unlock(&rings_mutex);
+        for (; ring != NULL; ring = ring->next) {
+            drain(ring);
+        }
+        fflush(log_fp);
+
+        // Free the rings of threads that exited, now that they are empty
+        pthread_mutex_lock(&rings_mutex);
+        for (log_ring **link = &rings; *link != NULL;) {
+            ring = *link;
+            if (atomic_load(&ring->closed) && atomic_load(&ring->head) == atomic_load(&ring->tail)) {
+                *link = ring->next;
+                Free(ring);
+            } else {
+                link = &ring->next;
+            }
+        }
+        pthread_mutex_unlock(&rings_mutex);
+    }
+
+    return NULL;
+}
+
+static void drain(log_ring *ring)
+{
+    unsigned long tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    unsigned long head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+    atomic_fetch_add(&log_records, head - tail);
+    for (; tail != head; tail++) {
+        format_record(&ring->records[tail % LOG_RING_SIZE]);
+        atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+    }
+}
+
+// One line per record:
+// "<date> <time> <outcome> <uri> <status> <bytes> <latency>", or
+// "<date> <time> debug <message>"
+static void format_record(log_record *rec)
+{
+    char when[32];
+    struct tm tm;
+    time_t sec = rec->time_us / 1000000;
+
+    localtime_r(&sec, &tm);
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &tm);
+
+    if (rec->outcome == LOG_MESSAGE) {
+        fprintf(log_fp, "%s.%03lld debug %.*s\n", when, rec->time_us / 1000 % 1000, rec->text_len, rec->text);
+        return;
+    }
+
+    fprintf(log_fp, "%s.%03lld %s %.*s ", when, rec->time_us / 1000 % 1000, outcome_names[rec->outcome],
+            rec->text_len, rec->text);
+    if (rec->status != 0) {
+        fprintf(log_fp, "%u ", rec->status);
+    } else {
+        fprintf(log_fp, "- ");
+    }
+    fprintf(log_fp, "%llu %.3fms\n", rec->bytes, rec->latency_us / 1000.0);
+}
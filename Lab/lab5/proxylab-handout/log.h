@@ -0,0 +1,55 @@
+/* Verbosity: nothing, one record per request, or also debug messages */
+#define LOG_OFF 0
+#define LOG_ACCESS 1
+#define LOG_DEBUG 2
+
+/* Records buffered per thread; records arriving at a full ring are dropped */
+#define LOG_RING_SIZE 4096
+
+/* URI or message bytes kept per record, making records 128 bytes */
+#define LOG_TEXT_MAX 104
+
+/* Milliseconds between drains of the rings */
+#define LOG_FLUSH_MS 100
+
+/* How a request was served */
+typedef enum log_outcome {
+    LOG_MISS,                   // Fetched from the origin
+    LOG_HIT,                    // Served from memory
+    LOG_DISK_HIT,               // Served from the disk tier
+    LOG_COALESCED,              // Served from another request's fetch
+    LOG_REVALIDATED,            // Stale, and the origin confirmed it
+    LOG_MESSAGE,                // Not a request: a debug message
+} log_outcome;
+
+/* Fixed-size binary record; the drain thread formats it */
+typedef struct log_record {
+    long long time_us;          // Wall clock when the request started
+    unsigned int latency_us;
+    unsigned short status;      // 0 if no response was sent
+    unsigned char outcome;
+    unsigned char text_len;
+    unsigned long long bytes;   // Response bytes sent to the client
+    char text[LOG_TEXT_MAX];    // URI, or the message, truncated
+} log_record;
+
+/* Single-producer ring: written only by its thread, read only by the
+ * drain thread */
+typedef struct log_ring {
+    log_record records[LOG_RING_SIZE];
+    _Atomic unsigned long head; // Records written
+    _Atomic unsigned long tail; // Records drained
+    _Atomic int closed;         // The thread exited; freed once drained
+    struct log_ring *next;
+} log_ring;
+
+extern int log_level;
+
+void log_init(int level, FILE *fp);
+int log_level_lookup(const char *name);
+long long log_now_us();
+void log_response(int status, size_t bytes);
+void log_response_outcome(log_outcome outcome);
+void log_access(const char *uri, log_outcome outcome, long long start_us);
+void log_debug(const char *fmt, ...);
+void log_stats(FILE *fp);
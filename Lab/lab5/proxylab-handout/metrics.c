@@ -0,0 +1,391 @@
+/*
+ * metrics.c - Request counters and latency histograms
+ *
+ * Every thread counts into a shard of its own with plain relaxed stores,
+ * so recording costs no lock and no contended cache line. A scrape of
+ * METRICS_PATH on the admin port sums the shards and answers in the
+ * Prometheus text format, together with the cache's own counters. The
+ * shards of exited threads are folded into one retired shard.
+ */
+#include <stdatomic.h>
+#include <sys/resource.h>
+#include "csapp.h"
+#include "cache.h"
+#include "compress.h"
+#include "metrics.h"
+
+int metrics_enabled = 0;
+
+static metrics_shard *shards;   // Every live thread's shard
+static metrics_shard retired;   // Sum of the shards of exited threads
+static pthread_mutex_t shards_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t shard_key;
+static __thread metrics_shard *thread_shard;
+
+// Request being served by this thread (thread engine)
+static __thread long long request_start;
+static __thread int first_byte_seen;
+static __thread int pending_status;
+static __thread size_t pending_bytes;
+static __thread int pending_outcome = -1;
+
+// Accept times by descriptor, until the request on it is picked up
+static _Atomic long long *accept_times;
+static int accept_slots;
+
+static int admin_fd = -1;
+
+static const char *histogram_names[] = {"proxy_first_byte_seconds", "proxy_upstream_connect_seconds",
+                                        "proxy_request_duration_seconds"};
+static const char *histogram_help[] = {
+    "Time from accepting the connection, or from the request's arrival on a kept-alive one, to the first response byte",
+    "Time to open an upstream connection, name resolution included; pooled connections are not counted",
+    "Time from accepting the connection, or from the request's arrival on a kept-alive one, to the last response byte",
+};
+static const char *outcome_names[] = {"miss", "hit", "disk_hit", "coalesced", "revalidated"};
+static const char *status_names[] = {"none", "1xx", "2xx", "3xx", "4xx", "5xx"};
+static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+
+// Helper functions
+static metrics_shard *shard_get();
+static void shard_retire(void *vargp);
+static void shard_add(metrics_shard *sum, metrics_shard *shard);
+static void bump(_Atomic unsigned long *counter, unsigned long n);
+static int bucket_of(long long us);
+static long long bucket_limit(int bucket);
+static void *admin_thread(void *vargp);
+static void write_metrics(FILE *fp);
+static void write_histogram(FILE *fp, metrics_histogram_id id, metrics_histogram *h);
+
+// Starts answering scrapes on 127.0.0.1:port, unless port is 0, in
+// which case nothing is recorded either
+void metrics_init(int port)
+{
+    struct sockaddr_in addr = {0};
+    struct rlimit rl;
+    int optval = 1;
+    pthread_t tid;
+
+    if (port == 0) {
+        return;
+    }
+
+    pthread_key_create(&shard_key, shard_retire);
+    getrlimit(RLIMIT_NOFILE, &rl);
+    accept_slots = rl.rlim_cur < 65536 ? rl.rlim_cur : 65536;
+    accept_times = Calloc(accept_slots, sizeof(*accept_times));
+
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if ((admin_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0 ||
+        setsockopt(admin_fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval)) < 0 ||
+        bind(admin_fd, (SA *)&addr, sizeof(addr)) < 0 || listen(admin_fd, LISTENQ) < 0) {
+        unix_error("ERROR, while opening the metrics port");
+    }
+    metrics_enabled = 1;
+    Pthread_create(&tid, NULL, admin_thread, NULL);
+}
+
+// Notes when the connection on fd was accepted
+void metrics_accepted(int fd)
+{
+    if (metrics_enabled && fd < accept_slots) {
+        atomic_store_explicit(&accept_times[fd], metrics_now_us(), memory_order_relaxed);
+    }
+}
+
+// Returns when the connection on fd was accepted, once, or 0
+long long metrics_accept_time(int fd)
+{
+    if (!metrics_enabled || fd >= accept_slots) {
+        return 0;
+    }
+    return atomic_exchange_explicit(&accept_times[fd], 0, memory_order_relaxed);
+}
+
+void metrics_observe(metrics_histogram_id id, long long us)
+{
+    if (!metrics_enabled) {
+        return;
+    }
+
+    metrics_histogram *h = &shard_get()->histograms[id];
+    if (us < 0) {
+        us = 0;
+    }
+    bump(&h->counts[bucket_of(us)], 1);
+    bump(&h->sum_us, us);
+}
+
+// Starts timing the thread's next request, at start_us or now
+void metrics_request_begin(long long start_us)
+{
+    if (!metrics_enabled) {
+        return;
+    }
+    request_start = start_us != 0 ? start_us : metrics_now_us();
+    first_byte_seen = 0;
+    pending_status = 0;
+    pending_bytes = 0;
+    pending_outcome = -1;
+}
+
+// The first response byte of the thread's request is going out
+void metrics_first_byte()
+{
+    if (metrics_enabled && !first_byte_seen) {
+        first_byte_seen = 1;
+        metrics_observe(METRICS_FIRST_BYTE, metrics_now_us() - request_start);
+    }
+}
+
+// Notes the response the thread's request got
+void metrics_response(int status, size_t bytes)
+{
+    pending_status = status;
+    pending_bytes = bytes;
+}
+
+// Overrides the outcome metrics_request_end() is given
+void metrics_response_outcome(int outcome)
+{
+    pending_outcome = outcome;
+}
+
+// Counts the thread's request, now over, as served with outcome
+void metrics_request_end(int outcome)
+{
+    metrics_request(pending_outcome >= 0 ? pending_outcome : outcome, pending_status, pending_bytes, request_start);
+}
+
+// Counts a request that started at start_us and is now over. The event
+// engine interleaves requests, so it keeps their state itself.
+void metrics_request(int outcome, int status, size_t bytes, long long start_us)
+{
+    if (!metrics_enabled) {
+        return;
+    }
+
+    metrics_shard *shard = shard_get();
+    int class = status >= 100 && status < 600 ? status / 100 : 0;
+
+    bump(&shard->requests[outcome], 1);
+    bump(&shard->bytes[outcome], bytes);
+    bump(&shard->responses[class], 1);
+    metrics_observe(METRICS_DURATION, metrics_now_us() - start_us);
+}
+
+// Monotonic microseconds, for measuring intervals
+long long metrics_now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+// ========================================================== //
+// ==================== Helper Functions ==================== //
+// ========================================================== //
+
+static metrics_shard *shard_get()
+{
+    metrics_shard *shard = thread_shard;
+
+    if (shard == NULL) {
+        shard = Calloc(1, sizeof(metrics_shard));
+        pthread_mutex_lock(&shards_mutex);
+        shard->next = shards;
+        shards = shard;
+        pthread_mutex_unlock(&shards_mutex);
+        pthread_setspecific(shard_key, shard);
+        thread_shard = shard;
+    }
+    return shard;
+}
+
+// Thread exit: the shard's counts move to the retired shard
+static void shard_retire(void *vargp)
+{
+    metrics_shard *shard = vargp;
+
+    pthread_mutex_lock(&shards_mutex);
+    for (metrics_shard **link = &shards; *link != NULL; link = &(*link)->next) {
+        if (*link == shard) {
+            *link = shard->next;
+            break;
+        }
+    }
+    shard_add(&retired, shard);
+    pthread_mutex_unlock(&shards_mutex);
+    Free(shard);
+}
+
+// Adds shard into sum. Requires shards_mutex.
+static void shard_add(metrics_shard *sum, metrics_shard *shard)
+{
+    for (int i = 0; i < METRICS_HISTOGRAMS; i++) {
+        for (int b = 0; b < METRICS_BUCKETS; b++) {
+            bump(&sum->histograms[i].counts[b], atomic_load_explicit(&shard->histograms[i].counts[b], memory_order_relaxed));
+        }
+        bump(&sum->histograms[i].sum_us, atomic_load_explicit(&shard->histograms[i].sum_us, memory_order_relaxed));
+    }
+    for (int i = 0; i < METRICS_OUTCOMES; i++) {
+        bump(&sum->requests[i], atomic_load_explicit(&shard->requests[i], memory_order_relaxed));
+        bump(&sum->bytes[i], atomic_load_explicit(&shard->bytes[i], memory_order_relaxed));
+    }
+    for (int i = 0; i < METRICS_STATUS_CLASSES; i++) {
+        bump(&sum->responses[i], atomic_load_explicit(&shard->responses[i], memory_order_relaxed));
+    }
+}
+
+// Adds n to a counter only one thread writes: a plain load and store,
+// atomic only so that a concurrent scrape reads whole values
+static void bump(_Atomic unsigned long *counter, unsigned long n)
+{
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+static int bucket_of(long long us)
+{
+    if (us < METRICS_SUB_BUCKETS) {
+        return us;
+    }
+
+    int e = 63 - __builtin_clzll(us);
+    int bucket = (e - METRICS_SUB_BITS + 1) * METRICS_SUB_BUCKETS + ((us >> (e - METRICS_SUB_BITS)) & (METRICS_SUB_BUCKETS - 1));
+    return bucket < METRICS_BUCKETS ? bucket : METRICS_BUCKETS - 1;
+}
+
+// Smallest value past bucket, in microseconds
+static long long bucket_limit(int bucket)
+{
+    if (bucket < METRICS_SUB_BUCKETS) {
+        return bucket + 1;
+    }
+
+    int e = bucket / METRICS_SUB_BUCKETS + METRICS_SUB_BITS - 1;
+    int sub = bucket % METRICS_SUB_BUCKETS;
+    return (long long)(METRICS_SUB_BUCKETS + sub + 1) << (e - METRICS_SUB_BITS);
+}
+
+// Answers one request per connection: METRICS_PATH, or 404
+static void *admin_thread(void *vargp)
+{
+    char line[MAXLINE], *body;
+    size_t len;
+    rio_t rio;
+    int fd;
+
+    Pthread_detach(pthread_self());
+    while (1) {
+        if ((fd = accept(admin_fd, NULL, NULL)) < 0) {
+            continue;
+        }
+
+        Rio_readinitb(&rio, fd);
+        if (rio_readlineb(&rio, line, MAXLINE) <= 0) {
+            close(fd);
+            continue;
+        }
+        int found = strncmp(line, "GET " METRICS_PATH " ", strlen(METRICS_PATH) + 5) == 0 ||
+                    strncmp(line, "GET " METRICS_PATH "\r", strlen(METRICS_PATH) + 5) == 0;
+
+        // The head is not needed, but the client expects it to be read
+        while (rio_readlineb(&rio, line, MAXLINE) > 0 && strcmp(line, "\r\n") != 0 && strcmp(line, "\n") != 0) {
+        }
+
+        FILE *fp = open_memstream(&body, &len);
+        if (found) {
+            write_metrics(fp);
+        } else {
+            fprintf(fp, "not found\n");
+        }
+        fclose(fp);
+
+        dprintf(fd, "HTTP/1.0 %s\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n"
+                "Connection: close\r\n\r\n", found ? "200 OK" : "404 Not Found", len);
+        rio_writen(fd, body, len);
+        free(body);
+        close(fd);
+    }
+
+    return NULL;
+}
+
+static void write_metrics(FILE *fp)
+{
+    metrics_shard *sum = Calloc(1, sizeof(metrics_shard));
+
+    pthread_mutex_lock(&shards_mutex);
+    shard_add(sum, &retired);
+    for (metrics_shard *shard = shards; shard != NULL; shard = shard->next) {
+        shard_add(sum, shard);
+    }
+    pthread_mutex_unlock(&shards_mutex);
+
+    fprintf(fp, "# HELP proxy_requests_total Requests served, by how.\n");
+    fprintf(fp, "# TYPE proxy_requests_total counter\n");
+    for (int i = 0; i < METRICS_OUTCOMES; i++) {
+        fprintf(fp, "proxy_requests_total{outcome=\"%s\"} %lu\n", outcome_names[i], atomic_load(&sum->requests[i]));
+    }
+    fprintf(fp, "# HELP proxy_response_bytes_total Response bytes sent to clients, by how the request was served.\n");
+    fprintf(fp, "# TYPE proxy_response_bytes_total counter\n");
+    for (int i = 0; i < METRICS_OUTCOMES; i++) {
+        fprintf(fp, "proxy_response_bytes_total{outcome=\"%s\"} %lu\n", outcome_names[i], atomic_load(&sum->bytes[i]));
+    }
+    fprintf(fp, "# HELP proxy_responses_total Responses by status class; none if nothing was sent.\n");
+    fprintf(fp, "# TYPE proxy_responses_total counter\n");
+    for (int i = 0; i < METRICS_STATUS_CLASSES; i++) {
+        fprintf(fp, "proxy_responses_total{code=\"%s\"} %lu\n", status_names[i], atomic_load(&sum->responses[i]));
+    }
+    for (int i = 0; i < METRICS_HISTOGRAMS; i++) {
+        write_histogram(fp, i, &sum->histograms[i]);
+    }
+    cache_metrics(fp);
+    compress_metrics(fp);
+
+    Free(sum);
+}
+
+// Exports h with a bucket per power of two of microseconds, then the
+// quantiles the finer buckets give
+static void write_histogram(FILE *fp, metrics_histogram_id id, metrics_histogram *h)
+{
+    const char *name = histogram_names[id];
+    unsigned long total = 0, count = 0;
+    int q = 0;
+
+    for (int b = 0; b < METRICS_BUCKETS; b++) {
+        total += atomic_load(&h->counts[b]);
+    }
+
+    fprintf(fp, "# HELP %s %s.\n", name, histogram_help[id]);
+    fprintf(fp, "# TYPE %s histogram\n", name);
+    for (int b = 0; b < METRICS_BUCKETS; b++) {
+        count += atomic_load(&h->counts[b]);
+
+        // Power-of-two limits end a group of sub-buckets
+        long long limit = bucket_limit(b);
+        if ((limit & (limit - 1)) == 0) {
+            fprintf(fp, "%s_bucket{le=\"%g\"} %lu\n", name, limit / 1e6, count);
+        }
+    }
+    fprintf(fp, "%s_bucket{le=\"+Inf\"} %lu\n", name, total);
+    fprintf(fp, "%s_sum %g\n", name, atomic_load(&h->sum_us) / 1e6);
+    fprintf(fp, "%s_count %lu\n", name, total);
+
+    fprintf(fp, "# HELP %s_quantile Quantiles of %s, within 12.5%%.\n", name, name);
+    fprintf(fp, "# TYPE %s_quantile gauge\n", name);
+    count = 0;
+    for (int b = 0; b < METRICS_BUCKETS && q < sizeof(quantiles) / sizeof(quantiles[0]); b++) {
+        count += atomic_load(&h->counts[b]);
+        while (total > 0 && q < sizeof(quantiles) / sizeof(quantiles[0]) && count >= quantiles[q] * total) {
+            fprintf(fp, "%s_quantile{quantile=\"%g\"} %g\n", name, quantiles[q], bucket_limit(b) / 1e6);
+            q++;
+        }
+    }
+    for (; q < sizeof(quantiles) / sizeof(quantiles[0]); q++) {
+        fprintf(fp, "%s_quantile{quantile=\"%g\"} NaN\n", name, quantiles[q]);
+    }
+}
@@ -0,0 +1,51 @@
+/* Log-linear histogram of microseconds: values below METRICS_SUB_BUCKETS
+ * are exact, and every power of two above is split into
+ * METRICS_SUB_BUCKETS buckets, so a bucket is within 12.5% of its values */
+#define METRICS_SUB_BITS 3
+#define METRICS_SUB_BUCKETS (1 << METRICS_SUB_BITS)
+#define METRICS_BUCKETS (32 * METRICS_SUB_BUCKETS)
+
+/* Status classes counted: none, 1xx .. 5xx */
+#define METRICS_STATUS_CLASSES 6
+
+/* Outcomes counted, as in log_outcome */
+#define METRICS_OUTCOMES 5
+
+/* Admin requests: "GET /metrics" answered from this loopback port */
+#define METRICS_PATH "/metrics"
+
+typedef enum metrics_histogram_id {
+    METRICS_FIRST_BYTE,         // Accept, or the request's arrival, to the first response byte
+    METRICS_CONNECT,            // Upstream connect, name resolution included
+    METRICS_DURATION,           // Accept, or the request's arrival, to the last response byte
+    METRICS_HISTOGRAMS,
+} metrics_histogram_id;
+
+typedef struct metrics_histogram {
+    _Atomic unsigned long counts[METRICS_BUCKETS];
+    _Atomic unsigned long sum_us;
+} metrics_histogram;
+
+/* One thread's counters. Only that thread writes them, so updates need no
+ * atomic read-modify-write; a scrape sums every shard. */
+typedef struct metrics_shard {
+    metrics_histogram histograms[METRICS_HISTOGRAMS];
+    _Atomic unsigned long requests[METRICS_OUTCOMES];
+    _Atomic unsigned long bytes[METRICS_OUTCOMES];
+    _Atomic unsigned long responses[METRICS_STATUS_CLASSES];
+    struct metrics_shard *next;
+} metrics_shard;
+
+extern int metrics_enabled;
+
+void metrics_init(int port);
+void metrics_accepted(int fd);
+long long metrics_accept_time(int fd);
+void metrics_observe(metrics_histogram_id id, long long us);
+void metrics_request_begin(long long start_us);
+void metrics_first_byte();
+void metrics_response(int status, size_t bytes);
+void metrics_response_outcome(int outcome);
+void metrics_request_end(int outcome);
+void metrics_request(int outcome, int status, size_t bytes, long long start_us);
+long long metrics_now_us();
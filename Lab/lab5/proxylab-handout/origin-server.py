@@ -0,0 +1,28 @@
+#!/usr/bin/python3
+
+# origin-server.py - A threaded HTTP/1.1 server with keep-alive that
+#                    serves the files under ./tiny. Unlike tiny, it keeps
+#                    connections open between requests, so the proxy's
+#                    upstream connection pool gets exercised.
+#
+# usage: origin-server.py <port>
+#
+import functools
+import http.server
+import os
+import sys
+
+class Handler(http.server.SimpleHTTPRequestHandler):
+  protocol_version = "HTTP/1.1"
+  # Headers and body are separate writes; Nagle would hold the body
+  disable_nagle_algorithm = True
+
+  def log_message(self, format, *args):
+    pass
+
+class Server(http.server.ThreadingHTTPServer):
+  request_queue_size = 128
+
+root = os.path.join(os.path.dirname(os.path.abspath(__file__)), "tiny")
+handler = functools.partial(Handler, directory=root)
+Server(('', int(sys.argv[1])), handler).serve_forever()
@@ -0,0 +1,44 @@
+#!/bin/bash
+#
+# pagebench.sh - Measures per-request latency for a page made of many
+#     small objects served through the proxy from tiny, with one
+#     connection per request, with keep-alive, and with pipelining.
+#
+#     usage: ./pagebench.sh [objects] [requests] [concurrency]
+#
+OBJECTS=${1:-32}
+REQUESTS=${2:-20000}
+CONCURRENCY=${3:-8}
+PAGE_DIR="pagebench"
+
+make -s proxy loadgen || exit 1
+
+# Small objects of 1-4 KB, as on an icon- and script-heavy page
+mkdir -p ./tiny/${PAGE_DIR}
+for i in `seq 1 ${OBJECTS}`; do
+    head -c $(( (RANDOM % 4 + 1) * 1024 )) /dev/urandom > ./tiny/${PAGE_DIR}/${i}.bin
+done
+
+tiny_port=`./free-port.sh`
+(cd ./tiny && exec ./tiny ${tiny_port} &> /dev/null) &
+tiny_pid=$!
+sleep 1
+
+proxy_port=`./free-port.sh`
+while [ "${proxy_port}" == "${tiny_port}" ]; do
+    proxy_port=`expr ${proxy_port} + 1`
+done
+./proxy -c 1M -o 64K ${proxy_port} &> /dev/null &
+proxy_pid=$!
+trap 'kill ${proxy_pid} ${tiny_pid} 2> /dev/null; rm -rf ./tiny/${PAGE_DIR}' EXIT
+sleep 1
+
+urls=""
+for i in `seq 1 ${OBJECTS}`; do
+    urls="${urls} http://localhost:${tiny_port}/${PAGE_DIR}/${i}.bin"
+done
+
+for mode in "" "-k" "-P 6"; do
+    echo "*** loadgen ${mode:-(connection per request)}"
+    ./loadgen ${mode} -c ${CONCURRENCY} -n ${REQUESTS} localhost ${proxy_port} ${urls}
+done
@@ -0,0 +1,607 @@
+/*
+ * parsebench.c - Microbenchmark for the proxy's request parser
+ *
+ * Parses the same request heads over and over and reports requests parsed
+ * per second for:
+ * 1. legacy: the line-at-a-time parser the proxy used before, copying
+ *    every line and field (sscanf, strtok_r, arena allocation)
+ * 2. in-place: http_request_head_end() and http_parse_request() on whole
+ *    heads, as the event engine does
+ * 3. incremental: an http_parser fed -f bytes at a time, as the thread
+ *    engine does with short reads, pipelined requests included
+ *
+ * Before timing, every head is parsed both ways and the results compared,
+ * and a set of malformed heads must be rejected.
+ *
+ * Emission mode (-w) instead times sending the parsed requests upstream,
+ * over a socket pair drained by another thread, and counts write
+ * syscalls per request:
+ * 1. per-line: one write per request line and header, as the proxy did
+ *    originally
+ * 2. vectored: http_request_iov() slices sent by one writev()
+ * 3. gathered: the same slices copied into one buffer and written, as
+ *    upstream_sendv() does for requests up to UPSTREAM_GATHER_MAX
+ *
+ * usage: ./parsebench [-n requests] [-f feed_size] [-w]
+ */
+#include <time.h>
+#include <sys/uio.h>
+#include <netinet/tcp.h>
+#include "csapp.h"
+#include "slab.h"
+#include "http.h"
+
+#define DEFAULT_REQUESTS 1000000
+#define DEFAULT_FEED 64
+
+/* The headers the original forwarder always sent */
+static const char *connection_hdr = "Connection: close\r\n";
+static const char *proxy_connection_hdr = "Proxy-Connection: close\r\n";
+
+/* Request heads as browsers and the driver send them */
+static const char *heads[] = {
+    "GET http://localhost:15213/home.html HTTP/1.0\r\n\r\n",
+    "GET http://localhost:15213/godzilla.jpg HTTP/1.1\r\n"
+    "Host: localhost:15213\r\n"
+    "Proxy-Connection: keep-alive\r\n\r\n",
+    "GET http://www.example.com/static/js/app.min.js?v=2024 HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:120.0) Gecko/20100101 Firefox/120.0\r\n"
+    "Accept: */*\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate\r\n"
+    "Referer: http://www.example.com/index.html\r\n"
+    "Cookie: session=4f2a9c1e77b04d1e; theme=dark; consent=yes\r\n"
+    "Connection: keep-alive\r\n"
+    "If-None-Match: \"5d8c72a5edda8\"\r\n\r\n",
+    "GET http://10.0.0.7:8080/api/v1/items/42 HTTP/1.1\n"
+    "Host: 10.0.0.7:8080\n"
+    "Accept: application/json\n"
+    "X-Request-Id: 7b0e4a22-61f1-4b0b-9d7e-2c3b1a6f9e10\n\n",
+};
+
+#define NHEADS (sizeof(heads) / sizeof(heads[0]))
+
+/* Must all be rejected */
+static const char *malformed[] = {
+    "GET\r\n\r\n",
+    "GET /relative HTTP/1.1\r\n\r\n",
+    "GET http:///path HTTP/1.1\r\n\r\n",
+    "GET http://host/ HTTP/one\r\n\r\n",
+    "GET http://host/ HTTP/1.1\r\nNo colon here\r\n\r\n",
+    "GET http://host/ HTTP/1.1\r\n: empty name\r\n\r\n",
+    "GET http://host/ HTTP/1.1\r\nBad : space\r\n\r\n",
+    "GET http://host/ HTTP/1.1\r\nA: b\r\n folded\r\n\r\n",
+};
+
+#define NMALFORMED (sizeof(malformed) / sizeof(malformed[0]))
+
+/* The parser the proxy used before, kept as the baseline */
+typedef struct legacy_header {
+    char *key;
+    char *value;
+    struct legacy_header *next;
+} legacy_header;
+
+typedef struct legacy_request {
+    char *uri;
+    char *path;
+    char *host;
+    char *hostname;
+    char *port;
+    int keep_alive;
+    legacy_header *extra_hdrs;
+    legacy_header *last_hdr;
+} legacy_request;
+
+/* The per-request arena its fields were copied into */
+#define ARENA_CHUNK_SIZE 4096
+
+typedef struct arena_chunk {
+    struct arena_chunk *next;
+    size_t size;                // Usable bytes after this header
+    size_t used;
+} arena_chunk;
+
+typedef struct arena {
+    arena_chunk *chunk;         // Chunk being carved, newest first
+} arena;
+
+// Arena chunk header, rounded up so allocations stay 16-byte aligned
+#define ARENA_HDR_SIZE ((sizeof(arena_chunk) + 15) & ~(size_t)15)
+
+static volatile long sink;
+
+/* Emission mode */
+static http_request parsed[NHEADS];
+static char parsed_bufs[NHEADS][HTTP_HEAD_SIZE];
+static long write_syscalls;
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void arena_init(arena *a)
+{
+    a->chunk = NULL;
+}
+
+static void *arena_alloc(arena *a, size_t size)
+{
+    arena_chunk *chunk = a->chunk;
+
+    size = (size + 15) & ~(size_t)15;
+    if (chunk == NULL || chunk->used + size > chunk->size) {
+        size_t total = ARENA_HDR_SIZE + size;
+        if (total < ARENA_CHUNK_SIZE) {
+            total = ARENA_CHUNK_SIZE;
+        }
+
+        chunk = slab_alloc(total);
+        chunk->size = total - ARENA_HDR_SIZE;
+        chunk->used = 0;
+        chunk->next = a->chunk;
+        a->chunk = chunk;
+    }
+
+    void *ptr = (char *)chunk + ARENA_HDR_SIZE + chunk->used;
+    chunk->used += size;
+
+    return ptr;
+}
+
+static char *arena_strdup(arena *a, const char *str)
+{
+    size_t len = strlen(str) + 1;
+    return memcpy(arena_alloc(a, len), str, len);
+}
+
+// Releases everything allocated from the arena at once
+static void arena_free(arena *a)
+{
+    arena_chunk *chunk = a->chunk;
+    while (chunk != NULL) {
+        arena_chunk *next = chunk->next;
+        slab_free(chunk, ARENA_HDR_SIZE + chunk->size);
+        chunk = next;
+    }
+    a->chunk = NULL;
+}
+
+// Strips leading and trailing whitespace in place
+static char *trim(char *str)
+{
+    char *end;
+
+    while (isspace((unsigned char)*str)) {
+        str++;
+    }
+    if (*str == '\0') {
+        return str;
+    }
+
+    end = str + strlen(str) - 1;
+    while (end > str && isspace((unsigned char)*end)) {
+        end--;
+    }
+    end[1] = '\0';
+
+    return str;
+}
+
+static int legacy_parse_request_line(char *line, legacy_request *request, arena *a)
+{
+    size_t len = strlen(line) + 1;
+    int major = 0, minor = 0;
+
+    request->uri = arena_alloc(a, len);
+    request->host = arena_alloc(a, len);
+    request->path = arena_alloc(a, len);
+    request->hostname = arena_alloc(a, len);
+    request->port = arena_alloc(a, len);
+    request->uri[0] = request->host[0] = request->path[0] = '\0';
+    request->hostname[0] = request->port[0] = '\0';
+
+    if (sscanf(line, "%*s %s HTTP/%d.%d", request->uri, &major, &minor) < 1) {
+        return -1;
+    }
+    request->keep_alive = major > 1 || (major == 1 && minor >= 1);
+
+    sscanf(request->uri, "http://%[^/]%s", request->host, request->path);
+    if (strcmp(request->path, "") == 0) {
+        strcpy(request->path, "/");
+    }
+    sscanf(request->host, "%[^:]:%s", request->hostname, request->port);
+    if (strcmp(request->port, "") == 0) {
+        strcpy(request->port, "80");
+    }
+
+    return 0;
+}
+
+static void legacy_parse_header(char *line, legacy_request *request, arena *a)
+{
+    char *save;
+    char *key = strtok_r(line, ":", &save);
+    char *value = strtok_r(NULL, "\r\n", &save);
+
+    if (key == NULL) {
+        return;
+    }
+    key = trim(key);
+    value = value != NULL ? trim(value) : "";
+
+    if (strcasecmp(key, "Connection") == 0 || strcasecmp(key, "Proxy-Connection") == 0) {
+        request->keep_alive = strstr(value, "close") == NULL;
+    }
+    if (strcmp(key, "Host") == 0 || strcmp(key, "User-Agent") == 0 || strcmp(key, "Connection") == 0 ||
+        strcmp(key, "Proxy-Connection") == 0) {
+        return;
+    }
+
+    legacy_header *hdr = arena_alloc(a, sizeof(legacy_header));
+    hdr->key = arena_strdup(a, key);
+    hdr->value = arena_strdup(a, value);
+    hdr->next = NULL;
+    if (request->last_hdr == NULL) {
+        request->extra_hdrs = hdr;
+    } else {
+        request->last_hdr->next = hdr;
+    }
+    request->last_hdr = hdr;
+}
+
+// Parses one head line by line, each line copied out first as
+// rio_readlineb() did. Returns the number of headers kept.
+static int legacy_parse(const char *head, legacy_request *request, arena *a)
+{
+    char line[MAXLINE];
+    const char *p = head, *eol;
+    int nhdrs = 0;
+
+    memset(request, 0, sizeof(legacy_request));
+    for (int first = 1; (eol = strchr(p, '\n')) != NULL; p = eol + 1, first = 0) {
+        size_t len = eol + 1 - p;
+        memcpy(line, p, len);
+        line[len] = '\0';
+
+        if (first) {
+            if (legacy_parse_request_line(line, request, a) < 0) {
+                return -1;
+            }
+        } else if (strcmp(line, "\r\n") == 0 || strcmp(line, "\n") == 0) {
+            break;
+        } else {
+            legacy_parse_header(line, request, a);
+        }
+    }
+    for (legacy_header *h = request->extra_hdrs; h != NULL; h = h->next) {
+        nhdrs++;
+    }
+
+    return nhdrs;
+}
+
+// Parses a copy of head in place, as a connection's buffer would hold it
+static int inplace_parse(const char *head, char *buf, http_request *request)
+{
+    size_t len = strlen(head), scanned = 0, head_end;
+
+    memcpy(buf, head, len);
+    if ((head_end = http_request_head_end(buf, &len, &scanned)) == 0) {
+        return -1;
+    }
+
+    return http_parse_request(buf, head_end, request);
+}
+
+// Both parsers must agree on every head, and malformed ones must fail
+static void verify()
+{
+    static char buf[HTTP_HEAD_SIZE];
+    legacy_request old;
+    http_request req;
+    arena a;
+
+    for (size_t i = 0; i < NHEADS; i++) {
+        arena_init(&a);
+        int nhdrs = legacy_parse(heads[i], &old, &a);
+        if (inplace_parse(heads[i], buf, &req) < 0 || nhdrs != req.nhdrs ||
+            strcmp(old.uri, req.uri) != 0 || strcmp(old.host, req.host) != 0 ||
+            strcmp(old.path, req.path) != 0 || strcmp(old.hostname, req.hostname) != 0 ||
+            strcmp(old.port, req.port) != 0 || old.keep_alive != req.keep_alive) {
+            fprintf(stderr, "parsers disagree on head %zu\n", i);
+            exit(1);
+        }
+        legacy_header *h = old.extra_hdrs;
+        for (int j = 0; j < nhdrs; j++, h = h->next) {
+            http_header *hdr = &req.hdrs[j];
+            if (strlen(h->key) != hdr->key_len || strncmp(h->key, hdr->key, hdr->key_len) != 0 ||
+                strlen(h->value) != hdr->value_len || strncmp(h->value, hdr->value, hdr->value_len) != 0) {
+                fprintf(stderr, "parsers disagree on header %d of head %zu\n", j, i);
+                exit(1);
+            }
+        }
+        arena_free(&a);
+    }
+
+    for (size_t i = 0; i < NMALFORMED; i++) {
+        if (inplace_parse(malformed[i], buf, &req) == 0) {
+            fprintf(stderr, "malformed head %zu accepted\n", i);
+            exit(1);
+        }
+    }
+}
+
+static double bench_legacy(int n)
+{
+    legacy_request req;
+    arena a;
+    double start = now();
+
+    for (int i = 0; i < n; i++) {
+        arena_init(&a);
+        sink += legacy_parse(heads[i % NHEADS], &req, &a);
+        arena_free(&a);
+    }
+
+    return now() - start;
+}
+
+static double bench_inplace(int n)
+{
+    static char buf[HTTP_HEAD_SIZE];
+    http_request req;
+    double start = now();
+
+    for (int i = 0; i < n; i++) {
+        sink += inplace_parse(heads[i % NHEADS], buf, &req);
+        sink += req.nhdrs;
+    }
+
+    return now() - start;
+}
+
+// Feeds all heads back to back, feed bytes per "read", through one parser
+static double bench_incremental(int n, size_t feed)
+{
+    static http_parser parser;
+    static char stream[MAXBUF * 4];
+    http_request req;
+    size_t len = 0, off = 0;
+    int parsed = 0, rc;
+
+    for (size_t i = 0; i < NHEADS; i++) {
+        len += snprintf(stream + len, sizeof(stream) - len, "%s", heads[i]);
+    }
+
+    http_parser_init(&parser);
+    double start = now();
+    while (parsed < n) {
+        if ((rc = http_parser_next(&parser, &req)) > 0) {
+            sink += req.nhdrs;
+            parsed++;
+            continue;
+        }
+        if (rc < 0) {
+            fprintf(stderr, "incremental parse failed\n");
+            exit(1);
+        }
+
+        size_t chunk = len - off < feed ? len - off : feed;
+        if (chunk > HTTP_HEAD_SIZE - parser.len) {
+            chunk = HTTP_HEAD_SIZE - parser.len;
+        }
+        memcpy(parser.buf + parser.len, stream + off, chunk);
+        parser.len += chunk;
+        off = (off + chunk) % len;
+    }
+
+    return now() - start;
+}
+
+// Discards whatever the benchmark sends
+static void *drain_thread(void *vargp)
+{
+    int fd = *(int *)vargp;
+    char buf[MAXBUF * 4];
+
+    while (read(fd, buf, sizeof(buf)) > 0) {
+    }
+    return NULL;
+}
+
+static void write_all(int fd, const char *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        write_syscalls++;
+        if (n < 0) {
+            unix_error("write error");
+        }
+        buf += n;
+        len -= n;
+    }
+}
+
+static void writev_all(int fd, struct iovec *iov, int iovcnt)
+{
+    while (iovcnt > 0) {
+        ssize_t n = writev(fd, iov, iovcnt);
+        write_syscalls++;
+        if (n < 0) {
+            unix_error("writev error");
+        }
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+}
+
+// The original forward_request(): a sprintf and a write per line
+static void emit_per_line(int fd, http_request *request)
+{
+    char buf[MAXLINE];
+
+    sprintf(buf, "GET %s HTTP/1.0\r\n", request->path);
+    write_all(fd, buf, strlen(buf));
+    sprintf(buf, "Host: %s\r\n", request->host);
+    write_all(fd, buf, strlen(buf));
+    write_all(fd, user_agent_hdr, strlen(user_agent_hdr));
+    write_all(fd, connection_hdr, strlen(connection_hdr));
+    write_all(fd, proxy_connection_hdr, strlen(proxy_connection_hdr));
+    for (int i = 0; i < request->nhdrs; i++) {
+        http_header *h = &request->hdrs[i];
+        sprintf(buf, "%.*s: %.*s\r\n", (int)h->key_len, h->key, (int)h->value_len, h->value);
+        write_all(fd, buf, strlen(buf));
+    }
+    write_all(fd, "\r\n", 2);
+}
+
+static void emit_vectored(int fd, http_request *request)
+{
+    struct iovec iov[HTTP_REQUEST_IOV];
+    int iovcnt = http_request_iov(request, iov, 0, NULL);
+
+    writev_all(fd, iov, iovcnt);
+}
+
+static void emit_gathered(int fd, http_request *request)
+{
+    struct iovec iov[HTTP_REQUEST_IOV];
+    int iovcnt = http_request_iov(request, iov, 0, NULL);
+    char buf[MAXBUF];
+    size_t len = 0;
+
+    for (int i = 0; i < iovcnt; i++) {
+        memcpy(buf + len, iov[i].iov_base, iov[i].iov_len);
+        len += iov[i].iov_len;
+    }
+    write_all(fd, buf, len);
+}
+
+static void bench_emit(const char *name, int n, int fd, void (*emit)(int, http_request *))
+{
+    write_syscalls = 0;
+    double start = now();
+    for (int i = 0; i < n; i++) {
+        emit(fd, &parsed[i % NHEADS]);
+    }
+    double elapsed = now() - start;
+
+    printf("%-18s %12.0f req/s  %7.1f ns/req  %5.2f write syscalls/req\n", name, n / elapsed,
+           elapsed * 1e9 / n, (double)write_syscalls / n);
+}
+
+// Sends every parsed request each way, checking that the bytes agree
+static void run_emission(int n)
+{
+    int fds[2];
+    pthread_t tid;
+
+    for (size_t i = 0; i < NHEADS; i++) {
+        char expected[MAXBUF], buf[MAXBUF];
+        http_request *r = &parsed[i];
+        size_t len;
+
+        if (inplace_parse(heads[i], parsed_bufs[i], r) < 0) {
+            fprintf(stderr, "head %zu does not parse\n", i);
+            exit(1);
+        }
+
+        // What the per-line writes send, in one piece
+        len = snprintf(expected, MAXBUF, "GET %s HTTP/1.0\r\nHost: %s\r\n%s%s%s", r->path, r->host,
+                       user_agent_hdr, connection_hdr, proxy_connection_hdr);
+        for (int j = 0; j < r->nhdrs; j++) {
+            len += snprintf(expected + len, MAXBUF - len, "%.*s: %.*s\r\n", (int)r->hdrs[j].key_len,
+                            r->hdrs[j].key, (int)r->hdrs[j].value_len, r->hdrs[j].value);
+        }
+        len += snprintf(expected + len, MAXBUF - len, "\r\n");
+
+        if (http_format_request(r, buf, MAXBUF, 0) != len || memcmp(buf, expected, len) != 0) {
+            fprintf(stderr, "vectored request differs for head %zu\n", i);
+            exit(1);
+        }
+    }
+
+    // A loopback TCP connection, like the one to a local origin
+    int listenfd = Open_listenfd("0");
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+    char port[16];
+    getsockname(listenfd, (struct sockaddr *)&addr, &addrlen);
+    snprintf(port, sizeof(port), "%d", ntohs(addr.sin_port));
+    fds[0] = Open_clientfd("localhost", port);
+    fds[1] = Accept(listenfd, NULL, NULL);
+    close(listenfd);
+    int nodelay = 1;
+    setsockopt(fds[0], IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    Pthread_create(&tid, NULL, drain_thread, &fds[1]);
+
+    bench_emit("per-line", n, fds[0], emit_per_line);
+    bench_emit("vectored", n, fds[0], emit_vectored);
+    bench_emit("gathered", n, fds[0], emit_gathered);
+
+    close(fds[0]);
+    Pthread_join(tid, NULL);
+    close(fds[1]);
+}
+
+static void report(const char *name, int n, double elapsed, double baseline)
+{
+    printf("%-18s %12.0f req/s  %7.1f ns/req  %5.2fx\n", name, n / elapsed, elapsed * 1e9 / n,
+           baseline / elapsed);
+}
+
+int main(int argc, char *argv[])
+{
+    int opt, n = DEFAULT_REQUESTS, emission = 0;
+    size_t feed = DEFAULT_FEED;
+    char name[64];
+
+    while ((opt = getopt(argc, argv, "n:f:w")) != -1) {
+        switch (opt) {
+        case 'n':
+            n = atoi(optarg);
+            break;
+        case 'f':
+            feed = atol(optarg);
+            break;
+        case 'w':
+            emission = 1;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-n requests] [-f feed_size] [-w]\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (n <= 0 || feed == 0) {
+        fprintf(stderr, "usage: %s [-n requests] [-f feed_size] [-w]\n", argv[0]);
+        exit(1);
+    }
+
+    slab_init();
+    verify();
+    if (emission) {
+        run_emission(n);
+        return 0;
+    }
+
+    double legacy = bench_legacy(n);
+    report("legacy", n, legacy, legacy);
+    report("in-place", n, bench_inplace(n), legacy);
+    snprintf(name, sizeof(name), "incremental/%zu", feed);
+    report(name, n, bench_incremental(n, feed), legacy);
+    report("incremental/1", n, bench_incremental(n, 1), legacy);
+
+    return 0;
+}
@@ -0,0 +1,218 @@
+#include <stdatomic.h>
+#include "csapp.h"
+#include "cache.h"
+#include "policy.h"
+
+// Helper functions
+static void lru_touch(cache_shard *shard, cache_entry *entry);
+static cache_shard *lru_pick_shard(cache_shard *shards, int nshards);
+static cache_entry *lru_pick_victim(cache_shard *shard);
+static void clock_touch(cache_shard *shard, cache_entry *entry);
+static cache_shard *clock_pick_shard(cache_shard *shards, int nshards);
+static cache_entry *clock_pick_victim(cache_shard *shard);
+static void sketch_init(size_t capacity);
+static void sketch_destroy();
+static void sketch_record(unsigned int hash);
+static int sketch_admit(unsigned int hash, unsigned int victim_hash);
+
+// Strict LRU: hits move to the front, the oldest shard tail is evicted
+cache_policy lru_policy = {
+    .name = "lru",
+    .touch = lru_touch,
+    .pick_shard = lru_pick_shard,
+    .pick_victim = lru_pick_victim,
+};
+
+// CLOCK (second chance): hits only set a bit, so readers never serialize
+cache_policy clock_policy = {
+    .name = "clock",
+    .touch = clock_touch,
+    .pick_shard = clock_pick_shard,
+    .pick_victim = clock_pick_victim,
+};
+
+// TinyLFU: LRU eviction behind a frequency-based admission filter
+cache_policy tinylfu_policy = {
+    .name = "tinylfu",
+    .init = sketch_init,
+    .destroy = sketch_destroy,
+    .record = sketch_record,
+    .admit = sketch_admit,
+    .touch = lru_touch,
+    .pick_shard = lru_pick_shard,
+    .pick_victim = lru_pick_victim,
+};
+
+static cache_policy *policies[] = {&lru_policy, &clock_policy, &tinylfu_policy};
+
+// CLOCK hand over the shards
+static atomic_uint clock_hand;
+
+// Count-min sketch of recent access frequencies
+static _Atomic unsigned char *sketch;
+static unsigned int sketch_width;
+static atomic_ulong sketch_samples;
+static unsigned long sketch_reset_at;
+static const unsigned int sketch_seeds[SKETCH_DEPTH] = {
+    0x9e3779b1u, 0x85ebca77u, 0xc2b2ae3du, 0x27d4eb2fu
+};
+
+cache_policy *policy_lookup(const char *name)
+{
+    for (int i = 0; i < sizeof(policies) / sizeof(policies[0]); i++) {
+        if (strcasecmp(policies[i]->name, name) == 0) {
+            return policies[i];
+        }
+    }
+    return NULL;
+}
+
+// ========================================================== //
+// ========================== LRU =========================== //
+// ========================================================== //
+static void lru_touch(cache_shard *shard, cache_entry *entry)
+{
+    pthread_mutex_lock(&shard->lru_mutex);
+    entry->stamp = cache_tick();
+    if (entry != shard->head) {
+        cache_lru_unlink(shard, entry);
+        cache_lru_push_front(shard, entry);
+    }
+    pthread_mutex_unlock(&shard->lru_mutex);
+}
+
+// Picks the shard whose tail was used least recently
+static cache_shard *lru_pick_shard(cache_shard *shards, int nshards)
+{
+    cache_shard *oldest = NULL;
+    unsigned long oldest_stamp = 0;
+
+    for (int i = 0; i < nshards; i++) {
+        cache_shard *shard = &shards[i];
+
+        pthread_rwlock_rdlock(&shard->lock);
+        pthread_mutex_lock(&shard->lru_mutex);
+        if (shard->tail != NULL && (oldest == NULL || shard->tail->stamp < oldest_stamp)) {
+            oldest = shard;
+            oldest_stamp = shard->tail->stamp;
+        }
+        pthread_mutex_unlock(&shard->lru_mutex);
+        pthread_rwlock_unlock(&shard->lock);
+    }
+
+    return oldest;
+}
+
+static cache_entry *lru_pick_victim(cache_shard *shard)
+{
+    return shard->tail;
+}
+
+// ========================================================== //
+// ========================= CLOCK ========================== //
+// ========================================================== //
+static void clock_touch(cache_shard *shard, cache_entry *entry)
+{
+    atomic_store(&entry->referenced, 1);
+}
+
+// Sweeps the shards round robin, skipping empty ones
+static cache_shard *clock_pick_shard(cache_shard *shards, int nshards)
+{
+    for (int i = 0; i < nshards; i++) {
+        cache_shard *shard = &shards[atomic_fetch_add(&clock_hand, 1) % nshards];
+
+        pthread_rwlock_rdlock(&shard->lock);
+        int empty = shard->tail == NULL;
+        pthread_rwlock_unlock(&shard->lock);
+
+        if (!empty) {
+            return shard;
+        }
+    }
+
+    return NULL;
+}
+
+// Referenced entries get a second chance at the front of the list
+static cache_entry *clock_pick_victim(cache_shard *shard)
+{
+    for (unsigned int n = shard->nentries; n > 0; n--) {
+        cache_entry *entry = shard->tail;
+        if (!atomic_exchange(&entry->referenced, 0)) {
+            return entry;
+        }
+        cache_lru_unlink(shard, entry);
+        cache_lru_push_front(shard, entry);
+    }
+
+    return shard->tail;
+}
+
+// ========================================================== //
+// ======================== TinyLFU ========================= //
+// ========================================================== //
+static void sketch_init(size_t capacity)
+{
+    size_t objects = capacity / SKETCH_OBJECT_SIZE;
+
+    sketch_width = SKETCH_MIN_WIDTH;
+    while (sketch_width < objects && sketch_width < SKETCH_MAX_WIDTH) {
+        sketch_width *= 2;
+    }
+    sketch = Calloc(SKETCH_DEPTH * sketch_width, sizeof(*sketch));
+
+    // Halve every counter after this many samples so old popularity fades
+    sketch_reset_at = 10UL * sketch_width;
+    atomic_init(&sketch_samples, 0);
+}
+
+static void sketch_destroy()
+{
+    Free((void *)sketch);
+    sketch = NULL;
+}
+
+static unsigned int sketch_index(int row, unsigned int hash)
+{
+    hash *= sketch_seeds[row];
+    return row * sketch_width + ((hash ^ (hash >> 15)) & (sketch_width - 1));
+}
+
+// Counters are updated without locks; lost increments only blur estimates
+static void sketch_record(unsigned int hash)
+{
+    for (int row = 0; row < SKETCH_DEPTH; row++) {
+        _Atomic unsigned char *counter = &sketch[sketch_index(row, hash)];
+        unsigned char count = atomic_load_explicit(counter, memory_order_relaxed);
+        if (count < SKETCH_MAX_COUNT) {
+            atomic_store_explicit(counter, count + 1, memory_order_relaxed);
+        }
+    }
+
+    if (atomic_fetch_add(&sketch_samples, 1) + 1 == sketch_reset_at) {
+        for (unsigned int i = 0; i < SKETCH_DEPTH * sketch_width; i++) {
+            unsigned char count = atomic_load_explicit(&sketch[i], memory_order_relaxed);
+            atomic_store_explicit(&sketch[i], count / 2, memory_order_relaxed);
+        }
+        atomic_store(&sketch_samples, 0);
+    }
+}
+
+static unsigned int sketch_estimate(unsigned int hash)
+{
+    unsigned int min = SKETCH_MAX_COUNT;
+    for (int row = 0; row < SKETCH_DEPTH; row++) {
+        unsigned int count = atomic_load_explicit(&sketch[sketch_index(row, hash)], memory_order_relaxed);
+        if (count < min) {
+            min = count;
+        }
+    }
+    return min;
+}
+
+// Admit only objects requested more often than the one they would evict
+static int sketch_admit(unsigned int hash, unsigned int victim_hash)
+{
+    return sketch_estimate(hash) > sketch_estimate(victim_hash);
+}
@@ -0,0 +1,35 @@
+/* TinyLFU frequency sketch: rows and saturation of each counter */
+#define SKETCH_DEPTH 4
+#define SKETCH_MAX_COUNT 15
+
+/* Sketch counters per expected object; objects are estimated at 1 KB */
+#define SKETCH_OBJECT_SIZE 1024
+#define SKETCH_MIN_WIDTH 1024
+#define SKETCH_MAX_WIDTH (1 << 22)
+
+/*
+ * Eviction policy hooks. Every hook except name, pick_shard and
+ * pick_victim may be NULL.
+ */
+typedef struct cache_policy {
+    const char *name;
+    void (*init)(size_t capacity);
+    void (*destroy)(void);
+
+    // Every lookup, hit or miss, before any lock is taken
+    void (*record)(unsigned int hash);
+    // A hit on entry; the shard is read-locked
+    void (*touch)(cache_shard *shard, cache_entry *entry);
+    // Whether a new object may displace the current victim
+    int (*admit)(unsigned int hash, unsigned int victim_hash);
+    // Shard to evict from next, or NULL if every shard is empty
+    cache_shard *(*pick_shard)(cache_shard *shards, int nshards);
+    // Entry to evict from a non-empty, write-locked shard
+    cache_entry *(*pick_victim)(cache_shard *shard);
+} cache_policy;
+
+extern cache_policy lru_policy;
+extern cache_policy clock_policy;
+extern cache_policy tinylfu_policy;
+
+cache_policy *policy_lookup(const char *name);
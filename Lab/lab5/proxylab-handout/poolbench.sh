@@ -0,0 +1,36 @@
+#!/bin/bash
+#
+# poolbench.sh - Measures the upstream connection pool: small uncached
+#     fetches through the proxy from a keep-alive origin, with pooling
+#     (the default) and with every request opening a fresh connection.
+#
+#     usage: ./poolbench.sh [requests] [concurrency]
+#
+REQUESTS=${1:-5000}
+CONCURRENCY=${2:-8}
+
+make -s proxy loadgen || exit 1
+
+origin_port=`./free-port.sh`
+./origin-server.py ${origin_port} &> /dev/null &
+origin_pid=$!
+trap 'kill ${origin_pid} 2> /dev/null' EXIT
+sleep 1
+
+for idle in 8 0; do
+    proxy_port=`./free-port.sh`
+    while [ "${proxy_port}" == "${origin_port}" ]; do
+        proxy_port=`expr ${proxy_port} + 1`
+    done
+    # A 1-byte object limit keeps every request a cache miss
+    ./proxy -o 1 -u ${idle} ${proxy_port} &> /dev/null &
+    proxy_pid=$!
+    sleep 1
+
+    echo "*** upstream_idle=${idle}: ${REQUESTS} requests, ${CONCURRENCY} clients"
+    ./loadgen -c ${CONCURRENCY} -n ${REQUESTS} localhost ${proxy_port} \
+        http://localhost:${origin_port}/home.html
+
+    kill ${proxy_pid}
+    wait ${proxy_pid} 2> /dev/null
+done
@@ -1,49 +1,224 @@
+#include <poll.h>
+#include <netinet/tcp.h>
+#include <sys/uio.h>
 #include "csapp.h"
 #include "cache.h"
+#include "slab.h"
+#include "policy.h"
+#include "sbuf.h"
+#include "http.h"
+#include "event.h"
+#include "relay.h"
+#include "upstream.h"
+#include "dns.h"
+#include "disk.h"
+#include "log.h"
+#include "metrics.h"
+#include "compress.h"
 
-/* You won't lose style points for including this long line in your code */
-static const char *user_agent_hdr = "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n";
-static const char *connection_hdr = "Connection: close\r\n";
-static const char *proxy_connection_hdr = "Proxy-Connection: close\r\n";
+/* Worker pool defaults; 0 threads means one thread per connection */
+#define DEFAULT_THREADS 16
+#define DEFAULT_QUEUE 64
 
-typedef struct http_header {
-    char *key;
-    char *value;
-    struct http_header *next;
-} http_header;
+sbuf_t sbuf; /* Shared buffer of connected descriptors */
 
-typedef struct http_request {
-    char uri[MAXLINE];
-    char path[MAXLINE];
-    char host[MAXLINE];
-    char hostname[MAXLINE];
-    char port[MAXLINE];
+/* Seconds a client connection may sit idle between requests */
+#define KEEPALIVE_TIMEOUT 5
 
-    http_header *extra_hdrs;
-} http_request;
+/* Seconds a client may stall a response before it is given up on */
+#define CLIENT_SEND_TIMEOUT 30
+
+/* Milliseconds to back off when accept() runs out of descriptors */
+#define ACCEPT_BACKOFF_MS 100
+
+/* Ranges of objects not cached whole are fetched, and cached, in aligned
+ * chunks of this many bytes, if the memory cache takes objects that big */
+#define RANGE_CHUNK_SIZE (256 * 1024)
+
+/* Response being forwarded, captured for the cache while it fits */
+typedef struct response {
+    int connfd;
+    char *head;                 // Head not yet sent to the client, or NULL
+    size_t head_len;
+    size_t head_end;            // Where the proxy's Connection header goes
+    const char *conn_hdr;       // NULL if the response is not HTTP/1.x
+    char *body;                 // Object being captured, NULL once too large
+    size_t size;                // Object bytes received so far
+    size_t sent;                // Object bytes forwarded to the client
+    size_t capacity;
+    size_t limit;               // Largest object the memory or disk tier takes
+    cache_flight *flight;       // Misses waiting for this object, or NULL
+    int failed;                 // The client went away; nothing more is sent
+} response;
 
 void error(const char *msg);
+void usage(char *prog);
+void serve(int connfd);
+int forward_response_head(http_request *request, rio_t *rio, char *head, long len, size_t head_end,
+                          http_response *resp, int connfd, int *keep_alive, cache_flight **flight,
+                          cache_entry *stale);
+int forward_cached_response(char *value, size_t size, int connfd, int keep_alive);
+int forward_cached_range(char *value, size_t size, http_request *request, int connfd, int keep_alive);
+int forward_cache_entry(cache_entry *entry, http_request *request, int connfd, int keep_alive);
+int forward_chunked_range(http_request *request, int connfd, int keep_alive, log_outcome *outcome);
+int forward_error(int connfd, int status, int keep_alive);
+void note_response(int status, size_t bytes);
 void *proxy_thread(void *vargp);
+void *worker_thread(void *vargp);
+void *stats_thread(void *vargp);
 
 // Helper functions
-char *trim(char *str);
+size_t parse_size(const char *str);
+int writev_full(int fd, struct iovec *iov, int iovcnt);
 
 int main(int argc, char *argv[])
 {
-    int listenfd;
-    char *port;
+    int opt, listenfd, connfd;
+    int nthreads = DEFAULT_THREADS, queue_size = DEFAULT_QUEUE;
+    int max_idle = UPSTREAM_MAX_IDLE, dns_ttl = DNS_TTL, level = LOG_ACCESS, metrics_port = 0;
+    int upstream_timeout = UPSTREAM_TIMEOUT;
+    char *port, *env, *engine = "threads", *disk_dir = NULL, *log_file = NULL;
+    size_t capacity = MAX_CACHE_SIZE, max_object = MAX_OBJECT_SIZE, disk_size = DISK_CAPACITY;
+    cache_policy *policy = &lru_policy;
+    FILE *log_fp = stdout;
     struct sockaddr_in clientaddr;
     socklen_t clientlen = sizeof(clientaddr);
     pthread_t tid;
+    sigset_t mask;
 
-    cache_init();
+    // Cache limits: defaults, then environment, then command line
+    if ((env = getenv("PROXY_CACHE_SIZE")) != NULL) {
+        capacity = parse_size(env);
+    }
+    if ((env = getenv("PROXY_MAX_OBJECT_SIZE")) != NULL) {
+        max_object = parse_size(env);
+    }
+    if ((env = getenv("PROXY_CACHE_POLICY")) != NULL) {
+        policy = policy_lookup(env);
+    }
+    if ((env = getenv("PROXY_THREADS")) != NULL) {
+        nthreads = atoi(env);
+    }
+    if ((env = getenv("PROXY_ENGINE")) != NULL) {
+        engine = env;
+    }
+    if ((env = getenv("PROXY_UPSTREAM_IDLE")) != NULL) {
+        max_idle = atoi(env);
+    }
+    if ((env = getenv("PROXY_UPSTREAM_TIMEOUT")) != NULL) {
+        upstream_timeout = atoi(env);
+    }
+    if ((env = getenv("PROXY_DNS_TTL")) != NULL) {
+        dns_ttl = atoi(env);
+    }
+    if ((env = getenv("PROXY_DISK_DIR")) != NULL) {
+        disk_dir = env;
+    }
+    if ((env = getenv("PROXY_DISK_SIZE")) != NULL) {
+        disk_size = parse_size(env);
+    }
+    if ((env = getenv("PROXY_SPLICE")) != NULL) {
+        relay_splice_enabled = atoi(env);
+    }
+    if ((env = getenv("PROXY_LOG_LEVEL")) != NULL) {
+        level = log_level_lookup(env);
+    }
+    if ((env = getenv("PROXY_LOG_FILE")) != NULL) {
+        log_file = env;
+    }
+    if ((env = getenv("PROXY_METRICS_PORT")) != NULL) {
+        metrics_port = atoi(env);
+    }
+    if ((env = getenv("PROXY_COMPRESS")) != NULL) {
+        compress_level = atoi(env);
+    }
+    while ((opt = getopt(argc, argv, "c:o:p:t:q:e:u:T:d:D:S:l:L:m:z:")) != -1) {
+        switch (opt) {
+        case 'c':
+            capacity = parse_size(optarg);
+            break;
+        case 'o':
+            max_object = parse_size(optarg);
+            break;
+        case 'p':
+            policy = policy_lookup(optarg);
+            break;
+        case 't':
+            nthreads = atoi(optarg);
+            break;
+        case 'q':
+            queue_size = atoi(optarg);
+            break;
+        case 'e':
+            engine = optarg;
+            break;
+        case 'u':
+            max_idle = atoi(optarg);
+            break;
+        case 'T':
+            upstream_timeout = atoi(optarg);
+            break;
+        case 'd':
+            dns_ttl = atoi(optarg);
+            break;
+        case 'D':
+            disk_dir = optarg;
+            break;
+        case 'S':
+            disk_size = parse_size(optarg);
+            break;
+        case 'l':
+            level = log_level_lookup(optarg);
+            break;
+        case 'L':
+            log_file = optarg;
+            break;
+        case 'm':
+            metrics_port = atoi(optarg);
+            break;
+        case 'z':
+            compress_level = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (capacity == 0 || max_object == 0 || policy == NULL || nthreads < 0 || queue_size <= 0 || max_idle < 0 || upstream_timeout < 0 || dns_ttl < 0 || disk_size == 0 || level < 0 ||
+        metrics_port < 0 || metrics_port > 65535 || compress_level < 0 || compress_level > 9 ||
+        (strcmp(engine, "threads") != 0 && strcmp(engine, "epoll") != 0)) {
+        usage(argv[0]);
+    }
 
     // Check port number
-    if (argc < 2) {
+    if (optind >= argc) {
         error("ERROR, no port provided\n");
-        exit(1);
+        usage(argv[0]);
     }
-    port = argv[1];
+    port = argv[optind];
+
+    if (log_file != NULL && (log_fp = fopen(log_file, "a")) == NULL) {
+        unix_error("ERROR, while opening the log file");
+    }
+
+    slab_init();
+    cache_init(capacity, max_object, policy);
+    upstream_init(max_idle, upstream_timeout);
+    dns_init(dns_ttl);
+    if (disk_dir != NULL) {
+        disk_init(disk_dir, disk_size);
+    }
+
+    // A client or origin that goes away shows up as EPIPE on the next
+    // write, to the connection concerned only
+    Signal(SIGPIPE, SIG_IGN);
+
+    // SIGUSR1 is only ever delivered to the stats thread
+    Sigemptyset(&mask);
+    Sigaddset(&mask, SIGUSR1);
+    Sigprocmask(SIG_BLOCK, &mask, NULL);
+    Pthread_create(&tid, NULL, stats_thread, NULL);
+    log_init(level, log_fp);
+    metrics_init(metrics_port);
 
     // Establish listening requests
     listenfd = Open_listenfd(port);
@@ -51,11 +226,42 @@ int main(int argc, char *argv[])
         error("ERROR, while opening listenfd\n");
     }
 
-    // Accept client request
+    // The event engine serves every connection from this thread
+    if (strcmp(engine, "epoll") == 0) {
+        event_loop(listenfd);
+    }
+
+    // Prethread the worker pool
+    if (nthreads > 0) {
+        sbuf_init(&sbuf, queue_size);
+        for (int i = 0; i < nthreads; i++) {
+            Pthread_create(&tid, NULL, worker_thread, NULL);
+        }
+    }
+
+    // Accept client request. A full queue blocks accepting, so excess
+    // connections wait in the listen backlog.
     while (1) {
-        int *connfdp = Malloc(sizeof(int));
-        *connfdp = Accept(listenfd, (SA *) &clientaddr, &clientlen);
-        Pthread_create(&tid, NULL, proxy_thread, connfdp);
+        if ((connfd = accept(listenfd, (SA *) &clientaddr, &clientlen)) < 0) {
+            // Out of descriptors: let connections finish before taking more
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+                error("ERROR, while accepting a connection");
+                poll(NULL, 0, ACCEPT_BACKOFF_MS);
+            }
+            continue;
+        }
+        metrics_accepted(connfd);
+        if (nthreads > 0) {
+            sbuf_insert(&sbuf, connfd);
+        } else {
+            int *connfdp = Malloc(sizeof(int));
+            *connfdp = connfd;
+            if (pthread_create(&tid, NULL, proxy_thread, connfdp) != 0) {
+                error("ERROR, while creating a thread");
+                Free(connfdp);
+                Close(connfd);
+            }
+        }
     }
 
     cache_free();
@@ -63,198 +269,1139 @@ int main(int argc, char *argv[])
     return 0;
 }
 
+void usage(char *prog)
+{
+    fprintf(stderr, "usage: %s [-c cache_size] [-o max_object_size] [-p policy]\n", prog);
+    fprintf(stderr, "          [-t threads] [-q queue_size] [-e engine]\n");
+    fprintf(stderr, "          [-u upstream_idle] [-T upstream_timeout] [-d dns_ttl]\n");
+    fprintf(stderr, "          [-D disk_dir] [-S disk_size] [-l log_level] [-L log_file]\n");
+    fprintf(stderr, "          [-m metrics_port] [-z compress_level] <port>\n");
+    fprintf(stderr, "   sizes take an optional K, M or G suffix\n");
+    fprintf(stderr, "   policy is one of lru (default), clock, tinylfu\n");
+    fprintf(stderr, "   threads is the worker pool size (default %d, 0 = one thread per connection)\n", DEFAULT_THREADS);
+    fprintf(stderr, "   queue_size bounds connections waiting for a worker (default %d)\n", DEFAULT_QUEUE);
+    fprintf(stderr, "   engine is threads (default) or epoll, a single-threaded event loop\n");
+    fprintf(stderr, "   upstream_idle is the keep-alive connections kept per origin (default %d, 0 = none)\n", UPSTREAM_MAX_IDLE);
+    fprintf(stderr, "   upstream_timeout is how long an origin may go silent before the client gets a 504\n");
+    fprintf(stderr, "        (default %ds, 0 = forever); connecting may take %ds\n", UPSTREAM_TIMEOUT, UPSTREAM_CONNECT_TIMEOUT);
+    fprintf(stderr, "   dns_ttl is how long resolved upstream addresses are reused (default %ds, 0 = never)\n", DNS_TTL);
+    fprintf(stderr, "   disk_dir keeps a second cache tier that survives restarts (default size %luM)\n", DISK_CAPACITY >> 20);
+    fprintf(stderr, "   log_level is off, access (default, one line per request) or debug; the log goes\n");
+    fprintf(stderr, "        to log_file, or to stdout\n");
+    fprintf(stderr, "   metrics_port serves GET %s on 127.0.0.1 in the Prometheus text format (default off)\n", METRICS_PATH);
+    fprintf(stderr, "   compress_level 1 (fastest) to 9 stores cached text gzipped, sent as it is to clients\n");
+    fprintf(stderr, "        that accept gzip and expanded for the rest (default 0 = off)\n");
+    fprintf(stderr, "   byte ranges are cut from cached objects; ranges of others are fetched and cached in\n");
+    fprintf(stderr, "        %dK chunks if max_object_size leaves room for them\n", RANGE_CHUNK_SIZE >> 10);
+    fprintf(stderr, "   env: PROXY_CACHE_SIZE, PROXY_MAX_OBJECT_SIZE, PROXY_CACHE_POLICY, PROXY_THREADS,\n");
+    fprintf(stderr, "        PROXY_ENGINE, PROXY_UPSTREAM_IDLE, PROXY_UPSTREAM_TIMEOUT, PROXY_DNS_TTL,\n");
+    fprintf(stderr, "        PROXY_DISK_DIR, PROXY_DISK_SIZE, PROXY_LOG_LEVEL, PROXY_LOG_FILE,\n");
+    fprintf(stderr, "        PROXY_METRICS_PORT, PROXY_COMPRESS, PROXY_SPLICE (0 disables the zero-copy relay)\n");
+    fprintf(stderr, "   send SIGUSR1 to print cache statistics\n");
+    exit(1);
+}
+
+// Prints a stats line each time SIGUSR1 arrives
+void *stats_thread(void *vargp)
+{
+    int sig;
+    sigset_t mask;
+
+    Pthread_detach(pthread_self());
+
+    Sigemptyset(&mask);
+    Sigaddset(&mask, SIGUSR1);
+    while (1) {
+        if (sigwait(&mask, &sig) == 0) {
+            cache_stats(stderr);
+            compress_stats(stderr);
+            upstream_stats(stderr);
+            dns_stats(stderr);
+            disk_stats(stderr);
+            log_stats(stderr);
+        }
+    }
+
+    return NULL;
+}
+
 void error(const char *msg)
 {
     fprintf(stderr, "%s\n", msg);
 }
 
-http_request parse_request(int connfd)
+// Parses the next request on the connection, reading until its head is
+// complete. Pipelined requests stay buffered in parser, and the fields of
+// request point into it. Returns 0, -1 if the client closed or failed,
+// or the status to refuse what it sent with: 400 if it is not a request
+// the proxy understands, 501 if it is not a GET.
+int parse_request(http_parser *parser, int fd, http_request *request)
 {
-    printf("parse_request\n");
+    int rc;
+    ssize_t n;
 
-    rio_t rio;
-    char buf[MAXLINE];
-    char method[MAXLINE];
-    http_request request;
-    http_header *curr = NULL;
+    while ((rc = http_parser_next(parser, request)) == 0) {
+        n = read(fd, parser->buf + parser->len, HTTP_HEAD_SIZE - parser->len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        parser->len += n;
+    }
+    if (rc < 0) {
+        return -rc;
+    }
+    log_debug("GET %s", request->uri);
 
-    memset(&request, 0, sizeof(http_request));
-    memset(buf, 0, sizeof(buf));
+    return 0;
+}
 
-    // Read request
-    Rio_readinitb(&rio, connfd);
+// Sends the request upstream over a pooled connection if there is one,
+// with extra header lines (or NULL): validators making it conditional,
+// or the proxy's own Range. Returns the upstream descriptor, or -1 with
+// errno set.
+int forward_request(http_request *request, int *reused, const char *extra)
+{
+    int clientfd, iovcnt, err;
+    struct iovec iov[HTTP_REQUEST_IOV];
+
+    // Open client connection
+    clientfd = upstream_get(request->hostname, request->port, reused);
+    if (clientfd < 0) {
+        err = errno;
+        log_debug("cannot connect to %s:%s: %s", request->hostname, request->port, strerror(err));
+        errno = err;
+        return -1;
+    }
 
-    Rio_readlineb(&rio, buf, MAXLINE);
-    printf("%s", buf);
+    // Send request to server: one gathered write of the request's own
+    // slices and the pre-serialized fixed headers
+    iovcnt = http_request_iov(request, iov, upstream_max_idle > 0, extra);
+    if (upstream_sendv(clientfd, iov, iovcnt) < 0) {
+        err = errno;
+        Close(clientfd);
+        errno = err;
+        return -1;
+    }
 
-    sscanf(buf, "%*s %s %*s", request.uri);
+    return clientfd;
+}
+
+// Writes n object bytes at p to the client. The head goes out with the
+// first of them, with the proxy's Connection header spliced in. Once the
+// client has gone away, the bytes only go to the waiters, if any.
+void response_write(response *r, char *p, size_t n)
+{
+    struct iovec iov[4];
+    int iovcnt = 0;
 
-    sscanf(request.uri, "http://%[^/]%s", request.host, request.path);
-    if (strcmp(request.path, "") == 0) {
-        strcpy(request.path, "/");
+    if (r->head != NULL) {
+        if (r->conn_hdr != NULL) {
+            iov[iovcnt++] = (struct iovec){r->head, r->head_end};
+            iov[iovcnt++] = (struct iovec){(char *)r->conn_hdr, strlen(r->conn_hdr)};
+            iov[iovcnt++] = (struct iovec){r->head + r->head_end, r->head_len - r->head_end};
+        } else {
+            iov[iovcnt++] = (struct iovec){r->head, r->head_len};
+        }
+        r->head = NULL;
     }
-    sscanf(request.host, "%[^:]:%s", request.hostname, request.port);
-    if (strcmp(request.port, "") == 0) {
-        strcpy(request.port, "80");
+    if (n > 0) {
+        iov[iovcnt++] = (struct iovec){p, n};
     }
-    
-    while (Rio_readlineb(&rio, buf, MAXLINE) != 0) {
-        printf("%s", buf);
 
-        // Last line of request
-        if (strcmp(buf, "\r\n") == 0) {
-            break;
+    if (!r->failed) {
+        metrics_first_byte();
+        if (writev_full(r->connfd, iov, iovcnt) < 0) {
+            r->failed = 1;
         }
+    }
 
-        char *key = trim(strtok(buf, ":"));
-        char *value = trim(strtok(NULL, "\r\n"));
-
-        // Ignore headers
-        if (strcmp(key, "Host") == 0 || strcmp(key, "User-Agent") == 0 || strcmp(key, "Connection") == 0 || strcmp(key, "Proxy-Connection") == 0) {
-            continue;
-        // Add extra header to linked list
+    // Waiters see the same bytes; past CACHE_STREAM_MAX they have to go
+    if (r->flight != NULL && n > 0) {
+        if (r->flight->size + n > CACHE_STREAM_MAX) {
+            cache_flight_end(r->flight, 0);
+            r->flight = NULL;
         } else {
-            http_header *hdr = Malloc(sizeof(http_header));
-            hdr->key = strdup(key);
-            hdr->value = strdup(value);
-            hdr->next = NULL;
-
-            if (curr == NULL) {
-                request.extra_hdrs = hdr;
-                curr = hdr;
-            } else {
-                curr->next = hdr;
-                curr = curr->next;
-            }
+            cache_flight_append(r->flight, p, n);
         }
     }
+}
+
+// Returns where to read up to *want more response bytes: the object
+// buffer while the response may still be cached, buf otherwise
+char *response_space(response *r, char *buf, size_t *want)
+{
+    // Grow the object buffer up to the limit
+    if (r->body != NULL && r->size == r->capacity && r->capacity < r->limit) {
+        size_t new_capacity = r->capacity * 2 < r->limit ? r->capacity * 2 : r->limit;
+        r->body = slab_realloc(r->body, r->capacity, new_capacity);
+        r->capacity = new_capacity;
+    }
 
-    return request;
+    if (r->body != NULL && r->size < r->capacity) {
+        if (*want > r->capacity - r->size) {
+            *want = r->capacity - r->size;
+        }
+        return r->body + r->size;
+    }
+    if (*want > MAXLINE) {
+        *want = MAXLINE;
+    }
+    return buf;
 }
 
-int forward_request(http_request request)
+// Forwards the bytes of the object buffer the client has not seen yet,
+// and the head if nothing else has gone out
+void response_flush(response *r)
 {
-    printf("\nforward_request\n");
+    if (r->body != NULL && r->sent < r->size) {
+        response_write(r, r->body + r->sent, r->size - r->sent);
+        r->sent = r->size;
+    } else if (r->head != NULL) {
+        response_write(r, NULL, 0);
+    }
+}
 
-    int n;
-    int clientfd;
-    char buf[MAXLINE];
-    rio_t rio;
-    http_header *curr = request.extra_hdrs;
+// Gives up on caching the response. Unless misses are tailing it, the
+// rest of it need not pass through user space.
+void response_uncacheable(response *r)
+{
+    if (r->body != NULL) {
+        response_flush(r);
+        slab_free(r->body, r->capacity);
+        r->body = NULL;
+    }
+    if (r->flight != NULL && cache_flight_detach(r->flight)) {
+        r->flight = NULL;
+    }
+}
 
-    // Open client connection
-    clientfd = Open_clientfd(request.hostname, request.port);
-    if (clientfd < 0) {
-        error("ERROR, while opening clientfd\n");
+// Accounts for n bytes just read to p. Bytes in the object buffer are
+// forwarded by the next response_flush().
+void response_commit(response *r, char *p, size_t n)
+{
+    if (r->body != NULL && p == r->body + r->size) {
+        r->size += n;
+        return;
     }
 
-    // Send request to server
-    Rio_readinitb(&rio, clientfd);
+    // Too large to cache
+    response_uncacheable(r);
+    response_flush(r);
 
-    sprintf(buf, "GET %s HTTP/1.0\r\n", request.path);
-    printf("%s", buf);
-    Rio_writen(clientfd, buf, strlen(buf));
+    response_write(r, p, n);
+    r->size += n;
+    r->sent = r->size;
+}
 
-    sprintf(buf, "Host: %s\r\n", request.host);
-    printf("%s", buf);
-    Rio_writen(clientfd, buf, strlen(buf));
+// Forwards response bytes already held in data, such as chunk lines
+void response_append(response *r, char *data, size_t n)
+{
+    while (n > 0) {
+        size_t want = n;
+        char *p = response_space(r, data, &want);
+        if (p != data) {
+            memcpy(p, data, want);
+        }
+        response_commit(r, p, want);
+        data += want;
+        n -= want;
+    }
+}
 
-    sprintf(buf, "%s", user_agent_hdr);
-    printf("%s", buf);
-    Rio_writen(clientfd, buf, strlen(buf));
+// Forwards exactly count bytes, or everything up to EOF for RELAY_ALL.
+// Returns -1 if the server stopped early, or if the client went away and
+// nobody else wants the rest.
+int forward_body(rio_t *rio, response *r, size_t count)
+{
+    char buf[MAXLINE];
+    ssize_t n;
 
-    sprintf(buf, "%s", connection_hdr);
-    printf("%s", buf);
-    Rio_writen(clientfd, buf, strlen(buf));
+    while (count > 0) {
+        if (r->failed && r->body == NULL && r->flight == NULL) {
+            return -1;
+        }
 
-    sprintf(buf, "%s", proxy_connection_hdr);
-    printf("%s", buf);
-    Rio_writen(clientfd, buf, strlen(buf));
+        // Bytes that will not be cached need not pass through user space
+        if (r->body == NULL && r->flight == NULL && rio->rio_cnt == 0) {
+            response_flush(r);
+            if ((n = relay(rio->rio_fd, r->connfd, count)) > 0) {
+                log_debug("relayed %zd bytes", n);
+                r->size += n;
+                r->sent = r->size;
+            }
+            return count == RELAY_ALL ? (n < 0 ? -1 : 0) : (n == count ? 0 : -1);
+        }
 
-    while (curr != NULL) {
-        sprintf(buf, "%s: %s\r\n", curr->key, curr->value);
-        printf("%s", buf);
-        Rio_writen(clientfd, buf, strlen(buf));
-        curr = curr->next;
+        size_t want = count;
+        char *p = response_space(r, buf, &want);
+        if ((n = rio_readnb(rio, p, want)) <= 0) {
+            return count == RELAY_ALL && n == 0 ? 0 : -1;
+        }
+        response_commit(r, p, n);
+        response_flush(r);
+        if (count != RELAY_ALL) {
+            count -= n;
+        }
     }
-    Rio_writen(clientfd, "\r\n", strlen("\r\n"));
 
-    return clientfd;
+    return 0;
+}
+
+// Forwards a chunked body, chunk framing included
+int forward_chunked(rio_t *rio, response *r)
+{
+    char line[MAXLINE];
+    ssize_t n;
+    unsigned long long len;
+
+    while (1) {
+        if ((n = rio_readlineb(rio, line, MAXLINE)) <= 0) {
+            return -1;
+        }
+        response_append(r, line, n);
+        if (r->failed && r->body == NULL && r->flight == NULL) {
+            return -1;
+        }
+
+        // Chunk data is followed by CRLF
+        if ((len = strtoull(line, NULL, 16)) == 0) {
+            break;
+        }
+        if (forward_body(rio, r, len + 2) < 0) {
+            return -1;
+        }
+    }
+
+    // Trailers end with an empty line
+    do {
+        if ((n = rio_readlineb(rio, line, MAXLINE)) <= 0) {
+            return -1;
+        }
+        response_append(r, line, n);
+    } while (strcmp(line, "\r\n") != 0 && strcmp(line, "\n") != 0);
+
+    return 0;
 }
 
-void forward_response(char* uri, int clientfd, int connfd)
+// Reads the status line and headers into head, dropping hop-by-hop
+// headers. Returns the head length, 0 if it is not HTTP/1.x (only the
+// first line is read then), or -1 if the head is cut short or does not
+// fit; *head_end is 0 then if the server sent nothing at all, and errno
+// tells whether it closed the connection (ECONNRESET), went silent
+// (EAGAIN) or sent too large a head (EMSGSIZE).
+long read_response_head(rio_t *rio, char *head, http_response *resp, size_t *head_end)
 {
-    printf("\nforward_response\n");
+    ssize_t n;
+    size_t len;
+    char line[MAXLINE];
 
-    int n, size = 0;
-    char buf[MAXLINE], body[MAX_OBJECT_SIZE];
+    http_response_init(resp);
+    *head_end = 0;
+    if ((n = rio_readlineb(rio, line, MAXLINE)) <= 0) {
+        if (n == 0) {
+            errno = ECONNRESET;
+        }
+        return -1;
+    }
+    memcpy(head, line, n);
+    len = n;
+    if (http_parse_status_line(line, resp) < 0) {
+        *head_end = len;
+        return 0;
+    }
+
+    while ((n = rio_readlineb(rio, line, MAXLINE)) > 0) {
+        if (strcmp(line, "\r\n") == 0 || strcmp(line, "\n") == 0) {
+            break;
+        }
+        http_parse_response_header(line, resp);
+        if (http_is_hop_header(line)) {
+            continue;
+        }
+        if (len + n > MAXBUF - 2) {
+            *head_end = len;
+            errno = EMSGSIZE;
+            return -1;
+        }
+        memcpy(head + len, line, n);
+        len += n;
+    }
+
+    *head_end = len;
+    if (n <= 0) {
+        if (n == 0) {
+            errno = ECONNRESET;
+        }
+        return -1;
+    }
+    memcpy(head + len, "\r\n", 2);
+    return len + 2;
+}
+
+// Forwards one response, framed by Content-Length, chunked encoding or
+// EOF. On entry *keep_alive says whether the client wants to send more
+// requests; on return, whether it may. Returns 1 if the upstream
+// connection can carry another request, 0 if it must be closed, and -1,
+// with errno saying why, if no whole head came back; nothing has reached
+// the client then, so it can still be sent an error. Misses waiting on
+// *flight tail the response as it goes out; the flight is ended, and
+// cleared, once the response is over or the waiters have to fetch it
+// themselves. If the request revalidated stale, a 304 refreshes it and
+// it is served instead.
+int forward_response(http_request *request, int clientfd, int connfd, int *keep_alive, cache_flight **flight,
+                     cache_entry *stale)
+{
+    long len;
+    size_t head_end;
+    char head[MAXBUF];
     rio_t rio;
+    http_response resp;
 
-    memset(body, 0, sizeof(body));
-    
     // Read response from server and forward to client
     Rio_readinitb(&rio, clientfd);
-    while ((n = Rio_readnb(&rio, buf, MAXLINE)) != 0) {
-        size += n;
-        if (size <= MAX_OBJECT_SIZE) {
-            memcpy(body + size - n, buf, n);
+    if ((len = read_response_head(&rio, head, &resp, &head_end)) < 0) {
+        return -1;
+    }
+    return forward_response_head(request, &rio, head, len, head_end, &resp, connfd, keep_alive, flight, stale);
+}
+
+// Forwards the rest of a response whose head read_response_head() has
+// read from rio into head: len bytes, head_end of them before the empty
+// line. Returns as forward_response() does, never -1.
+int forward_response_head(http_request *request, rio_t *rio, char *head, long len, size_t head_end,
+                          http_response *resp, int connfd, int *keep_alive, cache_flight **flight,
+                          cache_entry *stale)
+{
+    int rc;
+    response r;
+
+    r.head_end = head_end;
+
+    // Not modified: the cached body is still good, with a new lifetime
+    if (stale != NULL && resp->status == 304) {
+        time_t now = time(NULL), expires = http_response_expires(resp, now);
+        if (expires == 0) {
+            http_response cached;
+            http_parse_response_head(stale->value, stale->size, &cached);
+            expires = http_response_expires(&cached, now);
         }
-        printf("%s", buf);
-        Rio_writen(connfd, buf, n);
+        cache_refresh(stale, expires);
+        *keep_alive = forward_cache_entry(stale, request, connfd, *keep_alive);
+        log_response_outcome(LOG_REVALIDATED);
+        metrics_response_outcome(LOG_REVALIDATED);
+        return !resp->close && rio->rio_cnt == 0;
+    }
+    int cacheable = len > 0 && http_response_cacheable(resp);
+
+    r.connfd = connfd;
+    r.failed = 0;
+    r.flight = *flight;
+    r.head = head;
+    r.head_len = len > 0 ? len : r.head_end;
+
+    // The client can only tell where a delimited response ends
+    if (len == 0 || !http_response_is_framed(resp)) {
+        *keep_alive = 0;
     }
+    r.conn_hdr = len == 0 ? NULL : *keep_alive ? keep_alive_hdr : close_hdr;
 
-    printf("\nsize: %d\n", size);
-    if (size <= MAX_OBJECT_SIZE) {
-        cache_insert(uri, body, size);
+    // The cached object starts with the head, minus the hop-by-hop headers
+    r.limit = disk_enabled && DISK_MAX_OBJECT > cache_max_object ? DISK_MAX_OBJECT : cache_max_object;
+    r.capacity = MAXLINE < r.limit ? MAXLINE : r.limit;
+    while (r.capacity < r.head_len && r.capacity < r.limit) {
+        r.capacity = r.capacity * 2 < r.limit ? r.capacity * 2 : r.limit;
+    }
+    r.body = NULL;
+    r.size = r.sent = r.head_len;
+    if (r.head_len <= r.capacity) {
+        r.body = slab_alloc(r.capacity);
+        memcpy(r.body, head, r.head_len);
     }
+
+    // The stream holds the head without the proxy's Connection header,
+    // just like a cached object. Responses no cache may share are not
+    // streamed to other clients either.
+    if (r.flight != NULL) {
+        if (!cacheable || (resp->content_length >= 0 && resp->content_length > CACHE_STREAM_MAX - r.head_len)) {
+            cache_flight_end(r.flight, 0);
+            r.flight = NULL;
+        } else {
+            cache_flight_stream(r.flight, head, r.head_len);
+        }
+    }
+    if (r.body == NULL || !cacheable || (resp->content_length >= 0 && resp->content_length > r.limit - r.head_len)) {
+        response_uncacheable(&r);
+    }
+
+    // Body
+    if (len == 0) {
+        // Not HTTP/1.x; relay whatever follows
+        resp->close = 1;
+        rc = forward_body(rio, &r, RELAY_ALL);
+    } else if (!http_response_has_body(resp)) {
+        rc = 0;
+    } else if (resp->chunked) {
+        rc = forward_chunked(rio, &r);
+    } else if (resp->content_length >= 0) {
+        rc = forward_body(rio, &r, resp->content_length);
+    } else {
+        resp->close = 1;
+        rc = forward_body(rio, &r, RELAY_ALL);
+    }
+
+    response_flush(&r);
+    note_response(len > 0 ? resp->status : 0, r.size);
+    if (r.failed) {
+        *keep_alive = 0;
+    }
+    if (r.body != NULL && rc == 0) {
+        // The disk keeps a copy across restarts, and the memory cache takes
+        // ownership of the body if it fits
+        time_t expires = http_response_expires(resp, time(NULL));
+        disk_store(request->uri, r.body, r.size, expires);
+        if (r.size <= cache_max_object) {
+            cache_insert(request->uri, slab_realloc(r.body, r.capacity, r.size), r.size, expires);
+        } else {
+            slab_free(r.body, r.capacity);
+        }
+    } else if (r.body != NULL) {
+        slab_free(r.body, r.capacity);
+    }
+    if (r.flight != NULL) {
+        cache_flight_end(r.flight, rc == 0);
+    }
+    *flight = NULL;
+
+    if (rc < 0) {
+        *keep_alive = 0;
+    }
+
+    // Bytes past the response mean the framing was off
+    return rc == 0 && !resp->close && rio->rio_cnt == 0;
+}
+
+// Returns whether the client may send another request
+int forward_cached_response(char *value, size_t size, int connfd, int keep_alive)
+{
+    http_response resp;
+    struct iovec iov[3];
+    long head_end = http_parse_response_head(value, size, &resp);
+
+    // Forward cached response to client. The entry or disk segment is
+    // pinned, so this runs without holding any cache lock.
+    note_response(head_end < 0 ? 0 : resp.status, size);
+    metrics_first_byte();
+    if (head_end < 0) {
+        rio_writen(connfd, value, size);
+        return 0;
+    }
+
+    keep_alive = keep_alive && http_response_is_framed(&resp);
+    iov[0] = (struct iovec){value, head_end};
+    iov[1] = (struct iovec){(char *)(keep_alive ? keep_alive_hdr : close_hdr), 0};
+    iov[1].iov_len = strlen(iov[1].iov_base);
+    iov[2] = (struct iovec){value + head_end, size - head_end};
+    if (writev_full(connfd, iov, 3) < 0) {
+        return 0;
+    }
+
+    return keep_alive;
 }
 
-void forward_cached_response(cache_entry *cached, int connfd)
+// Serves the byte range the client asked for out of a cached response,
+// as a 206, or a 416 if it lies past the end. Anything but a whole 200
+// framed by Content-Length, or a range If-Range rules out, is sent whole.
+// Returns whether the client may send another request.
+int forward_cached_range(char *value, size_t size, http_request *request, int connfd, int keep_alive)
 {
-    printf("\nforward_cached_response\n");
+    http_response resp;
+    struct iovec iov[4];
+    char head[MAXBUF];
+    long long first = 0, last = 0;
+    long head_end;
+    size_t len;
+    int status, iovcnt = 3;
 
+    if (!request->range || (head_end = http_parse_response_head(value, size, &resp)) < 0 ||
+        resp.status != 200 || resp.chunked || memcmp(value + head_end, "\r\n", 2) != 0 ||
+        resp.content_length != size - head_end - 2 || !http_if_range_matches(request, value, head_end) ||
+        (status = http_range_resolve(request, resp.content_length, &first, &last)) == 200 ||
+        (len = http_format_partial(value, head_end, status == 206 ? first : -1, last, resp.content_length,
+                                   head, MAXBUF)) == 0) {
+        return forward_cached_response(value, size, connfd, keep_alive);
+    }
+
+    iov[0] = (struct iovec){head, len};
+    iov[1] = (struct iovec){(char *)(keep_alive ? keep_alive_hdr : close_hdr), 0};
+    iov[1].iov_len = strlen(iov[1].iov_base);
+    iov[2] = (struct iovec){"\r\n", 2};
+
+    // A 416 has no body
+    if (status == 206) {
+        iov[iovcnt++] = (struct iovec){value + head_end + 2 + first, last - first + 1};
+    }
+    note_response(status, len + iov[1].iov_len + 2 + (status == 206 ? last - first + 1 : 0));
+    metrics_first_byte();
+    if (writev_full(connfd, iov, iovcnt) < 0) {
+        return 0;
+    }
+
+    return keep_alive;
+}
+
+// Serves a pinned cache entry, compressed or not as the client allows.
+// Ranges are cut from the plain form. Returns whether the client may send
+// another request.
+int forward_cache_entry(cache_entry *entry, http_request *request, int connfd, int keep_alive)
+{
+    size_t size;
+    char *value = compress_open(entry, request->accept_gzip && !request->range, &size);
+
+    if (value == NULL) {
+        log_debug("cannot expand cached %s", entry->key);
+        return forward_error(connfd, 502, keep_alive);
+    }
+    keep_alive = forward_cached_range(value, size, request, connfd, keep_alive);
+    compress_close(entry, value, size);
+    return keep_alive;
+}
+
+// Lays out the cache key of chunk k of uri, or with k -1 the key that
+// marks it as not served in ranges. The suffix follows a space, which no
+// request URI holds, so no client request can name a chunk.
+void chunk_key(char *key, size_t size, char *uri, long long k)
+{
+    if (k < 0) {
+        snprintf(key, size, "%s #chunk=none", uri);
+    } else {
+        snprintf(key, size, "%s #chunk=%lld", uri, k);
+    }
+}
+
+// Returns chunk k of the request's object: a 206 response of
+// RANGE_CHUNK_SIZE bytes, fewer for the last chunk, held under its
+// chunk_key(). A cached chunk comes back pinned in *entry; otherwise it
+// is fetched with a Range of its own, cached, and returned in a slab
+// buffer, with *entry NULL. Returns NULL if the origin does not answer
+// with exactly that chunk.
+//
+// Later chunks pass the If-Range line of the first as if_range, so they
+// come from the same version of the object: a cached chunk of another
+// version is fetched again, and an origin whose object has changed
+// answers with the whole of it, which is not taken; errno is then ESTALE.
+//
+// Otherwise an origin that ignores Range answers with the whole object.
+// That is remembered under chunk_key() -1, so the object is not chunked
+// again, and unless connfd is -1 the response goes to the client as it
+// is and is cached whole. On entry *keep_alive says whether the client
+// wants to send more requests; on return it is -1 unless the whole
+// object was sent, and then whether the client may.
+char *fetch_chunk(http_request *request, long long k, size_t *size, cache_entry **entry, int connfd,
+                  int *keep_alive, const char *if_range)
+{
+    char key[MAXBUF + 32], range[MAXLINE], head[MAXBUF], validator[MAXLINE], *value;
+    long long first = k * RANGE_CHUNK_SIZE;
+    int clientfd, reused;
+    size_t head_end;
+    long len;
     rio_t rio;
+    http_response resp;
+
+    int client_keep_alive = *keep_alive;
+
+    *keep_alive = -1;
+    chunk_key(key, sizeof(key), request->uri, k);
+    if ((*entry = cache_lookup(key)) != NULL) {
+        long end;
+        if (!cache_is_stale(*entry, time(NULL)) &&
+            (if_range == NULL ||
+             ((end = http_parse_response_head((*entry)->value, (*entry)->size, &resp)) >= 0 &&
+              http_format_if_range((*entry)->value, end, validator, sizeof(validator)) > 0 &&
+              strcmp(validator, if_range) == 0))) {
+            *size = (*entry)->size;
+            return (*entry)->value;
+        }
+        cache_release(*entry);
+        *entry = NULL;
+    }
+
+    // The client's own range headers and encodings stay out of it
+    snprintf(range, sizeof(range), "Range: bytes=%lld-%lld\r\n%s", first, first + RANGE_CHUNK_SIZE - 1,
+             if_range != NULL ? if_range : "");
+    request->own_range = 1;
+    do {
+        if ((clientfd = forward_request(request, &reused, range)) < 0) {
+            request->own_range = 0;
+            return NULL;
+        }
+        Rio_readinitb(&rio, clientfd);
+        len = read_response_head(&rio, head, &resp, &head_end);
+        if (len < 0 && head_end == 0) {
+            Close(clientfd);
+        }
+    } while (len < 0 && head_end == 0 && reused);
+    request->own_range = 0;
+
+    if (len > 0 && resp.status == 200 && if_range != NULL) {
+        Close(clientfd);
+        errno = ESTALE;
+        return NULL;
+    }
+    if (len > 0 && resp.status == 200) {
+        chunk_key(key, sizeof(key), request->uri, -1);
+        value = slab_alloc(len);
+        memcpy(value, head, len);
+        cache_insert(key, value, len, http_response_expires(&resp, time(NULL)));
+
+        if (connfd != -1) {
+            cache_flight *flight = NULL;
+            *keep_alive = client_keep_alive;
+            if (forward_response_head(request, &rio, head, len, head_end, &resp, connfd, keep_alive, &flight,
+                                      NULL) > 0) {
+                upstream_put(request->hostname, request->port, clientfd);
+            } else {
+                Close(clientfd);
+            }
+            return NULL;
+        }
+    }
+    if (len <= 0 || resp.status != 206 || resp.chunked || resp.range_first != first || resp.range_length < 0 ||
+        resp.content_length != resp.range_last - first + 1 || resp.content_length > RANGE_CHUNK_SIZE) {
+        if (len >= 0 || head_end != 0) {
+            Close(clientfd);
+        }
+        return NULL;
+    }
+
+    *size = len + resp.content_length;
+    value = slab_alloc(*size);
+    memcpy(value, head, len);
+    if (rio_readnb(&rio, value + len, resp.content_length) != resp.content_length) {
+        Close(clientfd);
+        slab_free(value, *size);
+        return NULL;
+    }
+    if (!resp.close && rio.rio_cnt == 0) {
+        upstream_put(request->hostname, request->port, clientfd);
+    } else {
+        Close(clientfd);
+    }
+
+    // The cache takes a copy; this one goes to the client
+    if (!resp.no_store) {
+        char *copy = slab_alloc(*size);
+        memcpy(copy, value, *size);
+        cache_insert(key, copy, *size, http_response_expires(&resp, time(NULL)));
+    }
+    return value;
+}
+
+// Serves a byte range of an object not cached whole out of chunks, each
+// cached or fetched on its own. *outcome says whether any had to be
+// fetched. If the origin answers the first chunk with the whole object,
+// that is what the client gets. Returns -1, having sent nothing, if the
+// origin does not serve the first chunk, the object is known not to be
+// served in ranges, If-Range rules it out, or the range runs past the
+// first chunk and nothing ties later chunks to its version. Otherwise
+// returns whether the client may send another request.
+//
+// If the object changes midway, what was sent cannot be taken back: the
+// response is cut short and the chunks sent are dropped from the cache,
+// so the next request fetches the new version.
+int forward_chunked_range(http_request *request, int connfd, int keep_alive, log_outcome *outcome)
+{
+    long long k0 = request->range_first / RANGE_CHUNK_SIZE, k = k0, first, last, length;
+    size_t size, len;
+    long head_end;
+    char key[MAXBUF + 32], head[MAXBUF], if_range[MAXLINE], *value;
+    cache_entry *entry;
+    http_response resp;
+    struct iovec iov[4];
+    int iovcnt, whole = keep_alive;
+
+    chunk_key(key, sizeof(key), request->uri, -1);
+    if ((entry = cache_lookup(key)) != NULL) {
+        int stale = cache_is_stale(entry, time(NULL));
+        cache_release(entry);
+        if (!stale) {
+            return -1;
+        }
+    }
+
+    *outcome = LOG_MISS;
+    if ((value = fetch_chunk(request, k, &size, &entry, connfd, &whole, NULL)) == NULL) {
+        return whole;
+    }
+    *outcome = entry != NULL ? LOG_HIT : LOG_MISS;
+    head_end = http_parse_response_head(value, size, &resp);
+    length = resp.range_length;
+    if (head_end < 0 || !http_if_range_matches(request, value, head_end) ||
+        http_range_resolve(request, length, &first, &last) != 206 ||
+        (last / RANGE_CHUNK_SIZE > k && http_format_if_range(value, head_end, if_range, sizeof(if_range)) == 0) ||
+        (len = http_format_partial(value, head_end, first, last, length, head, MAXBUF)) == 0) {
+        if (entry != NULL) {
+            cache_release(entry);
+        } else {
+            slab_free(value, size);
+        }
+        return -1;
+    }
+
+    note_response(206, len + strlen(keep_alive ? keep_alive_hdr : close_hdr) + 2 + last - first + 1);
+    metrics_first_byte();
+    iov[0] = (struct iovec){head, len};
+    iov[1] = (struct iovec){(char *)(keep_alive ? keep_alive_hdr : close_hdr), 0};
+    iov[1].iov_len = strlen(iov[1].iov_base);
+    iov[2] = (struct iovec){"\r\n", 2};
+    iovcnt = 3;
+
+    // The head goes out with the first slice; a chunk that cannot be had
+    // midway cuts the response short
+    while (1) {
+        long long chunk_end = (k + 1) * RANGE_CHUNK_SIZE - 1 < last ? (k + 1) * RANGE_CHUNK_SIZE - 1 : last;
+
+        iov[iovcnt++] = (struct iovec){value + head_end + 2 + first - k * RANGE_CHUNK_SIZE, chunk_end - first + 1};
+        int rc = writev_full(connfd, iov, iovcnt);
+        if (entry != NULL) {
+            cache_release(entry);
+        } else {
+            slab_free(value, size);
+        }
+        if (rc < 0) {
+            return 0;
+        }
+        first = chunk_end + 1;
+        if (first > last) {
+            return keep_alive;
+        }
+
+        k++;
+        if ((value = fetch_chunk(request, k, &size, &entry, -1, &whole, if_range)) == NULL ||
+            (head_end = http_parse_response_head(value, size, &resp)) < 0 || resp.range_length != length) {
+            int changed = value == NULL ? errno == ESTALE : head_end >= 0;
+            if (value != NULL && entry != NULL) {
+                cache_release(entry);
+            } else if (value != NULL) {
+                slab_free(value, size);
+            }
+            for (long long i = k0; changed && i < k; i++) {
+                chunk_key(key, sizeof(key), request->uri, i);
+                cache_remove(key);
+            }
+            return 0;
+        }
+        if (entry == NULL) {
+            *outcome = LOG_MISS;
+        }
+        iovcnt = 0;
+    }
+}
+
+// Serves an object another connection is still fetching by tailing its
+// stream. Returns whether the client may send another request.
+int forward_flight_response(cache_flight *flight, int connfd, int keep_alive)
+{
+    char *p;
+    ssize_t n;
+    http_response resp;
+    struct iovec iov[3];
+    size_t off = flight->head_len;
+
+    // The head is published whole, in the first segment
+    cache_flight_peek(flight, 0, &p);
+    long head_end = http_parse_response_head(p, off, &resp);
+
+    keep_alive = keep_alive && http_response_is_framed(&resp);
+    iov[0] = (struct iovec){p, head_end};
+    iov[1] = (struct iovec){(char *)(keep_alive ? keep_alive_hdr : close_hdr), 0};
+    iov[1].iov_len = strlen(iov[1].iov_base);
+    iov[2] = (struct iovec){p + head_end, off - head_end};
+    metrics_first_byte();
+    if (writev_full(connfd, iov, 3) < 0) {
+        note_response(resp.status, 0);
+        return 0;
+    }
+
+    while ((n = cache_flight_peek(flight, off, &p)) > 0) {
+        if (rio_writen(connfd, p, n) < 0) {
+            break;
+        }
+        off += n;
+    }
+    note_response(resp.status, off);
+
+    // A client cut short can only tell from the connection closing
+    return n == 0 && keep_alive;
+}
+
+// Answers the request itself with status. Returns whether the client may
+// send another request.
+int forward_error(int connfd, int status, int keep_alive)
+{
+    char buf[MAXLINE];
+    size_t len = http_format_error(status, keep_alive, buf, MAXLINE);
+
+    note_response(status, len);
+    metrics_first_byte();
+    return rio_writen(connfd, buf, len) < 0 ? 0 : keep_alive;
+}
+
+// Notes the response the current request got, for its access record and
+// its metrics
+void note_response(int status, size_t bytes)
+{
+    log_response(status, bytes);
+    metrics_response(status, bytes);
+}
+
+// Waits up to KEEPALIVE_TIMEOUT seconds for the client's next request.
+// Pipelined requests are already buffered.
+int wait_for_request(http_parser *parser, int fd)
+{
+    struct pollfd pfd = {fd, POLLIN, 0};
+
+    return http_parser_pending(parser) || poll(&pfd, 1, KEEPALIVE_TIMEOUT * 1000) > 0;
+}
+
+// Serves requests on one client connection until either side ends it,
+// then closes it
+void serve(int connfd)
+{
+    http_parser parser;
+    http_request request;
+    int keep_alive = 1, nodelay = 1, rc;
+    struct timeval send_timeout = {CLIENT_SEND_TIMEOUT, 0};
+
+    // Each response goes out in as few writes as possible, so Nagle would
+    // only hold back the tail of one while the client delays its ACK
+    setsockopt(connfd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+    // A client that stops reading must not hold the thread forever
+    setsockopt(connfd, SOL_SOCKET, SO_SNDTIMEO, &send_timeout, sizeof(send_timeout));
+
+    // The first request is timed from the accept, later ones from their
+    // arrival
+    long long accepted = metrics_accept_time(connfd);
+
+    http_parser_init(&parser);
+    while (keep_alive && wait_for_request(&parser, connfd)) {
+        if ((rc = parse_request(&parser, connfd, &request)) < 0) {
+            break;
+        }
+        long long start = log_level >= LOG_ACCESS ? log_now_us() : 0;
+        metrics_request_begin(accepted);
+        accepted = 0;
+
+        // Nothing after a refused request can be trusted to be framed
+        if (rc > 0) {
+            forward_error(connfd, rc, 0);
+            log_access("-", LOG_MISS, start);
+            metrics_request_end(LOG_MISS);
+            break;
+        }
+        keep_alive = request.keep_alive;
+        log_outcome outcome;
+        int coalesced = 0;
+
+        // Check if request is in cache. Stale objects are revalidated with
+        // the origin. Of concurrent misses for the same object only the
+        // first goes upstream; the rest tail its response.
+        cache_flight *flight = NULL;
+        disk_segment *segment = NULL;
+        cache_entry *stale = NULL;
+        int streaming = 0, ranged = -1;
+        char *value;
+        size_t size;
+        time_t now = time(NULL), expires;
+        cache_entry *cached = cache_find(request.uri);
+        if (cached != NULL && cache_is_stale(cached, now)) {
+            stale = cached;
+            cached = NULL;
+        }
+        if (cached == NULL && stale == NULL) {
+            segment = disk_find(request.uri, &value, &size, &expires);
+
+            // A stale copy on disk is simply fetched again
+            if (segment != NULL && expires != 0 && now >= expires) {
+                disk_release(segment);
+                segment = NULL;
+            }
+        }
 
-    // Forward cached response to client
-    Rio_readinitb(&rio, connfd);
-    printf("%s", cached->value);
-    Rio_writen(connfd, cached->value, cached->size);
+        // Ranges of objects held neither whole nor stale come out of
+        // chunks, if the cache takes chunks and the origin serves them
+        if (cached == NULL && segment == NULL && stale == NULL && request.range && request.range_first >= 0 &&
+            !request.conditional && cache_max_object >= RANGE_CHUNK_SIZE + MAXBUF) {
+            ranged = forward_chunked_range(&request, connfd, keep_alive, &outcome);
+        }
+        if (cached == NULL && segment == NULL && ranged < 0) {
+            int leader;
+            flight = cache_flight_begin(request.uri, &leader);
+            if (!leader) {
+                coalesced = 1;
+                cached = cache_flight_wait(flight, &streaming);
+                if (!streaming) {
+                    flight = NULL;
+                }
+                if (stale != NULL) {
+                    cache_release(stale);
+                    stale = NULL;
+                }
+            }
+        }
+
+        if (ranged >= 0) {
+            keep_alive = ranged;
+        } else if (streaming) {
+            outcome = LOG_COALESCED;
+            keep_alive = forward_flight_response(flight, connfd, keep_alive);
+            cache_flight_leave(flight);
+        } else if (cached != NULL) {
+            outcome = coalesced ? LOG_COALESCED : LOG_HIT;
+            keep_alive = forward_cache_entry(cached, &request, connfd, keep_alive);
+            cache_release(cached);
+        } else if (segment != NULL) {
+            outcome = LOG_DISK_HIT;
+            keep_alive = forward_cached_range(value, size, &request, connfd, keep_alive);
+
+            // Disk hits small enough for memory move up a tier
+            if (size <= cache_max_object) {
+                char *copy = slab_alloc(size);
+                memcpy(copy, value, size);
+                cache_insert(request.uri, copy, size, expires);
+            }
+            disk_release(segment);
+        } else {
+            int clientfd, reused, err = 0;
+            char validators[MAXLINE];
+
+            outcome = LOG_MISS;
+
+            // Only a 304 to the proxy's own validators says the stale copy
+            // is still good
+            if (stale != NULL && (request.conditional ||
+                                  compress_validators(stale, validators, MAXLINE) == 0)) {
+                cache_release(stale);
+                stale = NULL;
+            }
+
+            // A pooled connection the server has meanwhile closed yields
+            // nothing; retry until a fresh connection answers
+            rc = -1;
+            do {
+                if ((clientfd = forward_request(&request, &reused, stale != NULL ? validators : NULL)) < 0) {
+                    err = errno;
+                    break;
+                }
+                rc = forward_response(&request, clientfd, connfd, &keep_alive, &flight, stale);
+                err = errno;
+                if (rc > 0) {
+                    upstream_put(request.hostname, request.port, clientfd);
+                } else {
+                    Close(clientfd);
+                }
+            } while (rc < 0 && reused);
+
+            // The client has seen nothing yet, so it can be told why
+            if (rc < 0) {
+                int timed_out = err == ETIMEDOUT || err == EAGAIN || err == EWOULDBLOCK;
+                keep_alive = forward_error(connfd, timed_out ? 504 : 502, keep_alive);
+            }
+            if (flight != NULL) {
+                cache_flight_end(flight, 0);
+            }
+            if (stale != NULL) {
+                cache_release(stale);
+            }
+        }
+        log_access(request.uri, outcome, start);
+        metrics_request_end(outcome);
+    }
+
+    Close(connfd);
 }
 
+// Thread per connection
 void *proxy_thread(void *vargp)
 {
     int connfd = *((int *)vargp);
     Pthread_detach(pthread_self());
     Free(vargp);
 
-    http_request request = parse_request(connfd);
+    serve(connfd);
+    return NULL;
+}
 
-    // Check if request is in cache
-    cache_entry *cached = cache_find(request.uri);
-    if (cached != NULL) {
-        forward_cached_response(cached, connfd);
-    } else {
-        int clientfd = forward_request(request);
-        forward_response(request.uri, clientfd, connfd);
+// Pool worker: serves connections taken from the shared buffer
+void *worker_thread(void *vargp)
+{
+    Pthread_detach(pthread_self());
+
+    while (1) {
+        serve(sbuf_remove(&sbuf));
     }
-    
-    Close(connfd);
+
     return NULL;
 }
 
 // ========================================================== //
 // ==================== Helper Functions ==================== //
 // ========================================================== //
-char* trim(char* str) {
-    while(isspace((unsigned char)*str)) str++;
-    
-    if(*str == 0)
-        return str;
 
-    char* end = str + strlen(str) - 1;
-    while(end > str && isspace((unsigned char)*end)) end--;
+// Parses a byte count with an optional K, M or G suffix. Returns 0 if invalid.
+size_t parse_size(const char *str)
+{
+    char *end;
+    unsigned long long size = strtoull(str, &end, 10);
 
-    *(end+1) = 0;
+    if (end == str) {
+        return 0;
+    }
+    switch (toupper((unsigned char)*end)) {
+    case 'G':
+        size <<= 10;
+        /* fall through */
+    case 'M':
+        size <<= 10;
+        /* fall through */
+    case 'K':
+        size <<= 10;
+        end++;
+    }
+    if (*end == 'B' || *end == 'b') {
+        end++;
+    }
 
-    return str;
+    return *end == '\0' ? (size_t)size : 0;
+}
+
+// Writes every iovec, like rio_writen() does for one buffer. Returns -1
+// if the peer is gone or stalled past its send timeout, 0 otherwise.
+int writev_full(int fd, struct iovec *iov, int iovcnt)
+{
+    while (iovcnt > 0) {
+        ssize_t n = writev(fd, iov, iovcnt);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+
+        // Skip what was written
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+
+    return 0;
 }
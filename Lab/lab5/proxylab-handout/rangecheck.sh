@@ -0,0 +1,72 @@
+#!/bin/bash
+#
+# rangecheck.sh - Checks byte ranges served out of the memory cache:
+#     caches home.html through the proxy, then asks for ranges of it,
+#     unsatisfiable ones several times in a row, and compares status,
+#     Content-Range and body against what the object holds.
+#
+#     usage: ./rangecheck.sh
+#
+ROUNDS=5
+OBJECT=home.html
+
+make -s proxy || exit 1
+if [ ! -x ./tiny/tiny ]; then
+    (cd ./tiny && make -s) || exit 1
+fi
+
+tiny_port=`./free-port.sh`
+(cd ./tiny && exec ./tiny ${tiny_port} &> /dev/null) &
+tiny_pid=$!
+proxy_port=`./free-port.sh`
+while [ "${proxy_port}" == "${tiny_port}" ]; do
+    proxy_port=`expr ${proxy_port} + 1`
+done
+./proxy -l off -o 1M ${proxy_port} &> /dev/null &
+proxy_pid=$!
+trap 'kill ${proxy_pid} ${tiny_pid} 2> /dev/null; rm -f .range-body .range-head' EXIT
+sleep 1
+
+url="http://localhost:${tiny_port}/${OBJECT}"
+length=`stat -c %s ./tiny/${OBJECT}`
+failures=0
+
+#
+# check - requests range $1 and expects status $2 and Content-Range $3,
+#     and for a 206 the bytes $4 to $5 of the object
+#
+function check {
+    curl -s --max-time 5 --proxy http://localhost:${proxy_port} -H "Range: bytes=$1" \
+        -D .range-head -o .range-body ${url}
+    status=`head -1 .range-head | cut -d' ' -f2`
+    range=`grep -i "^Content-Range:" .range-head | tr -d '\r' | cut -d' ' -f2-`
+    if [ "${status}" != "$2" ] || [ "${range}" != "$3" ]; then
+        echo "FAIL: bytes=$1 gave status '${status}', Content-Range '${range}'; expected $2, '$3'"
+        failures=$(( failures + 1 ))
+    elif [ "$2" == "206" ] && ! tail -c +$(( $4 + 1 )) ./tiny/${OBJECT} | head -c $(( $5 - $4 + 1 )) | \
+            cmp -s - .range-body; then
+        echo "FAIL: bytes=$1 body differs"
+        failures=$(( failures + 1 ))
+    fi
+}
+
+# The first request fills the cache
+curl -s --max-time 5 --proxy http://localhost:${proxy_port} -o /dev/null ${url}
+
+last=$(( length - 1 ))
+for i in `seq ${ROUNDS}`; do
+    check "${length}-" 416 "bytes */${length}"
+    check "200-300" 416 "bytes */${length}"
+    check "5000000-" 416 "bytes */${length}"
+    check "-0" 416 "bytes */${length}"
+    check "0-9" 206 "bytes 0-9/${length}" 0 9
+    check "10-" 206 "bytes 10-${last}/${length}" 10 ${last}
+    check "-5" 206 "bytes $(( length - 5 ))-${last}/${length}" $(( length - 5 )) ${last}
+    check "5-5000" 206 "bytes 5-${last}/${length}" 5 ${last}
+done
+
+if [ ${failures} -ne 0 ]; then
+    echo "rangecheck: ${failures} failures"
+    exit 1
+fi
+echo "rangecheck: all ranges served correctly"
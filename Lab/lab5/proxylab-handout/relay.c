@@ -0,0 +1,104 @@
+/*
+ * relay.c - Zero-copy relay between two descriptors
+ *
+ * Bytes move socket -> pipe -> socket with splice(), so the kernel hands
+ * pages along without copying them through user space. This file keeps
+ * clear of csapp.h, whose gai_error() clashes with _GNU_SOURCE.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "relay.h"
+
+int relay_splice_enabled = 1;
+
+// Helper functions
+static ssize_t relay_copy(int infd, int outfd, size_t count);
+
+// Moves count bytes, or everything up to EOF for RELAY_ALL, from infd to
+// outfd. Returns the number of bytes moved, or -1 on error.
+ssize_t relay(int infd, int outfd, size_t count)
+{
+    int pipefd[2];
+    ssize_t n, m, total = 0;
+
+    if (!relay_splice_enabled || pipe(pipefd) < 0) {
+        return relay_copy(infd, outfd, count);
+    }
+
+    // A larger pipe means fewer round trips; the default is fine too
+    fcntl(pipefd[1], F_SETPIPE_SZ, RELAY_PIPE_SIZE);
+
+    while (total < count) {
+        size_t want = count - total < RELAY_PIPE_SIZE ? count - total : RELAY_PIPE_SIZE;
+        if ((n = splice(infd, NULL, pipefd[1], NULL, want, SPLICE_F_MOVE)) == 0) {
+            break;
+        }
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            // Descriptors splice() cannot handle
+            if (errno == EINVAL && total == 0) {
+                close(pipefd[0]);
+                close(pipefd[1]);
+                return relay_copy(infd, outfd, count);
+            }
+            total = -1;
+            break;
+        }
+
+        // Drain the pipe into outfd
+        while (n > 0) {
+            if ((m = splice(pipefd[0], NULL, outfd, NULL, n, SPLICE_F_MOVE)) < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                total = -1;
+                goto done;
+            }
+            n -= m;
+            total += m;
+        }
+    }
+
+done:
+    close(pipefd[0]);
+    close(pipefd[1]);
+    return total;
+}
+
+// ========================================================== //
+// ==================== Helper Functions ==================== //
+// ========================================================== //
+static ssize_t relay_copy(int infd, int outfd, size_t count)
+{
+    char buf[RELAY_BUF_SIZE];
+    ssize_t n, m, total = 0;
+
+    while (total < count) {
+        size_t want = count - total < RELAY_BUF_SIZE ? count - total : RELAY_BUF_SIZE;
+        if ((n = read(infd, buf, want)) == 0) {
+            break;
+        }
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        for (char *p = buf; n > 0; p += m, n -= m) {
+            if ((m = write(outfd, p, n)) < 0) {
+                if (errno == EINTR) {
+                    m = 0;
+                    continue;
+                }
+                return -1;
+            }
+            total += m;
+        }
+    }
+
+    return total;
+}
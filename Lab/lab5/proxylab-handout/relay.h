@@ -0,0 +1,13 @@
+/* Bytes moved per splice() call; also the pipe size requested */
+#define RELAY_PIPE_SIZE (1 << 20)
+
+/* Buffer for the copying fallback */
+#define RELAY_BUF_SIZE 8192
+
+/* 0 forces the copying relay (PROXY_SPLICE=0) */
+extern int relay_splice_enabled;
+
+/* Relay everything up to EOF */
+#define RELAY_ALL ((size_t)-1)
+
+ssize_t relay(int infd, int outfd, size_t count);
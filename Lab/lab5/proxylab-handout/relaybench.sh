@@ -0,0 +1,38 @@
+#!/bin/bash
+#
+# relaybench.sh - Measures proxy throughput on large, uncacheable
+#     transfers with the zero-copy splice relay and with the copying
+#     relay (PROXY_SPLICE=0).
+#
+#     usage: ./relaybench.sh [size_mb] [requests]
+#
+SIZE_MB=${1:-256}
+REQUESTS=${2:-8}
+FILE="relaybench.bin"
+
+make -s proxy loadgen || exit 1
+
+tiny_port=`./free-port.sh`
+(cd ./tiny && exec ./tiny ${tiny_port} &> /dev/null) &
+tiny_pid=$!
+
+dd if=/dev/urandom of=./tiny/${FILE} bs=1M count=${SIZE_MB} status=none
+trap 'kill ${tiny_pid} 2> /dev/null; rm -f ./tiny/${FILE}' EXIT
+sleep 1
+
+for splice in 1 0; do
+    proxy_port=`./free-port.sh`
+    while [ "${proxy_port}" == "${tiny_port}" ]; do
+        proxy_port=`expr ${proxy_port} + 1`
+    done
+    PROXY_SPLICE=${splice} ./proxy ${proxy_port} &> /dev/null &
+    proxy_pid=$!
+    sleep 1
+
+    echo "*** PROXY_SPLICE=${splice}: ${REQUESTS} x ${SIZE_MB} MB"
+    ./loadgen -c 1 -n ${REQUESTS} localhost ${proxy_port} \
+        http://localhost:${tiny_port}/${FILE}
+
+    kill ${proxy_pid}
+    wait ${proxy_pid} 2> /dev/null
+done
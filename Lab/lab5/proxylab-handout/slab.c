@@ -0,0 +1,221 @@
+#include "csapp.h"
+#include "slab.h"
+
+slab_class classes[SLAB_CLASSES];
+
+// Helper functions
+static slab_class *class_of(size_t size);
+static void slab_refill(slab_class *cls);
+static void partial_push(slab_class *cls, slab *s);
+static void partial_unlink(slab_class *cls, slab *s);
+static size_t slab_header_size(size_t block_size);
+static void *large_map(size_t size);
+
+void slab_init()
+{
+    for (int i = 0; i < SLAB_CLASSES; i++) {
+        pthread_mutex_init(&classes[i].mutex, NULL);
+        classes[i].block_size = (size_t)SLAB_MIN_SIZE << i;
+        classes[i].partial = NULL;
+        classes[i].nempty = 0;
+        classes[i].free_list = NULL;
+        classes[i].free_bytes = 0;
+    }
+}
+
+// Blocks larger than SLAB_MAX_SIZE come straight from Malloc
+void *slab_alloc(size_t size)
+{
+    if (size > SLAB_MAX_SIZE) {
+        return Malloc(size);
+    }
+
+    slab_class *cls = class_of(size);
+    slab_block *block;
+
+    pthread_mutex_lock(&cls->mutex);
+    if (cls->block_size >= SLAB_LARGE_SIZE) {
+        if ((block = cls->free_list) != NULL) {
+            cls->free_list = block->next;
+            cls->free_bytes -= cls->block_size;
+        }
+        pthread_mutex_unlock(&cls->mutex);
+        return block != NULL ? block : large_map(cls->block_size);
+    }
+
+    if (cls->partial == NULL) {
+        slab_refill(cls);
+    }
+    slab *s = cls->partial;
+    if (s->nfree == s->nblocks) {
+        cls->nempty--;
+    }
+    block = s->free_list;
+    s->free_list = block->next;
+    if (--s->nfree == 0) {
+        partial_unlink(cls, s);
+    }
+    pthread_mutex_unlock(&cls->mutex);
+
+    return block;
+}
+
+// Moves the block only if new_size falls in a different class
+void *slab_realloc(void *ptr, size_t old_size, size_t new_size)
+{
+    if (old_size > SLAB_MAX_SIZE && new_size > SLAB_MAX_SIZE) {
+        return Realloc(ptr, new_size);
+    }
+    if (old_size <= SLAB_MAX_SIZE && new_size <= SLAB_MAX_SIZE
+            && class_of(old_size) == class_of(new_size)) {
+        return ptr;
+    }
+
+    void *new_ptr = slab_alloc(new_size);
+    memcpy(new_ptr, ptr, old_size < new_size ? old_size : new_size);
+    slab_free(ptr, old_size);
+
+    return new_ptr;
+}
+
+// size must be the size the block was allocated (or reallocated) with.
+// A slab whose blocks are all free is unmapped, unless it is the only
+// such slab of its class, which is kept so a class hovering at a slab
+// boundary does not map and unmap one per allocation.
+void slab_free(void *ptr, size_t size)
+{
+    if (size > SLAB_MAX_SIZE) {
+        Free(ptr);
+        return;
+    }
+
+    slab_class *cls = class_of(size);
+    slab_block *block = ptr;
+
+    pthread_mutex_lock(&cls->mutex);
+    if (cls->block_size >= SLAB_LARGE_SIZE) {
+        if (cls->free_bytes + cls->block_size > SLAB_LARGE_KEEP) {
+            pthread_mutex_unlock(&cls->mutex);
+            munmap(ptr, cls->block_size);
+            return;
+        }
+        block->next = cls->free_list;
+        cls->free_list = block;
+        cls->free_bytes += cls->block_size;
+        pthread_mutex_unlock(&cls->mutex);
+        return;
+    }
+
+    slab *s = (slab *)((size_t)ptr & ~(size_t)(SLAB_SIZE - 1));
+    block->next = s->free_list;
+    s->free_list = block;
+    if (s->nfree++ == 0) {
+        partial_push(cls, s);
+    }
+    if (s->nfree == s->nblocks) {
+        if (cls->nempty > 0) {
+            partial_unlink(cls, s);
+        } else {
+            cls->nempty++;
+            s = NULL;
+        }
+    } else {
+        s = NULL;
+    }
+    pthread_mutex_unlock(&cls->mutex);
+
+    if (s != NULL) {
+        munmap(s, SLAB_SIZE);
+    }
+}
+
+// Bytes a block of size bytes really takes: the whole block of its class
+size_t slab_charge(size_t size)
+{
+    return size > SLAB_MAX_SIZE ? size : class_of(size)->block_size;
+}
+
+// ========================================================== //
+// ==================== Helper Functions ==================== //
+// ========================================================== //
+static slab_class *class_of(size_t size)
+{
+    int i = 0;
+    while (((size_t)SLAB_MIN_SIZE << i) < size) {
+        i++;
+    }
+    return &classes[i];
+}
+
+// Maps a fresh slab, aligned to SLAB_SIZE, and carves it into blocks.
+// Requires the class mutex.
+static void slab_refill(slab_class *cls)
+{
+    char *map, *start;
+    size_t head;
+
+    // Twice the size is mapped so an aligned slab fits in it, and the
+    // rest is given back
+    if ((map = mmap(NULL, 2 * SLAB_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) ==
+        MAP_FAILED) {
+        unix_error("slab: mmap error");
+    }
+    start = (char *)(((size_t)map + SLAB_SIZE - 1) & ~(size_t)(SLAB_SIZE - 1));
+    if ((head = start - map) > 0) {
+        munmap(map, head);
+    }
+    if (SLAB_SIZE - head > 0) {
+        munmap(start + SLAB_SIZE, SLAB_SIZE - head);
+    }
+
+    slab *s = (slab *)start;
+    size_t offset = slab_header_size(cls->block_size);
+    s->free_list = NULL;
+    s->nblocks = s->nfree = (SLAB_SIZE - offset) / cls->block_size;
+    for (int i = s->nblocks - 1; i >= 0; i--) {
+        slab_block *block = (slab_block *)(start + offset + i * cls->block_size);
+        block->next = s->free_list;
+        s->free_list = block;
+    }
+    partial_push(cls, s);
+    cls->nempty++;
+}
+
+static void partial_push(slab_class *cls, slab *s)
+{
+    s->prev = NULL;
+    s->next = cls->partial;
+    if (cls->partial != NULL) {
+        cls->partial->prev = s;
+    }
+    cls->partial = s;
+}
+
+static void partial_unlink(slab_class *cls, slab *s)
+{
+    if (s->prev != NULL) {
+        s->prev->next = s->next;
+    } else {
+        cls->partial = s->next;
+    }
+    if (s->next != NULL) {
+        s->next->prev = s->prev;
+    }
+}
+
+// Large blocks are mapped one by one so freeing one returns its pages
+static void *large_map(size_t size)
+{
+    void *p;
+
+    if ((p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED) {
+        unix_error("slab: mmap error");
+    }
+    return p;
+}
+
+// The header takes whole blocks, so the blocks stay aligned to their size
+static size_t slab_header_size(size_t block_size)
+{
+    return (sizeof(slab) + block_size - 1) & ~(block_size - 1);
+}
@@ -0,0 +1,46 @@
+/* Size classes are powers of two from SLAB_MIN_SIZE to SLAB_MAX_SIZE */
+#define SLAB_MIN_SHIFT 6
+#define SLAB_MAX_SHIFT 20
+#define SLAB_MIN_SIZE (1 << SLAB_MIN_SHIFT)
+#define SLAB_MAX_SIZE (1 << SLAB_MAX_SHIFT)
+#define SLAB_CLASSES (SLAB_MAX_SHIFT - SLAB_MIN_SHIFT + 1)
+
+/* Bytes carved into blocks at a time. Slabs are aligned to their size,
+ * so a block finds its slab by masking its address. */
+#define SLAB_SIZE (64 * 1024)
+
+/* Blocks this large or larger are mapped one at a time instead of
+ * being carved from slabs */
+#define SLAB_LARGE_SIZE (8 * 1024)
+
+/* Free bytes each class of large blocks keeps for reuse; blocks freed
+ * past that go back to the system */
+#define SLAB_LARGE_KEEP (1024 * 1024)
+
+typedef struct slab_block {
+    struct slab_block *next;
+} slab_block;
+
+/* Starts every slab, ahead of its blocks */
+typedef struct slab {
+    slab_block *free_list;
+    int nfree;
+    int nblocks;
+    struct slab *prev;          // Among the slabs of its class with free blocks
+    struct slab *next;
+} slab;
+
+typedef struct slab_class {
+    pthread_mutex_t mutex;
+    size_t block_size;
+    slab *partial;              // Slabs with free blocks
+    int nempty;                 // Of those, how many are wholly free
+    slab_block *free_list;      // Large blocks kept for reuse
+    size_t free_bytes;
+} slab_class;
+
+void slab_init();
+void *slab_alloc(size_t size);
+void *slab_realloc(void *ptr, size_t old_size, size_t new_size);
+void slab_free(void *ptr, size_t size);
+size_t slab_charge(size_t size);
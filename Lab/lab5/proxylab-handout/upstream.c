@@ -0,0 +1,223 @@
+/*
+ * upstream.c - Pool of persistent upstream connections
+ *
+ * Connections whose last response left them reusable are kept per origin
+ * and handed to the next request for the same host and port, skipping
+ * name resolution and the TCP handshake.
+ */
+#include <stdatomic.h>
+#include "csapp.h"
+#include "cache.h"
+#include "slab.h"
+#include "dns.h"
+#include "upstream.h"
+
+int upstream_max_idle = UPSTREAM_MAX_IDLE;
+int upstream_timeout = UPSTREAM_TIMEOUT;
+
+static upstream_origin *origins[UPSTREAM_BUCKETS];
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Statistics
+static atomic_ulong upstream_connects, upstream_reuses, upstream_failures;
+static atomic_ulong upstream_requests, upstream_syscalls;
+static atomic_int upstream_idle;
+
+// Helper functions
+static upstream_origin **origin_slot(const char *key);
+static int upstream_alive(int fd);
+
+void upstream_init(int max_idle, int timeout)
+{
+    upstream_max_idle = max_idle;
+    upstream_timeout = timeout;
+}
+
+// Returns a connection to hostname:port, pooled if one is still usable.
+// *reused tells the caller whether the server may have dropped it.
+// Returns -1 if no connection could be opened, with errno ETIMEDOUT if
+// the origin did not answer in time. Reads and writes on the connection
+// fail with EAGAIN once the origin is silent for upstream_timeout seconds.
+int upstream_get(char *hostname, char *port, int *reused)
+{
+    char key[MAXLINE];
+    int fd;
+    time_t idle_since;
+    struct timeval timeout = {upstream_timeout, 0};
+
+    snprintf(key, MAXLINE, "%s:%s", hostname, port);
+
+    while (1) {
+        fd = -1;
+
+        pthread_mutex_lock(&pool_mutex);
+        upstream_origin **slot = origin_slot(key);
+        upstream_origin *origin = *slot;
+        if (origin != NULL) {
+            upstream_conn *conn = origin->idle;
+            origin->idle = conn->next;
+            fd = conn->fd;
+            idle_since = conn->idle_since;
+            slab_free(conn, sizeof(upstream_conn));
+
+            // Origins only exist while they have idle connections
+            if (--origin->nidle == 0) {
+                *slot = origin->next;
+                Free(origin->key);
+                Free(origin);
+            }
+        }
+        pthread_mutex_unlock(&pool_mutex);
+
+        if (fd < 0) {
+            break;
+        }
+        atomic_fetch_sub(&upstream_idle, 1);
+
+        if (time(NULL) - idle_since < UPSTREAM_IDLE_TIMEOUT && upstream_alive(fd)) {
+            atomic_fetch_add(&upstream_reuses, 1);
+            *reused = 1;
+            return fd;
+        }
+        Close(fd);
+    }
+
+    atomic_fetch_add(&upstream_connects, 1);
+    *reused = 0;
+    if ((fd = dns_connect(hostname, port, UPSTREAM_CONNECT_TIMEOUT * 1000)) < 0) {
+        atomic_fetch_add(&upstream_failures, 1);
+        return -1;
+    }
+    if (upstream_timeout > 0) {
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    }
+    return fd;
+}
+
+// Returns a connection whose last response was read completely
+void upstream_put(char *hostname, char *port, int fd)
+{
+    char key[MAXLINE];
+
+    snprintf(key, MAXLINE, "%s:%s", hostname, port);
+
+    pthread_mutex_lock(&pool_mutex);
+    upstream_origin **slot = origin_slot(key);
+    upstream_origin *origin = *slot;
+    if ((origin != NULL ? origin->nidle : 0) >= upstream_max_idle) {
+        pthread_mutex_unlock(&pool_mutex);
+        Close(fd);
+        return;
+    }
+
+    if (origin == NULL) {
+        origin = Malloc(sizeof(upstream_origin));
+        origin->key = strdup(key);
+        origin->idle = NULL;
+        origin->nidle = 0;
+        origin->next = NULL;
+        *slot = origin;
+    }
+
+    upstream_conn *conn = slab_alloc(sizeof(upstream_conn));
+    conn->fd = fd;
+    conn->idle_since = time(NULL);
+    conn->next = origin->idle;
+    origin->idle = conn;
+    origin->nidle++;
+    pthread_mutex_unlock(&pool_mutex);
+
+    atomic_fetch_add(&upstream_idle, 1);
+}
+
+// Writes iov in as few sendmsg() calls as the socket allows, usually one,
+// consuming iov. A pooled connection may have been closed by the server,
+// so this fails with -1 instead of raising SIGPIPE.
+int upstream_sendv(int fd, struct iovec *iov, int iovcnt)
+{
+    struct msghdr msg = {0};
+    struct iovec flat;
+    char buf[UPSTREAM_GATHER_MAX];
+    size_t len = 0;
+
+    atomic_fetch_add(&upstream_requests, 1);
+
+    // The kernel pays per slice, so small requests are cheaper to copy
+    for (int i = 0; i < iovcnt && len <= UPSTREAM_GATHER_MAX; i++) {
+        len += iov[i].iov_len;
+    }
+    if (len <= UPSTREAM_GATHER_MAX) {
+        len = 0;
+        for (int i = 0; i < iovcnt; i++) {
+            memcpy(buf + len, iov[i].iov_base, iov[i].iov_len);
+            len += iov[i].iov_len;
+        }
+        flat = (struct iovec){buf, len};
+        iov = &flat;
+        iovcnt = 1;
+    }
+
+    while (iovcnt > 0) {
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt;
+        ssize_t n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        atomic_fetch_add(&upstream_syscalls, 1);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+
+        // Skip what was written
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+void upstream_stats(FILE *fp)
+{
+    unsigned long requests = atomic_load(&upstream_requests);
+    unsigned long syscalls = atomic_load(&upstream_syscalls);
+
+    fprintf(fp, "upstream: max_idle=%d idle=%d connects=%lu failures=%lu reuses=%lu requests=%lu "
+            "send_syscalls=%.2f/request\n",
+            upstream_max_idle, atomic_load(&upstream_idle), atomic_load(&upstream_connects),
+            atomic_load(&upstream_failures), atomic_load(&upstream_reuses),
+            requests, requests > 0 ? (double)syscalls / requests : 0.0);
+}
+
+// ========================================================== //
+// ==================== Helper Functions ==================== //
+// ========================================================== //
+
+// Returns the link pointing at key's origin, or at the NULL ending its
+// bucket. Requires pool_mutex.
+static upstream_origin **origin_slot(const char *key)
+{
+    upstream_origin **slot = &origins[cache_hash(key) & (UPSTREAM_BUCKETS - 1)];
+
+    while (*slot != NULL && strcmp((*slot)->key, key) != 0) {
+        slot = &(*slot)->next;
+    }
+    return slot;
+}
+
+// An idle connection is usable if the server has neither closed it nor
+// sent anything unsolicited
+static int upstream_alive(int fd)
+{
+    char c;
+    ssize_t n = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+
+    return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
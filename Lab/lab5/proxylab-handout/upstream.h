@@ -0,0 +1,39 @@
+/* Idle connections kept per origin by default (0 disables pooling) */
+#define UPSTREAM_MAX_IDLE 8
+
+/* Seconds an idle connection stays eligible for reuse */
+#define UPSTREAM_IDLE_TIMEOUT 30
+
+/* Seconds allowed for resolving and connecting to an origin */
+#define UPSTREAM_CONNECT_TIMEOUT 5
+
+/* Seconds an origin may go silent while a response is awaited, by default */
+#define UPSTREAM_TIMEOUT 30
+
+#define UPSTREAM_BUCKETS 64
+
+/* Requests up to this size are copied into one buffer and sent; larger
+ * ones go to the kernel as slices */
+#define UPSTREAM_GATHER_MAX MAXBUF
+
+typedef struct upstream_conn {
+    int fd;
+    time_t idle_since;
+    struct upstream_conn *next;
+} upstream_conn;
+
+typedef struct upstream_origin {
+    char *key;                  // "hostname:port"
+    upstream_conn *idle;        // Most recently returned first
+    int nidle;
+    struct upstream_origin *next;
+} upstream_origin;
+
+extern int upstream_max_idle;
+extern int upstream_timeout;
+
+void upstream_init(int max_idle, int timeout);
+int upstream_get(char *hostname, char *port, int *reused);
+void upstream_put(char *hostname, char *port, int fd);
+int upstream_sendv(int fd, struct iovec *iov, int iovcnt);
+void upstream_stats(FILE *fp);